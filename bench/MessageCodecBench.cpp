@@ -0,0 +1,112 @@
+// Peer wire codec throughput: the string-based codec the client used to have
+// against the allocation-free Message codec, on the message mix of a
+// download (kRequest out, kPiece and kHave in).
+
+#include "net/Message.hpp"
+#include "utils/byte_tools.hpp"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+    constexpr size_t kIterations = 2'000'000;
+    constexpr size_t kBlockSize = 1 << 14;
+
+    // The previous codec, kept verbatim as the baseline.
+    struct LegacyMessage {
+        MessageId id;
+        size_t messageLength;
+        std::string payload;
+
+        static LegacyMessage Parse(const std::string& message_string) {
+            size_t length = utils::BytesToInt(message_string.substr(0, 4));
+            if (length == 0) {
+                return { MessageId(10), 0, "" };
+            }
+
+            uint8_t id = uint8_t((unsigned char) message_string[4]);
+            std::string payload;
+            if (id > 3) {
+                payload = message_string.substr(5);
+            }
+            return { MessageId(id), length, payload };
+        }
+
+        static LegacyMessage Init(MessageId id, const std::string& payload) {
+            return { id, payload.size() + 1, payload };
+        }
+
+        std::string ToString() const {
+            std::string message_id;
+            unsigned char ch = static_cast<uint8_t>(id) & 0xFF;
+            message_id += ch;
+            return utils::IntToBytes(messageLength) + message_id + payload;
+        }
+    };
+
+    template <typename Body>
+    void Run(const char* name, Body body) {
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = 0;
+        for (size_t i = 0; i < kIterations; ++i) {
+            checksum += body(i);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << name << ": " << static_cast<size_t>(kIterations / seconds)
+                  << " messages/s (checksum " << checksum << ")" << std::endl;
+    }
+
+    std::string MakePieceFrame() {
+        std::string frame(Message::kPieceHeaderSize + kBlockSize, 'x');
+        Message::EncodePieceHeader(7, 3 * kBlockSize, kBlockSize, frame.data());
+        return frame;
+    }
+}
+
+int main() {
+    const std::string piece_frame = MakePieceFrame();
+    char have_frame[Message::kHaveSize];
+    Message::Encode(HaveMessage{42}, have_frame);
+    const std::string have_string(have_frame, sizeof have_frame);
+
+    std::cout << "Encode kRequest" << std::endl;
+    Run("legacy", [](size_t i) {
+        std::string payload;
+        payload += utils::IntToBytes(static_cast<uint32_t>(i));
+        payload += utils::IntToBytes(0);
+        payload += utils::IntToBytes(kBlockSize);
+        return LegacyMessage::Init(MessageId::kRequest, payload).ToString().size();
+    });
+    Run("codec ", [](size_t i) {
+        char frame[Message::kRequestSize];
+        RequestMessage request{static_cast<uint32_t>(i), 0, kBlockSize};
+        size_t size = Message::Encode(MessageId::kRequest, request, frame);
+        return size + static_cast<unsigned char>(frame[8]);
+    });
+
+    std::cout << "Decode kHave" << std::endl;
+    Run("legacy", [&](size_t) {
+        LegacyMessage message = LegacyMessage::Parse(have_string);
+        return static_cast<size_t>(utils::BytesToInt(message.payload.substr(0, 4)));
+    });
+    Run("codec ", [&](size_t) {
+        HaveMessage have{};
+        Message::Parse(have_string).Decode(have);
+        return static_cast<size_t>(have.piece_index);
+    });
+
+    std::cout << "Decode kPiece (16 KiB block, block left in place)" << std::endl;
+    Run("legacy", [&](size_t) {
+        LegacyMessage message = LegacyMessage::Parse(piece_frame);
+        size_t offset = utils::BytesToInt(message.payload.substr(4, 4));
+        std::string block = message.payload.substr(8);
+        return offset + block.size();
+    });
+    Run("codec ", [&](size_t) {
+        PieceMessage piece{};
+        Message::Parse(piece_frame).Decode(piece);
+        return piece.offset + piece.block.size();
+    });
+}
@@ -0,0 +1,126 @@
+// Cost of assembling a downloaded piece for hashing and writing: the
+// per-block std::string storage Piece used to have, which concatenated the
+// blocks once for the hash and again for the write, against blocks copied
+// into one pooled buffer (both including the SHA-1). Then the latency from
+// the last block arriving to the piece being verified: hashing the whole
+// piece at that point against the incremental hash, which only has the last
+// block left.
+
+#include "core/Piece.hpp"
+#include "utils/byte_tools.hpp"
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+    constexpr size_t kBytesPerRun = size_t(1) << 30;
+
+    // The previous block storage, kept as the baseline.
+    struct LegacyPiece {
+        size_t length;
+        std::vector<std::string> blocks;
+
+        explicit LegacyPiece(size_t length) : length(length), blocks((length + kBlockSize - 1) / kBlockSize) {}
+
+        void SaveBlock(size_t offset, std::string data) {
+            blocks[offset / kBlockSize] = std::move(data);
+        }
+
+        std::string GetData() const {
+            std::string result;
+            result.reserve(length);
+            for (const std::string& block : blocks) {
+                result += block;
+            }
+            return result;
+        }
+    };
+
+    template <typename Body>
+    void Run(const char* name, size_t piece_length, Body body) {
+        size_t pieces = kBytesPerRun / piece_length;
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = 0;
+        for (size_t i = 0; i < pieces; ++i) {
+            checksum += body(i);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << name << ": " << static_cast<size_t>(kBytesPerRun / seconds / (1 << 20))
+                  << " MiB/s (checksum " << checksum << ")" << std::endl;
+    }
+}
+
+namespace {
+    constexpr size_t kCompletionSamples = 16;
+
+    void MeasureCompletion(size_t piece_length, const std::string& block,
+                           const std::shared_ptr<utils::BufferPool>& pool) {
+        using Clock = std::chrono::steady_clock;
+        Clock::duration whole{}, incremental{};
+        std::string hash(piece_length, 'x');
+        hash = utils::CalculateSHA1(hash);
+
+        for (size_t i = 0; i < kCompletionSamples; ++i) {
+            Piece piece(i, piece_length, hash, pool);
+            for (size_t offset = 0; offset + kBlockSize < piece_length; offset += kBlockSize) {
+                piece.SaveBlock(offset, block);
+            }
+            piece.HashRetrievedBlocks(); // the hasher pool keeping up with the download
+
+            auto start = Clock::now();
+            piece.SaveBlock(piece_length - kBlockSize, block);
+            piece.HashRetrievedBlocks();
+            if (!piece.HashMatches()) {
+                std::cerr << "incremental hash mismatch" << std::endl;
+            }
+            incremental += Clock::now() - start;
+
+            start = Clock::now();
+            if (utils::CalculateSHA1(piece.GetData()) != hash) {
+                std::cerr << "whole-piece hash mismatch" << std::endl;
+            }
+            whole += Clock::now() - start;
+        }
+
+        auto microseconds = [](Clock::duration total) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(total).count() / kCompletionSamples;
+        };
+        std::cout << "  last block to verified: whole-piece hash " << microseconds(whole)
+                  << " us, incremental " << microseconds(incremental) << " us" << std::endl;
+    }
+}
+
+int main() {
+    const std::string block(kBlockSize, 'x');
+
+    for (size_t piece_length : {size_t(4) << 20, size_t(16) << 20}) {
+        std::cout << (piece_length >> 20) << " MiB pieces" << std::endl;
+
+        Run("legacy", piece_length, [&](size_t) {
+            LegacyPiece piece(piece_length);
+            for (size_t offset = 0; offset < piece_length; offset += kBlockSize) {
+                piece.SaveBlock(offset, block); // the receive path made a std::string per block
+            }
+            std::string for_hash = piece.GetData();
+            std::string for_write = piece.GetData();
+            return utils::CalculateSHA1(for_hash).size() + static_cast<size_t>(for_write.back());
+        });
+
+        auto pool = utils::BufferPool::Create(piece_length, 4);
+        Run("pooled", piece_length, [&](size_t i) {
+            Piece piece(i, piece_length, std::string(20, '\0'), pool);
+            for (size_t offset = 0; offset < piece_length; offset += kBlockSize) {
+                piece.SaveBlock(offset, block);
+            }
+            piece.HashRetrievedBlocks();
+            std::string_view data = piece.GetData();
+            size_t result = piece.GetDataHash().size() + static_cast<size_t>(data.back());
+            piece.ReleaseData();
+            return result;
+        });
+        std::cout << "  pooled buffers allocated: " << pool->AllocationCount() << std::endl;
+
+        MeasureCompletion(piece_length, block, pool);
+    }
+}
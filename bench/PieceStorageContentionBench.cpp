@@ -0,0 +1,129 @@
+// Lock contention on the PieceStorage work queue: a few worker threads, each
+// standing in for an event loop, drive a couple of hundred simulated peers
+// through the pick -> save block -> PieceProcessed cycle the real peers go
+// through, once with a single shard (every worker on one lock) and once with
+// one shard per worker.
+//
+// usage: piece-storage-contention-bench [workers] [peers] [pieces]
+
+#include "core/PieceStorage.hpp"
+#include "utils/byte_tools.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    constexpr size_t kPieceLength = 1 << 14; // one block per piece keeps the disk out of the way
+    constexpr double kPeerHasPiece = 0.6;
+
+    struct Swarm {
+        TorrentFile torrent_file;
+        std::string data;
+        std::vector<PeerPiecesAvailability> peers;
+    };
+
+    Swarm MakeSwarm(size_t peer_count, size_t seed_count, size_t piece_count) {
+        Swarm swarm;
+        std::mt19937 random(42);
+        swarm.data.resize(piece_count * kPieceLength);
+        for (char& byte : swarm.data) {
+            byte = static_cast<char>(random());
+        }
+
+        TorrentFile& torrent_file = swarm.torrent_file;
+        torrent_file.name = "piece-storage-bench.bin";
+        torrent_file.piece_length = kPieceLength;
+        torrent_file.length = swarm.data.size();
+        for (size_t i = 0; i < piece_count; ++i) {
+            torrent_file.piece_hashes.push_back(
+                utils::CalculateSHA1(swarm.data.substr(i * kPieceLength, kPieceLength)));
+        }
+
+        // Every worker's first peer is a seed, so each worker can finish on
+        // its own; the rest have a random share of the pieces.
+        std::bernoulli_distribution has_piece(kPeerHasPiece);
+        for (size_t p = 0; p < peer_count; ++p) {
+            std::string bitfield((piece_count + 7) >> 3, '\0');
+            for (size_t i = 0; i < piece_count; ++i) {
+                if (p < seed_count || has_piece(random)) {
+                    bitfield[i >> 3] |= static_cast<char>(1 << (7 - (i & 7)));
+                }
+            }
+            swarm.peers.emplace_back(bitfield, bitfield.size());
+        }
+        return swarm;
+    }
+
+    void RunWorker(PieceStorage& storage, const Swarm& swarm, size_t worker_index, size_t worker_count) {
+        std::vector<const PeerPiecesAvailability*> peers;
+        for (size_t p = worker_index; p < swarm.peers.size(); p += worker_count) {
+            peers.push_back(&swarm.peers[p]);
+            storage.AddPeerAvailability(swarm.peers[p]);
+        }
+
+        while (!storage.QueueIsEmpty()) {
+            for (const PeerPiecesAvailability* peer : peers) {
+                PiecePtr piece = storage.GetNextPieceToDownload(*peer, worker_index);
+                if (!piece) {
+                    continue;
+                }
+                piece->SaveBlock(0, swarm.data.substr(piece->GetIndex() * kPieceLength, piece->GetLength()));
+                storage.PieceProcessed(piece);
+            }
+        }
+    }
+
+    void Run(const Swarm& swarm, size_t worker_count, size_t shard_count) {
+        std::filesystem::path directory = std::filesystem::temp_directory_path();
+        PieceStorageOptions options;
+        options.shard_count = shard_count;
+        PieceStorage storage(swarm.torrent_file, directory, options);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < worker_count; ++i) {
+            workers.emplace_back(RunWorker, std::ref(storage), std::cref(swarm), i, worker_count);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        storage.CloseOutputFile(); // waits for the hasher pool
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::filesystem::remove(directory / swarm.torrent_file.name);
+
+        PieceStorage::QueueStats stats = storage.GetQueueStats();
+        std::cerr << "  " << shard_count << " shard(s): " << seconds << " s, "
+                  << static_cast<size_t>(stats.picks / seconds) << " picks/s, "
+                  << stats.contended_acquisitions << "/" << stats.lock_acquisitions
+                  << " queue lock acquisitions contended ("
+                  << 100.0 * stats.contended_acquisitions / stats.lock_acquisitions << "%), "
+                  << stats.stolen_picks << " stolen picks"
+                  << (storage.IsDownloadComplete() ? "" : " INCOMPLETE") << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t worker_count = argc > 1 ? std::stoul(argv[1]) : 4;
+    size_t peer_count = argc > 2 ? std::stoul(argv[2]) : 256;
+    size_t piece_count = argc > 3 ? std::stoul(argv[3]) : 8192;
+
+    Swarm swarm = MakeSwarm(std::max(peer_count, worker_count), worker_count, piece_count);
+
+    // PieceStorage logs every saved piece on stdout.
+    std::ostringstream discarded;
+    std::streambuf* stdout_buffer = std::cout.rdbuf(discarded.rdbuf());
+
+    std::cerr << worker_count << " workers, " << peer_count << " peers, " << piece_count
+              << " pieces (" << std::thread::hardware_concurrency() << " cores)" << std::endl;
+    Run(swarm, worker_count, 1);
+    Run(swarm, worker_count, worker_count);
+
+    std::cout.rdbuf(stdout_buffer);
+}
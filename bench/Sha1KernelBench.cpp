@@ -0,0 +1,79 @@
+// Single-core SHA-1 throughput of every kernel this CPU supports, hashing a
+// batch of independent pieces the way a recheck does, against OpenSSL one
+// piece at a time. Each kernel's digests are checked against OpenSSL's.
+//
+// usage: sha1-kernel-bench [piece KiB] [pieces]
+
+#include "utils/Sha1Kernels.hpp"
+#include "utils/byte_tools.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    constexpr size_t kBytesPerRun = size_t(2) << 30;
+
+    template <typename Body>
+    void Run(const std::string& name, size_t batch_bytes, Body body) {
+        size_t rounds = std::max<size_t>(1, kBytesPerRun / batch_bytes);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            body();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "  " << name << ": " << rounds * batch_bytes / seconds / 1e9 << " GB/s" << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t piece_length = (argc > 1 ? std::stoul(argv[1]) : 256) << 10;
+    size_t piece_count = argc > 2 ? std::stoul(argv[2]) : 64;
+
+    std::mt19937 random(42);
+    std::string data(piece_length * piece_count, '\0');
+    for (char& byte : data) {
+        byte = static_cast<char>(random());
+    }
+    std::vector<std::string_view> pieces;
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < piece_count; ++i) {
+        // Uneven lengths, like a torrent's last piece, exercise the lane refill.
+        size_t length = piece_length - (i % 3 == 2 ? 1 + i * 37 % piece_length : 0);
+        pieces.push_back(std::string_view(data).substr(i * piece_length, length));
+        expected.push_back(utils::CalculateSHA1(pieces.back()));
+    }
+    size_t batch_bytes = 0;
+    for (std::string_view piece : pieces) {
+        batch_bytes += piece.size();
+    }
+
+    std::cout << piece_count << " pieces of up to " << (piece_length >> 10) << " KiB, kernel picked for the batch "
+              << utils::GetSha1KernelName(utils::GetBestSha1Kernel(piece_count)) << std::endl;
+
+    Run("openssl", batch_bytes, [&] {
+        for (std::string_view piece : pieces) {
+            utils::CalculateSHA1(piece);
+        }
+    });
+
+    std::vector<std::string> digests(piece_count);
+    for (utils::Sha1Kernel kernel : {utils::Sha1Kernel::kScalar, utils::Sha1Kernel::kShaNi,
+                                     utils::Sha1Kernel::kAvx2, utils::Sha1Kernel::kAvx512}) {
+        std::string name = utils::GetSha1KernelName(kernel);
+        if (!utils::IsSha1KernelSupported(kernel)) {
+            std::cout << "  " << name << ": not supported" << std::endl;
+            continue;
+        }
+        utils::CalculateSHA1Many(kernel, pieces.data(), pieces.size(), digests.data());
+        if (digests != expected) {
+            std::cout << "  " << name << ": DIGEST MISMATCH" << std::endl;
+            continue;
+        }
+        Run(name, batch_bytes, [&] {
+            utils::CalculateSHA1Many(kernel, pieces.data(), pieces.size(), digests.data());
+        });
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "core/FileSet.hpp"
+#include "core/StorageBackend.hpp"
+
+// Writes pieces with O_DIRECT, straight from the page-aligned pooled piece
+// buffers to the device, so a download of tens of GB does not push other
+// services' data out of the page cache. The file offset, the buffer
+// address and the length of a direct write must all be multiples of the
+// file's direct I/O alignment (statx STATX_DIOALIGN, or the page size).
+// Each file segment of a write is cut at offsets aligned to that and to
+// the page size, so buffered and direct writes never share a page:
+// - the aligned middle goes out directly, copied to an aligned buffer
+//   first if its memory is not aligned;
+// - the unaligned head and tail, e.g. the end of the final piece or of a
+//   file in a multi-file torrent, go through a second, buffered descriptor.
+// Runs of adjacent pieces from the write-back cache go out as one pwritev
+// per file, so the cache size sets how large the device's writes get.
+class DirectStorage : public StorageBackend {
+public:
+    DirectStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files);
+
+    const char* GetName() const override;
+    void Write(uint64_t offset, std::string_view data, Callback on_complete) override;
+    void WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                       Callback on_complete) override;
+    void Flush() override;
+    void Sync() override; // fdatasync
+
+    size_t GetAlignment() const;
+
+private:
+    bool WriteSpan(size_t file_index, uint64_t file_offset, const std::vector<std::string_view>& parts);
+    bool WriteDirect(size_t file_index, uint64_t file_offset, const std::vector<std::string_view>& parts);
+    bool WriteBuffered(size_t file_index, uint64_t file_offset, const std::vector<std::string_view>& parts);
+
+    FileSet direct_files;
+    FileSet buffered_files;
+    size_t alignment;
+    size_t split_alignment; // where writes are cut: alignment, at least a page
+};
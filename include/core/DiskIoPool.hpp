@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that write verified pieces to the storage backend, so a slow
+// disk stalls neither the hasher threads nor the event loops. Jobs come off
+// one shared queue in submission order; a piece is written by one job, so
+// no ordering between jobs is needed. The queue is not bounded here:
+// PieceStorage's memory budget counts the pieces waiting in it and stops
+// handing out new ones while they pile up.
+class DiskIoPool {
+public:
+    using Job = std::function<void()>;
+
+    explicit DiskIoPool(size_t thread_count = DefaultThreadCount());
+    ~DiskIoPool(); // runs the jobs still queued, then joins
+
+    DiskIoPool(const DiskIoPool&) = delete;
+    DiskIoPool& operator=(const DiskIoPool&) = delete;
+
+    void Submit(Job job);
+    // Waits until every job submitted so far has run.
+    void Drain();
+    // Jobs queued or running.
+    size_t QueueDepth() const;
+    size_t ThreadCount() const;
+
+    static size_t DefaultThreadCount();
+
+private:
+    void Run();
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable has_work;
+    std::condition_variable is_idle;
+    std::deque<Job> queue;
+    std::atomic<size_t> queue_depth = 0;
+    bool is_stopped = false;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "core/TorrentFile.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How eagerly a file, or a piece, is downloaded. Waiting pieces are picked
+// from the highest priority down, rarest first within a priority.
+enum class DownloadPriority : uint8_t {
+    kSkip, // not downloaded; the file is not even created
+    kLow,
+    kNormal,
+    kHigh,
+};
+
+constexpr size_t kDownloadPriorityCount = 4;
+
+const char* GetDownloadPriorityName(DownloadPriority priority);
+// "skip", "low", "normal" or "high"; throws std::invalid_argument otherwise.
+DownloadPriority ParseDownloadPriority(const std::string& name);
+
+// A `<files>=<priority>` command line setting. The files are "*" or a
+// comma-separated list of indices and index ranges, e.g. "0,4-7".
+struct FilePriorityRule {
+    std::vector<std::pair<size_t, size_t>> ranges; // first and last file index
+    DownloadPriority priority;
+};
+
+// Throws std::invalid_argument on a malformed rule.
+FilePriorityRule ParseFilePriorityRule(const std::string& rule);
+
+// The priority of every file: kNormal, unless a rule covers the file; a
+// later rule overrides an earlier one. Throws std::invalid_argument if a
+// rule names a file the torrent does not have.
+std::vector<DownloadPriority> ResolveFilePriorities(const std::vector<FilePriorityRule>& rules, size_t file_count);
+
+// The priority of every piece: the highest of the non-empty files it
+// overlaps. A piece shared by a skipped and a wanted file is downloaded
+// whole, since it can only be verified whole; only pieces that lie
+// entirely in skipped files are kSkip.
+std::vector<DownloadPriority> GetPiecePriorities(const std::vector<TorrentFile::File>& files,
+                                                 const std::vector<DownloadPriority>& file_priorities,
+                                                 size_t piece_length, size_t piece_count);
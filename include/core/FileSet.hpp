@@ -0,0 +1,70 @@
+#pragma once
+
+#include "core/TorrentFile.hpp"
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Where a byte range of the torrent lands: `length` bytes at `file_offset`
+// of file `file_index`, which are bytes [torrent_offset, torrent_offset +
+// length) of the payload.
+struct FileSpan {
+    size_t file_index;
+    uint64_t file_offset;
+    uint64_t torrent_offset;
+    uint64_t length;
+};
+
+// The output files of a torrent seen as one byte stream. The start offsets
+// of the non-empty files are kept sorted, so the files a piece touches are
+// found with one binary search however many files there are. Descriptors
+// are opened the first time a file is written and stay open until the
+// FileSet goes away; a torrent of thousands of files only opens those its
+// pieces reach.
+class FileSet {
+public:
+    // Files are opened with `open_flags` | O_CLOEXEC; they must exist.
+    FileSet(const std::filesystem::path& directory, std::vector<TorrentFile::File> files,
+            int open_flags = O_WRONLY);
+    ~FileSet();
+
+    FileSet(const FileSet&) = delete;
+    FileSet& operator=(const FileSet&) = delete;
+
+    size_t GetFileCount() const;
+    const std::filesystem::path& GetPath(size_t file_index) const; // under the directory
+    uint64_t GetLength(size_t file_index) const;
+    uint64_t GetTotalLength() const;
+
+    // Appends the spans covering [offset, offset + length), in order. The
+    // files need not cover the whole payload (skipped files are left out of
+    // the set); bytes that fall in no file are left out.
+    void Map(uint64_t offset, uint64_t length, std::vector<FileSpan>& spans) const;
+
+    // The file's descriptor, opened on first use. Thread-safe; throws
+    // std::runtime_error if the file cannot be opened.
+    int GetDescriptor(size_t file_index);
+    // Runs `visit` on every descriptor opened so far.
+    void ForEachOpenDescriptor(const std::function<void(size_t file_index, int fd)>& visit) const;
+
+private:
+    struct Entry {
+        std::filesystem::path path;
+        uint64_t offset;
+        uint64_t length;
+        std::atomic<int> fd{-1};
+    };
+
+    std::unique_ptr<Entry[]> entries;
+    size_t file_count;
+    uint64_t total_length = 0;
+    int open_flags;
+    std::vector<uint64_t> span_starts; // torrent offsets of the non-empty files, ascending
+    std::vector<size_t> span_files;    // their file indices
+    std::mutex open_mutex;
+};
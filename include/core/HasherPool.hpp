@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that hash pieces (and hand verified ones on to the disk) so the
+// event loop threads only copy blocks. Jobs with the same key run on the
+// same thread in submission order, so the work queued for one piece never
+// runs concurrently with itself.
+class HasherPool {
+public:
+    using Job = std::function<void()>;
+
+    explicit HasherPool(size_t thread_count = DefaultThreadCount());
+    ~HasherPool(); // runs the jobs still queued, then joins
+
+    HasherPool(const HasherPool&) = delete;
+    HasherPool& operator=(const HasherPool&) = delete;
+
+    void Submit(size_t key, Job job);
+    void Drain();
+    // Jobs queued or running.
+    size_t QueueDepth() const;
+    size_t ThreadCount() const;
+
+    static size_t DefaultThreadCount();
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable has_work;
+        std::deque<Job> queue;
+        bool is_stopped = false;
+    };
+
+    void Run(Worker& worker);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> queue_depth = 0;
+    std::mutex idle_mutex;
+    std::condition_variable is_idle;
+};
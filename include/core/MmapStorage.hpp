@@ -0,0 +1,36 @@
+#pragma once
+
+#include "core/FileSet.hpp"
+#include "core/StorageBackend.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+// Maps each output file shared, the first time a piece reaches it, and
+// copies verified pieces straight from their buffers to their offsets in
+// the mappings: no stream buffer, no lock, no write syscall. Right after
+// the copy, writeback of just that range is started (sync_file_range,
+// which is what msync(MS_ASYNC) no longer does on Linux), so dirty pages
+// do not pile up until the kernel's own flusher gets to them; Sync waits
+// for the rest with msync(MS_SYNC).
+//
+// A file's blocks are reserved with fallocate before it is mapped: a page
+// fault that needs a block the disk cannot provide would be a SIGBUS, not
+// an error.
+class MmapStorage : public StorageBackend {
+public:
+    MmapStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files);
+    ~MmapStorage() override;
+
+    const char* GetName() const override;
+    void Write(uint64_t offset, std::string_view data, Callback on_complete) override;
+    void Flush() override;
+    void Sync() override;
+
+private:
+    char* GetMapping(size_t file_index); // throws std::runtime_error
+
+    FileSet files;
+    std::unique_ptr<std::atomic<char*>[]> mappings;
+    std::mutex map_mutex;
+};
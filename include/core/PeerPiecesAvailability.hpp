@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// The pieces one peer has announced, as the raw kBitField bitfield.
+class PeerPiecesAvailability {
+public:
+    PeerPiecesAvailability() = default;
+    explicit PeerPiecesAvailability(std::string bitfield, size_t size);
+    bool IsPieceAvailable(size_t piece_index) const;
+    void SetPieceAvailability(size_t piece_index);
+    size_t Size() const;
+
+private:
+    std::string bitfield;
+    size_t size = 0;
+};
@@ -1,8 +1,14 @@
 #pragma once
 
+#include "utils/BufferPool.hpp"
+#include "utils/Sha1.hpp"
+#include <condition_variable>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
+#include <mutex>
 
 constexpr size_t kBlockSize = 1 << 14; // 16KB
 
@@ -17,22 +23,58 @@ struct Block {
     size_t offset;
     size_t length;
     Status status;
-    std::string data;
+    size_t request_count = 0; // connections with a request for it outstanding
 };
 
+// Block bookkeeping for one piece. Blocks are copied straight to their
+// offset in one contiguous buffer taken from the pool when the first block
+// arrives and returned by Reset/ReleaseData. The SHA-1 is computed by
+// HashRetrievedBlocks, on a hasher thread, as the contiguous prefix of
+// retrieved blocks grows; a block that arrives ahead of the prefix waits in
+// the buffer until the gap is filled, so at completion only the last
+// blocks are left to hash. During endgame several peer connections,
+// possibly on different event loop threads, fill the same piece, so every
+// member function locks.
 class Piece {
 public:
-    Piece(size_t index, size_t length, const std::string& hash);
+    enum class SaveResult {
+        kDuplicate, // the block had already arrived from another peer
+        kSaved,
+        kCompleted, // this block was the last one missing
+    };
+
+    Piece(size_t index, size_t length, const std::string& hash, std::shared_ptr<utils::BufferPool> buffer_pool);
 
+    // True once every block is retrieved and hashed and the digest matches.
     bool HashMatches() const;
+    // Claims the job of hashing the blocks saved since the last run; false
+    // if such a job is already queued.
+    bool MarkHashScheduled();
+    // Feeds the contiguous prefix of retrieved blocks that has not been
+    // hashed yet to the SHA-1, without holding the lock while hashing; the
+    // last block finalizes the digest. Calls must not overlap.
+    void HashRetrievedBlocks();
     Block* GetFirstMissingBlock();
     size_t GetIndex() const;
-    void SaveBlock(size_t blockOffset, std::string data);
+    // Endgame: a block that is already pending elsewhere, has fewer than
+    // `max_requests` requests outstanding and is not `already_requested`.
+    const Block* GetBlockToDuplicate(size_t max_requests,
+                                     const std::function<bool(const Block&)>& already_requested);
+    void CancelBlockRequest(size_t blockOffset);
+    bool IsBlockRetrieved(size_t blockOffset) const;
+    SaveResult SaveBlock(size_t blockOffset, std::string_view data);
     bool AllBlocksRetrieved() const;
-    std::string GetData() const;
+    // The piece's bytes, once all blocks are retrieved; valid until Reset or
+    // ReleaseData.
+    std::string_view GetData() const;
+    // Appends the offsets and bytes of the retrieved blocks, for resume
+    // data; false if there are none.
+    bool CopyRetrievedBlocks(std::vector<size_t>& offsets, std::string& data) const;
+    // SHA-1 of the data, empty until all blocks are retrieved.
     std::string GetDataHash() const;
     const std::string& GetHash() const;
     void Reset();
+    void ReleaseData();
 
     bool IsDownloading() const;
     bool IsComplete() const;
@@ -40,11 +82,24 @@ public:
     size_t GetBytesDownloaded() const;
 
 private:
+    bool AllBlocksRetrievedLocked() const;
+    Block* FindBlockLocked(size_t blockOffset);
+    const Block* FindBlockLocked(size_t blockOffset) const;
+
+    mutable std::mutex mutex;
     size_t index;
     size_t length;
     std::string hash;
-    std::vector<Block> blocks;
+    std::vector<Block> blocks; // blocks[offset / kBlockSize]
     size_t bytes_downloaded;
+    std::shared_ptr<utils::BufferPool> buffer_pool;
+    utils::BufferPool::Buffer buffer;
+    utils::Sha1 hasher;
+    size_t hashed_bytes = 0;
+    std::string digest; // set once hashed_bytes reaches length
+    bool is_hash_scheduled = false;
+    bool is_hashing = false; // the buffer is being read without the lock
+    std::condition_variable hashing_finished;
 };
 
 using PiecePtr = std::shared_ptr<Piece>;
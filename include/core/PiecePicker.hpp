@@ -0,0 +1,63 @@
+#pragma once
+
+#include "core/DownloadPriority.hpp"
+#include "core/PeerPiecesAvailability.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Rarest-first selection among the pieces that are waiting to be requested.
+// Every piece has a swarm availability count (how many connected peers have
+// announced it); waiting pieces are kept in one bucket per count, so picking
+// walks the buckets from the rarest up and only looks at pieces that are
+// actually waiting. Each priority has its own buckets, and higher
+// priorities are picked from first. A picker can own only every `stride`-th piece starting
+// at `first_piece`, so PieceStorage can shard the pieces across several
+// pickers. Not thread-safe; PieceStorage serializes access.
+class PiecePicker {
+public:
+    static constexpr size_t kNoPiece = static_cast<size_t>(-1);
+
+    explicit PiecePicker(size_t piece_count, size_t first_piece = 0, size_t stride = 1);
+
+    void AddPiece(size_t piece_index);
+    void RemovePiece(size_t piece_index);
+    bool IsWaiting(size_t piece_index) const;
+    size_t WaitingCount() const;
+    void Clear();
+
+    void AddPeer(const PeerPiecesAvailability& peer);
+    void RemovePeer(const PeerPiecesAvailability& peer);
+    void IncrementAvailability(size_t piece_index);
+    void DecrementAvailability(size_t piece_index);
+    size_t GetAvailability(size_t piece_index) const;
+    // kNormal unless set; a waiting piece moves to its new buckets.
+    void SetPriority(size_t piece_index, DownloadPriority priority);
+    DownloadPriority GetPriority(size_t piece_index) const;
+
+    // The rarest waiting piece `peer` has, from the highest priority that
+    // has one, or kNoPiece. Without a peer, the rarest waiting piece anybody
+    // has, then one nobody has announced, again by priority.
+    size_t PickRarest(const PeerPiecesAvailability* peer) const;
+
+private:
+    static constexpr size_t kNotWaiting = static_cast<size_t>(-1);
+
+    bool Owns(size_t piece_index) const;
+    size_t Slot(size_t piece_index) const;
+
+    std::vector<size_t>& BucketOf(size_t piece_index); // by its priority and availability
+    void Unlink(size_t piece_index);
+    void Link(size_t piece_index);
+
+    size_t piece_count;
+    size_t first_piece;
+    size_t stride;
+    std::vector<uint32_t> availability; // per owned piece, indexed by Slot()
+    std::vector<DownloadPriority> priorities; // by Slot()
+    // buckets[p][n]: waiting pieces of priority p that n peers have
+    std::array<std::vector<std::vector<size_t>>, kDownloadPriorityCount> buckets;
+    std::vector<size_t> position_in_bucket;   // by Slot(); kNotWaiting for pieces not waiting
+    size_t waiting_count = 0;
+};
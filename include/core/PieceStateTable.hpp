@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+enum class PieceState : uint8_t {
+    kMissing,  // waiting to be handed to a peer
+    kInFlight, // blocks being requested
+    kHashing,  // all blocks in, hash being checked
+    kWriting,  // verified, write to disk pending
+    kDone,     // on disk
+    kSkipped,  // only in skipped files; never requested
+};
+
+// Where every piece of the torrent is, readable from any thread without a
+// lock. Besides the per-piece state byte, each state has a bitset of its
+// pieces and a count, so totals are O(1) and the pieces in a state can be
+// walked a word at a time without allocating. Walks are snapshots: a piece
+// that changes state meanwhile may or may not be visited.
+//
+// Changes to one piece must be serialized by the caller (PieceStorage holds
+// the piece's shard lock); changes to different pieces may run in parallel.
+class PieceStateTable {
+public:
+    static constexpr size_t kStateCount = 6;
+
+    explicit PieceStateTable(size_t piece_count); // every piece kMissing
+
+    size_t Size() const;
+    PieceState Get(size_t piece_index) const;
+    bool Is(size_t piece_index, PieceState state) const;
+    // Moves the piece to `to` if it is in `from`; false if it was not.
+    bool Transition(size_t piece_index, PieceState from, PieceState to);
+    // Moves the piece to `to` whatever its state; returns the old one.
+    PieceState Set(size_t piece_index, PieceState to);
+    size_t Count(PieceState state) const;
+
+    template <typename Function>
+    void ForEach(PieceState state, Function&& function) const {
+        Walk(state, false, function);
+    }
+
+    // Every piece that is not kDone yet, kSkipped ones included.
+    template <typename Function>
+    void ForEachNotDone(Function&& function) const {
+        Walk(PieceState::kDone, true, function);
+    }
+
+private:
+    void Move(size_t piece_index, PieceState from, PieceState to);
+    std::atomic<uint64_t>& Word(PieceState state, size_t word_index) const;
+
+    template <typename Function>
+    void Walk(PieceState state, bool inverted, Function& function) const {
+        for (size_t w = 0; w < word_count; ++w) {
+            uint64_t word = Word(state, w).load(std::memory_order_acquire);
+            if (inverted) {
+                word = ~word & ValidBits(w);
+            }
+            while (word) {
+                function(w * 64 + __builtin_ctzll(word));
+                word &= word - 1;
+            }
+        }
+    }
+
+    uint64_t ValidBits(size_t word_index) const;
+
+    size_t piece_count;
+    size_t word_count;
+    std::unique_ptr<std::atomic<uint8_t>[]> states;
+    std::unique_ptr<std::atomic<uint64_t>[]> bits; // kStateCount bitsets of word_count words
+    std::array<std::atomic<size_t>, kStateCount> counts;
+};
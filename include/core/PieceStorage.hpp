@@ -1,28 +1,121 @@
 #pragma once
 
+#include "core/DiskIoPool.hpp"
+#include "core/DownloadPriority.hpp"
+#include "core/FileSet.hpp"
+#include "core/HasherPool.hpp"
 #include "core/Piece.hpp"
+#include "core/PiecePicker.hpp"
+#include "core/PieceStateTable.hpp"
+#include "core/ResumeData.hpp"
+#include "core/StorageBackend.hpp"
 #include "core/TorrentFile.hpp"
+#include "core/WriteBackCache.hpp"
+#include "utils/BufferPool.hpp"
+#include "utils/Preallocation.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
-#include <fstream>
-#include <queue>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
+struct PieceStorageOptions {
+    // Waiting pieces are split into shards, usually one per event loop
+    // thread, each behind its own lock.
+    size_t shard_count = 1;
+    size_t hasher_threads = HasherPool::DefaultThreadCount();
+    size_t disk_threads = DiskIoPool::DefaultThreadCount();
+    // Bytes of pieces being downloaded, hashed or waiting for the disk.
+    // Past it no new piece is handed out until some are written; 0 sets
+    // no limit. The write-back cache gets at most half of it.
+    uint64_t memory_budget = 256 * (1 << 20);
+    // Recheck an existing output file even if the resume data matches it.
+    // Without resume data the file is rechecked anyway.
+    bool force_recheck = false;
+    utils::PreallocationMode preallocation = utils::PreallocationMode::kSparse;
+    StorageBackendType storage_backend = StorageBackendType::kAuto;
+    WriteBackCacheOptions write_cache;
+    DurabilityMode durability = DurabilityMode::kPeriodic;
+    // Applied in order over every file at kNormal.
+    std::vector<FilePriorityRule> file_priorities;
+    // Streaming: the pieces in this many bytes from the read position (see
+    // PieceStorage::Read) are requested first, in order, and the window
+    // slides on as they complete. 0 picks rarest first throughout.
+    size_t read_ahead = 0;
+};
+
 class PieceStorage {
 public:
+    // Lock statistics of the waiting-piece shards, summed over all shards.
+    struct QueueStats {
+        uint64_t lock_acquisitions = 0;
+        uint64_t contended_acquisitions = 0; // the shard lock was already held
+        uint64_t picks = 0;
+        uint64_t stolen_picks = 0;           // taken from another worker's shard
+        uint64_t throttled_picks = 0;        // refused for the memory budget
+    };
+
     PieceStorage(const TorrentFile& torrent_file,
-                 const std::filesystem::path& output_directory);
+                 const std::filesystem::path& output_directory,
+                 const PieceStorageOptions& options = PieceStorageOptions());
 
-    PiecePtr GetNextPieceToDownload();
+    // The waiting piece with the earliest deadline the peer has; failing
+    // that, the rarest waiting piece the peer has, looked up in the worker's
+    // own shard first and stolen from the other shards when that one has
+    // none for it.
+    PiecePtr GetNextPieceToDownload(const PeerPiecesAvailability& peer, size_t worker_index = 0);
+    // Pieces with a deadline are handed out before any other, earliest
+    // first, whatever their availability, and skip the write-back cache's
+    // delay. The deadline goes once the piece is on disk; a later call for
+    // the same piece replaces it.
+    void SetPieceDeadline(size_t piece_index, std::chrono::steady_clock::time_point deadline);
+    // Blocks until the pieces covering [offset, offset + length) of the
+    // payload are verified and on disk, then returns those bytes. The pieces
+    // get a deadline of now, and with read-ahead the window moves to
+    // `offset`. Throws std::out_of_range past the end of the payload, and
+    // std::runtime_error if part of the range is in a skipped file or the
+    // output file is closed before the range is complete.
+    std::string Read(uint64_t offset, size_t length);
+    void AddPeerAvailability(const PeerPiecesAvailability& peer);
+    void RemovePeerAvailability(const PeerPiecesAvailability& peer);
+    void AddPieceAvailability(size_t piece_index);
+    // Pieces the peer has that are handed out and not finished yet; during
+    // endgame their remaining blocks are requested from several peers.
+    std::vector<PiecePtr> GetPiecesInProgress(const PeerPiecesAvailability& peer) const;
+    // A block of the piece was saved; its hashing is queued on the hasher
+    // pool unless a hash job for the piece is queued already.
+    void BlockSaved(const PiecePtr& piece);
+    // All blocks are in: the piece is verified on the hasher pool, then
+    // written, or requeued if the hash does not match.
     void PieceProcessed(const PiecePtr& piece);
+    // Puts a fresh copy of the piece back in the queue; copies still held
+    // elsewhere can no longer be processed.
     void Enqueue(const PiecePtr& piece);
     bool QueueIsEmpty() const;
     bool IsPieceAlreadySaved(size_t piece_index) const;
+    // Lock-free view of where every piece is, e.g. to walk the missing
+    // pieces without GetMissingPieces' copy.
+    const PieceStateTable& GetPieceStates() const;
     size_t TotalPiecesCount() const;
+    // Pieces to download or already on disk: all but the kSkipped ones.
+    size_t WantedPiecesCount() const;
+    // The files that are not skipped, in payload order.
+    const std::vector<TorrentFile::File>& GetWantedFiles() const;
     size_t PiecesSavedToDiscCount() const;
 
     void CloseOutputFile();
+    // Records the pieces on disk and the blocks of partly downloaded pieces
+    // next to the output file, so a restart can skip them. Failures are
+    // logged; the download carries on without a checkpoint.
+    void CheckpointResumeData();
     void PrintMissingPieces() const;
+    // Every piece that is not skipped is on disk.
     bool IsDownloadComplete() const;
     bool HasActiveWork() const;
     std::vector<size_t> GetMissingPieces() const;
@@ -31,18 +124,116 @@ public:
     void PrintDownloadStatus() const;
     void PrintDetailedStatus() const;
     size_t GetMissingPiecesCount() const;
+
+    size_t GetShardCount() const;
+    QueueStats GetQueueStats() const;
+    void PrintQueueStats() const;
+    // Hash jobs queued or running.
+    size_t GetHashQueueDepth() const;
+    // Piece writes queued or running.
+    size_t GetDiskQueueDepth() const;
+    // Bytes of the pieces handed out, being hashed or being written: what
+    // the memory budget limits.
+    uint64_t GetInFlightBytes() const;
 private:
+    // Owns every piece i with i % shard count == its index: the picker
+    // entries, pieces[i] and changes to the piece's state.
+    struct alignas(64) Shard {
+        Shard(size_t piece_count, size_t first_piece, size_t stride);
+
+        mutable std::mutex mutex;
+        PiecePicker picker;
+        std::atomic<size_t> waiting_count = 0; // picker.WaitingCount(), readable without the lock
+        mutable std::atomic<uint64_t> lock_acquisitions = 0;
+        mutable std::atomic<uint64_t> contended_acquisitions = 0;
+        std::atomic<uint64_t> picks = 0;        // by workers this shard is home to
+        std::atomic<uint64_t> stolen_picks = 0;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Deadline {
+        Clock::time_point time;
+        bool is_read_ahead; // set by the read-ahead window, which drops it when it moves on
+    };
+
+    Shard& ShardOf(size_t piece_index);
+    bool IsOverMemoryBudget() const;
+    std::unique_lock<std::mutex> LockShard(const Shard& shard) const;
+    size_t WaitingCount() const;
+
+    void VerifyPiece(const PiecePtr& piece);
     void SavePieceToDisk(const PiecePtr& piece);
-    void InitializeOutputFile();
+    // Resume data that matches this torrent and the output file as it is
+    // on disk, or nothing. Pieces overlapping a file that is wanted now but
+    // was skipped when the data was saved are not counted as done.
+    std::optional<ResumeData> LoadConsistentResumeData() const;
+    // Which pieces of an output file left by an earlier run are valid, or
+    // nothing if there is no such file. Throws std::runtime_error if the
+    // files are there but cannot be rechecked.
+    std::optional<ResumeData> RecheckExistingFile() const;
+    void InitializeOutputFile(bool keep_existing);
+    void RestorePartialPieces(const ResumeData& resume_data);
+
+    PiecePtr TakePiece(Shard& shard, size_t piece_index);
+    void AddWaitingPiece(Shard& shard, size_t piece_index);
+    bool SetPieceState(size_t piece_index, PieceState from, PieceState to);
+    PiecePtr MakePiece(size_t piece_index) const;
 
-    std::queue<PiecePtr> remaining_pieces_queue;
-    mutable std::mutex queue_mutex;
-    std::ofstream file;
-    mutable std::mutex file_mutex;
-    std::vector<size_t> indices_of_pieces_saved_to_disk;
+    PiecePtr TakeDeadlinePiece(const PeerPiecesAvailability& peer);
+    bool HasRequestedDeadline(size_t piece_index);
+    // Called once the piece is kDone: drops its deadline, slides the
+    // read-ahead window and wakes readers.
+    void PieceDone(size_t piece_index);
+    // The rest are called with deadline_mutex held.
+    void SetDeadlineLocked(size_t piece_index, Clock::time_point time, bool is_read_ahead);
+    void EraseDeadlineLocked(size_t piece_index);
+    void MoveReadAheadLocked(size_t piece_index);
+    void UpdateReadAheadLocked();
+
+    std::vector<PiecePtr> pieces;
+    PieceStateTable states;
+    std::shared_ptr<utils::BufferPool> buffer_pool;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::unique_ptr<StorageBackend> storage; // reset by CloseOutputFile
+    std::unique_ptr<FileSet> read_files;     // the wanted files, opened for Read
 
     std::filesystem::path output_directory;
+    std::filesystem::path output_path; // the file, or directory of a multi-file torrent
+    std::vector<TorrentFile::File> files;
+    std::vector<TorrentFile::File> wanted_files; // those not skipped: created and written
+    std::vector<DownloadPriority> file_priorities;
+    std::filesystem::path resume_path;
+    std::mutex resume_mutex; // one checkpoint at a time
+    utils::PreallocationMode preallocation;
+    StorageBackendType storage_backend;
+    WriteBackCacheOptions write_cache;
+    DurabilityMode durability;
     size_t default_piece_length;
+
+    // Taken before a shard's lock, never after one.
+    std::mutex deadline_mutex;
+    std::set<std::pair<Clock::time_point, size_t>> deadline_order; // earliest first
+    std::unordered_map<size_t, Deadline> deadlines;
+    std::atomic<size_t> deadline_count = 0; // deadlines.size(), readable without the lock
+    size_t read_ahead_pieces = 0;
+    size_t read_ahead_start = 0; // first piece of the window; pieces before it are done or behind the reader
+    size_t read_ahead_end = 0;   // pieces before it have been given their read-ahead deadline
+
+    std::mutex done_mutex;
+    std::condition_variable piece_done; // a piece became kDone, or the output file was closed
+    bool is_closed = false;
+
     size_t total_piece_count;
     TorrentFile torrent_file;
+
+    uint64_t memory_budget;
+    std::atomic<uint64_t> throttled_picks = 0;
+    std::atomic<uint64_t> peak_in_flight_bytes = 0;
+    std::atomic<bool> is_budget_flush_queued = false;
+
+    // Last, so their threads are joined before anything their jobs touch
+    // goes; hasher jobs submit disk jobs, so the hashers go first.
+    DiskIoPool disk_pool;
+    HasherPool hasher_pool;
 };
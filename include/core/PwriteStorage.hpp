@@ -0,0 +1,24 @@
+#pragma once
+
+#include "core/FileSet.hpp"
+#include "core/StorageBackend.hpp"
+
+// Writes each piece with pwrite at its offset on a raw file descriptor.
+// The offset travels with the call, so there is no shared file position to
+// guard: disk threads write their pieces concurrently, with no lock at
+// all. A run of adjacent pieces goes out as a single pwritev per file it
+// covers.
+class PwriteStorage : public StorageBackend {
+public:
+    PwriteStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files);
+
+    const char* GetName() const override;
+    void Write(uint64_t offset, std::string_view data, Callback on_complete) override;
+    void WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                       Callback on_complete) override;
+    void Flush() override;
+    void Sync() override; // fdatasync
+
+private:
+    FileSet files;
+};
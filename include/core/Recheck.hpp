@@ -0,0 +1,20 @@
+#pragma once
+
+#include "core/ResumeData.hpp"
+#include "core/TorrentFile.hpp"
+#include <cstddef>
+#include <filesystem>
+
+// Hashes every piece of the existing output files under `directory`
+// against the torrent's piece hashes, `thread_count` threads each taking
+// the next batch of pieces through the multi-buffer SHA-1. The files are
+// memory-mapped and read front to back with readahead hints, so on a cold
+// cache the recheck runs at disk speed. A piece that spans files is copied
+// together first. Progress and throughput go to stdout.
+//
+// The result is resume data listing the pieces that matched, with the
+// files' summed size and latest mtime. Pieces in missing or short files
+// are not valid; throws std::runtime_error if a file that exists cannot be
+// opened or mapped.
+ResumeData RecheckOutputFiles(const TorrentFile& torrent_file, const std::filesystem::path& directory,
+                              size_t thread_count);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "core/TorrentFile.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// What a restart needs to carry on with a download instead of starting
+// over: the pieces already on disk, the size and modification time the
+// output files had when that was recorded, the files that were being
+// written, and the blocks of pieces that were partly downloaded. Kept next to the output file, or directory of a
+// multi-file torrent, as "<name>.resume".
+struct ResumeData {
+    struct PartialPiece {
+        size_t index = 0;
+        std::vector<size_t> block_offsets; // retrieved blocks, ascending
+        std::string data;                  // their bytes, back to back
+    };
+
+    std::string info_hash;
+    size_t piece_count = 0;
+    std::string completed_pieces; // bitfield, high bit of byte 0 is piece 0
+    uint64_t file_size = 0;       // of all output files together
+    int64_t file_mtime = 0;       // the latest of them, filesystem clock ticks
+    // Files that completed pieces were written to, a bitfield like
+    // completed_pieces. A piece shared with a skipped file is only on disk
+    // in the wanted ones, so it is done for a file only if the file is here.
+    size_t file_count = 0;
+    std::string wanted_files;
+    std::vector<PartialPiece> partial_pieces;
+
+    bool IsPieceCompleted(size_t piece_index) const;
+    void SetPieceCompleted(size_t piece_index);
+    void ClearPieceCompleted(size_t piece_index);
+    bool IsFileWanted(size_t file_index) const;
+    void SetFileWanted(size_t file_index);
+};
+
+std::filesystem::path GetResumeDataPath(const std::filesystem::path& output_file);
+// Modification time of the file in the units ResumeData::file_mtime uses.
+int64_t GetFileModificationTime(const std::filesystem::path& file);
+
+// What resume data records of the output: the summed size and the latest
+// modification time of those of `files` under `directory` that exist.
+struct OutputFilesStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    size_t existing_count = 0;
+};
+OutputFilesStamp GetOutputFilesStamp(const std::filesystem::path& directory,
+                                     const std::vector<TorrentFile::File>& files);
+
+// Throws std::runtime_error if the file is missing, truncated or corrupt.
+ResumeData LoadResumeData(const std::filesystem::path& path);
+// Written to a temporary file and renamed over `path`, so a crash mid-way
+// leaves the previous checkpoint intact.
+void SaveResumeData(const std::filesystem::path& path, const ResumeData& resume_data);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "core/TorrentFile.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class StorageBackendType {
+    kAuto,   // io_uring when built and supported, pwrite otherwise
+    kPwrite, // positional writes on a file descriptor, no lock
+    kMmap,   // the file mapped shared; pieces copied to their offset
+    kDirect, // O_DIRECT from the aligned piece buffers, past the page cache
+    kUring,  // io_uring writes from a dedicated thread
+};
+
+const char* GetStorageBackendName(StorageBackendType type);
+// "auto", "pwrite", "mmap", "direct" or "uring"; throws std::invalid_argument otherwise.
+StorageBackendType ParseStorageBackendType(const std::string& name);
+
+// When written pieces are forced out to the disk with StorageBackend::Sync.
+enum class DurabilityMode {
+    kNone,       // never; the kernel writes back in its own time
+    kPeriodic,   // before every resume checkpoint, and when the file is closed
+    kOnComplete, // once, when the file is closed
+};
+
+const char* GetDurabilityModeName(DurabilityMode mode);
+// "none", "periodic" or "on-complete"; throws std::invalid_argument otherwise.
+DurabilityMode ParseDurabilityMode(const std::string& name);
+
+// Where verified pieces go: the output files, through one of several I/O
+// strategies. Offsets are into the torrent's payload; a write that crosses
+// file boundaries becomes one write per file. Write may be called from
+// several disk threads at once. Destroying a backend waits for the
+// writes it has queued.
+class StorageBackend {
+public:
+    using Callback = std::function<void(bool success)>;
+
+    virtual ~StorageBackend() = default;
+
+    virtual const char* GetName() const = 0;
+    // Writes `data` at `offset` of the file and runs on_complete, possibly
+    // before returning. `data` must stay valid until on_complete has run.
+    virtual void Write(uint64_t offset, std::string_view data, Callback on_complete) = 0;
+    // Writes `parts` back to back from `offset`, as one request where the
+    // backend can; on_complete runs once, after all of them. By default
+    // each part is a separate Write.
+    virtual void WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                               Callback on_complete);
+    // Waits for queued writes and pushes everything written to the file, so
+    // its size and mtime cover every write completed so far.
+    virtual void Flush() = 0;
+    // Flush, then force everything written onto the disk.
+    virtual void Sync() = 0;
+
+    // Writes to the existing, already preallocated, `files` under
+    // `directory`; their descriptors are opened as they are first written.
+    // Falls back to the pwrite backend if an io_uring one cannot be set up
+    // for kAuto; throws std::runtime_error otherwise.
+    static std::unique_ptr<StorageBackend> Create(StorageBackendType type, const std::filesystem::path& directory,
+                                                  const std::vector<TorrentFile::File>& files);
+
+protected:
+    // A callback to be run `count` times, possibly on different threads;
+    // the last run calls on_complete, with success only if every run had it.
+    static Callback JoinCallbacks(size_t count, Callback on_complete);
+    // Bytes [begin, end) of `parts` laid end to end.
+    static std::vector<std::string_view> SliceParts(const std::vector<std::string_view>& parts, uint64_t begin,
+                                                    uint64_t end);
+};
@@ -12,16 +12,27 @@ public:
 
     void DownloadTorrent(const std::filesystem::path& torrentFilePath,
                         const std::filesystem::path& outputDirectory);
+    // Rechecks a previously downloaded file and updates its resume data
+    // without downloading anything; true if every piece is valid.
+    bool VerifyTorrent(const std::filesystem::path& torrentFilePath,
+                       const std::filesystem::path& outputDirectory);
 
     const std::string& GetPeerId() const { return peer_id; }
     void SetPeerId(const std::string& peerId) { peer_id = peerId; }
+    void SetStorageOptions(const PieceStorageOptions& options) { storage_options = options; }
+    // While downloading, copies the payload of the wanted files in order to
+    // `path` (e.g. a FIFO a player reads) as the pieces arrive. Empty: off.
+    void SetStreamOutput(const std::filesystem::path& path) { stream_output = path; }
 
 private:
     std::string peer_id;
+    PieceStorageOptions storage_options;
+    std::filesystem::path stream_output;
     std::atomic<bool> is_terminated = false;
 
     std::string GenerateRandomSuffix(size_t length = 4);
     bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrent_file,
                                const TorrentTracker& tracker);
     void DownloadFromTracker(const TorrentFile& torrentFile, PieceStorage& pieces);
+    void StreamPayload(PieceStorage& pieces);
 };
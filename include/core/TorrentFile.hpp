@@ -1,9 +1,18 @@
 #pragma once
 
+#include <cstdint>
+#include <filesystem>
 #include <string>
 #include <vector>
 
 struct TorrentFile {
+    // A file of the torrent: a byte range of the concatenated payload.
+    struct File {
+        std::filesystem::path path; // relative to the output directory, starting with `name`
+        uint64_t offset;
+        uint64_t length;
+    };
+
     std::string announce;
     std::string comment;
     std::vector<std::string> piece_hashes;
@@ -11,6 +20,12 @@ struct TorrentFile {
     size_t length;
     std::string name;
     std::string info_hash;
+    // In payload order. LoadTorrentFile always fills it; left empty, the
+    // torrent is the single file `name` of `length` bytes.
+    std::vector<File> files;
 };
 
 TorrentFile LoadTorrentFile(const std::string& filename);
+
+// `files`, or the single file `name` when it is empty.
+std::vector<TorrentFile::File> GetTorrentFiles(const TorrentFile& torrent_file);
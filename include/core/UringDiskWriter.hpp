@@ -0,0 +1,68 @@
+#pragma once
+
+#include "core/FileSet.hpp"
+#include "core/StorageBackend.hpp"
+#include "utils/IoUring.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string_view>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+// Writes verified pieces through io_uring from a dedicated thread. Every
+// write queued while the previous batch was in flight is submitted with a
+// single io_uring_enter, straight from the pieces' own buffers. A write
+// becomes one job, and one writev, per file it spans.
+class UringDiskWriter : public StorageBackend {
+public:
+    UringDiskWriter(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files);
+    ~UringDiskWriter() override;
+
+    UringDiskWriter(const UringDiskWriter&) = delete;
+    UringDiskWriter& operator=(const UringDiskWriter&) = delete;
+
+    const char* GetName() const override;
+    void Write(uint64_t offset, std::string_view data, Callback on_complete) override;
+    // One writev per file the run touches.
+    void WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                       Callback on_complete) override;
+    void Flush() override; // waits until every queued write has completed
+    void Sync() override;
+
+    size_t GetWriteCount() const; // writes submitted to the ring, resumed short writes included
+
+private:
+    struct Job {
+        int fd;
+        uint64_t offset;
+        std::vector<iovec> vectors; // what is left to write starts at first_vector
+        Callback on_complete;
+        size_t first_vector = 0;
+        uint64_t written = 0;
+    };
+
+    void Run();
+    // False, and nothing queued, if the job could not get an SQE.
+    bool SubmitJob(size_t job_index);
+    void ProcessBatch(std::vector<Job>& batch);
+    // Moves past `count` bytes the kernel has written.
+    static void Advance(Job& job, size_t count);
+
+    FileSet files;
+    utils::IoUring ring;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable has_work;
+    std::condition_variable is_idle;
+    std::deque<Job> queue;
+    std::vector<Job>* current_batch = nullptr;
+    bool is_busy = false;
+    bool is_stopped = false;
+    std::atomic<size_t> write_count = 0;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "core/StorageBackend.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WriteBackCacheOptions {
+    // Bytes of verified pieces held back before they are written; 0 turns
+    // the cache off.
+    size_t capacity = 32 << 20;
+    // Flush once the oldest cached piece has waited this long...
+    std::chrono::milliseconds max_age{2000};
+    // ...or no piece has arrived for this long.
+    std::chrono::milliseconds idle_time{250};
+};
+
+// Sits in front of another backend and holds verified pieces back, in their
+// own buffers, until the cache is full, its oldest piece too old or no piece
+// has arrived for a while. A flush sorts the pieces by offset and hands each
+// run of adjacent ones to the backend as one gathered write, so pieces
+// verified in random order reach the disk as few large sequential writes.
+// Writers block while the cache is full and a flush is under way.
+class WriteBackCache : public StorageBackend {
+public:
+    WriteBackCache(std::unique_ptr<StorageBackend> backend, WriteBackCacheOptions options);
+    ~WriteBackCache() override; // flushes whatever is still cached
+
+    WriteBackCache(const WriteBackCache&) = delete;
+    WriteBackCache& operator=(const WriteBackCache&) = delete;
+
+    const char* GetName() const override; // the backend's
+    void Write(uint64_t offset, std::string_view data, Callback on_complete) override;
+    void Flush() override;
+    void Sync() override;
+
+    size_t GetWriteCount() const; // gathered writes handed to the backend
+    const StorageBackend& GetBackend() const;
+
+private:
+    struct Entry {
+        uint64_t offset;
+        std::string_view data;
+        Callback on_complete;
+    };
+    using Clock = std::chrono::steady_clock;
+
+    void Run();
+    void WriteOut(std::vector<Entry>& entries);
+
+    std::unique_ptr<StorageBackend> backend;
+    WriteBackCacheOptions options;
+
+    std::thread thread;
+    mutable std::mutex mutex;
+    std::condition_variable has_work;
+    std::condition_variable has_space;
+    std::condition_variable is_idle;
+    std::vector<Entry> entries;
+    size_t cached_bytes = 0;
+    Clock::time_point oldest_write;
+    Clock::time_point latest_write;
+    bool is_flush_requested = false;
+    bool is_flushing = false;
+    bool is_stopped = false;
+    size_t write_count = 0;
+};
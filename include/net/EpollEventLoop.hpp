@@ -0,0 +1,33 @@
+#pragma once
+
+#include "net/EventLoop.hpp"
+
+// Readiness-based engine: one epoll instance, PeerConnect does its own
+// recv/send when the socket is reported ready.
+class EpollEventLoop : public EventLoop {
+public:
+    EpollEventLoop();
+    ~EpollEventLoop() override;
+
+    const char* GetName() const override;
+
+protected:
+    void Loop() override;
+    void AdoptPeer(std::shared_ptr<PeerConnect> peer) override;
+    void TerminatePeers() override;
+
+private:
+    struct Entry {
+        std::shared_ptr<PeerConnect> peer;
+        int fd = -1;
+        uint64_t generation = 0;
+        uint32_t events = 0;
+    };
+
+    void Dispatch(uint64_t data, uint32_t events);
+    void Sync(size_t slot);
+    void TickAll();
+
+    int epoll_fd = -1;
+    std::vector<Entry> entries;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "net/PeerConnect.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A thread that drives every PeerConnect assigned to it. Peers are only
+// ever touched from that thread once added. Concrete engines (epoll,
+// io_uring) implement Loop and own the per-peer I/O bookkeeping.
+class EventLoop {
+public:
+    EventLoop();
+    virtual ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void Add(std::shared_ptr<PeerConnect> peer);
+    void Start();
+    void Stop();
+    size_t GetPeerCount() const;
+    virtual const char* GetName() const = 0;
+
+    // Picks the best engine this build and kernel support.
+    static std::unique_ptr<EventLoop> Create();
+
+protected:
+    virtual void Loop() = 0;
+    virtual void AdoptPeer(std::shared_ptr<PeerConnect> peer) = 0;
+    virtual void TerminatePeers() = 0;
+
+    void AdoptNewPeers();
+    void DrainWakeFd();
+    void SetLivePeerCount(size_t live_peers);
+
+    int wake_fd = -1;
+    std::atomic<bool> is_stopped = false;
+
+private:
+    void Wake();
+
+    std::thread thread;
+    mutable std::mutex new_peers_mutex;
+    std::vector<std::shared_ptr<PeerConnect>> new_peers;
+    std::atomic<size_t> peer_count = 0;
+};
+
+// Fixed set of event loops; peers are spread across them round-robin so the
+// thread count stays constant however many peers the trackers return.
+class EventLoopGroup {
+public:
+    explicit EventLoopGroup(size_t thread_count = DefaultThreadCount());
+
+    void Add(std::shared_ptr<PeerConnect> peer);
+    void Start();
+    void Stop();
+    size_t GetPeerCount() const;
+    size_t GetThreadCount() const;
+    const char* GetEngineName() const;
+
+    static size_t DefaultThreadCount();
+
+private:
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    size_t next_loop = 0;
+};
@@ -1,7 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
-#include <string>
+#include <string_view>
 
 enum class MessageId : uint8_t {
     kChoke = 0,
@@ -17,12 +18,63 @@ enum class MessageId : uint8_t {
     kKeepAlive,
 };
 
+struct HaveMessage {
+    uint32_t piece_index;
+};
+
+// Payload of both kRequest and kCancel.
+struct RequestMessage {
+    uint32_t piece_index;
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct PieceMessage {
+    uint32_t piece_index;
+    uint32_t offset;
+    std::string_view block; // points into the frame the message was parsed from
+};
+
+struct PortMessage {
+    uint16_t port;
+};
+
+// Peer wire codec. Parsing only splits a frame into id and payload view, the
+// typed Decode overloads read fixed fields from that view, and the Encode
+// functions write complete frames into caller-provided buffers. Nothing here
+// allocates.
 struct Message {
+    static constexpr size_t kLengthSize = 4;
+    static constexpr size_t kHeaderSize = kLengthSize + 1;
+    static constexpr size_t kKeepAliveSize = kLengthSize;
+    static constexpr size_t kHaveSize = kHeaderSize + 4;
+    static constexpr size_t kRequestSize = kHeaderSize + 12;
+    static constexpr size_t kPieceHeaderSize = kHeaderSize + 8;
+    static constexpr size_t kPortSize = kHeaderSize + 2;
+
     MessageId id;
     size_t messageLength;
-    std::string payload;
+    std::string_view payload; // valid as long as the parsed frame is
+
+    // `messageString` is a whole frame, length prefix included.
+    static Message Parse(std::string_view messageString);
+
+    // Each returns false when the payload is too short for the message type.
+    bool Decode(HaveMessage& have) const;
+    bool Decode(RequestMessage& request) const;
+    bool Decode(PieceMessage& piece) const;
+    bool Decode(PortMessage& port) const;
 
-    static Message Parse(const std::string& messageString);
-    static Message Init(MessageId id, const std::string& payload);
-    std::string ToString() const;
+    // Each writes a frame to `out` and returns its size; `out` must hold at
+    // least the matching k*Size bytes.
+    static size_t EncodeKeepAlive(char* out);
+    static size_t Encode(MessageId id, char* out); // messages without payload
+    static size_t Encode(const HaveMessage& have, char* out);
+    static size_t Encode(MessageId id, const RequestMessage& request, char* out); // kRequest or kCancel
+    static size_t Encode(const PortMessage& port, char* out);
+    // Writes the length prefix and id of a message whose `payload_length`
+    // payload bytes the caller sends right after (bitfields, piece data).
+    static size_t EncodeHeader(MessageId id, size_t payload_length, char* out);
+    // kPiece header only; the block itself follows as its own buffer.
+    static size_t EncodePieceHeader(uint32_t piece_index, uint32_t offset, size_t block_length, char* out);
 };
@@ -2,54 +2,92 @@
 
 #include "net/TcpConnect.hpp"
 #include "net/Peer.hpp"
+#include "net/RequestPipeline.hpp"
 #include "core/TorrentFile.hpp"
+#include "core/PeerPiecesAvailability.hpp"
 #include "core/PieceStorage.hpp"
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
-class PeerPiecesAvailability {
-public:
-    PeerPiecesAvailability() = default;
-    explicit PeerPiecesAvailability(std::string bitfield, size_t size);
-    bool IsPieceAvailable(size_t piece_index) const;
-    void SetPieceAvailability(size_t piece_index);
-    size_t Size() const;
-
-private:
-    std::string bitfield;
-    size_t size;
-};
-
+// Per-peer protocol state machine. It never blocks: an EventLoop calls
+// OnReadable/OnWritable when the socket is ready (or OnDataReceived once a
+// completion engine has already read the bytes) and OnTick periodically to
+// drive reconnects, timeouts and new requests.
 class PeerConnect {
 public:
+    using Clock = std::chrono::steady_clock;
+
     PeerConnect(const Peer& peer, const TorrentFile& torrent_file, std::string self_peer_id, PieceStorage& piece_storage);
     ~PeerConnect() = default;
 
-    void HandleConnectionError();
-    void Run();
+    // Index of the event loop driving this peer; PieceStorage picks from
+    // that loop's shard first.
+    void SetWorkerIndex(size_t index);
+    void Start();
+    void OnReadable();
+    void OnWritable();
+    void OnDataReceived();
+    void OnSocketError(const std::string& reason);
+    void OnTick(Clock::time_point now);
     void Terminate();
+
+    TcpConnect& GetSocket();
+    int GetFd() const;
+    uint64_t GetSocketGeneration() const;
+    bool IsConnecting() const;
+    bool WantsWrite() const;
     bool Failed() const;
-    bool IsDownloading() const;
     bool IsTerminated() const;
 private:
+    enum class State {
+        kIdle,
+        kConnecting,
+        kHandshaking,
+        kConnected,
+        kFinished,
+    };
+
     const TorrentFile& torrent_file;
     TcpConnect socket;
     const std::string self_peer_id;
     std::string peer_id;
     PeerPiecesAvailability pieces_availability;
     std::atomic<bool> is_terminated = false;
+    State state = State::kIdle;
+    Clock::time_point state_changed_at;
+    Clock::time_point retry_at;
+    Clock::time_point last_activity_time;
+    int total_failures = 0;
     bool is_choked = true;
-    PiecePtr piece_is_in_progress;
+    std::vector<PiecePtr> pieces_in_progress;
+    std::vector<PiecePtr> endgame_pieces; // handed to other peers, requested here as well
     PieceStorage& piece_storage;
-    bool block_is_pending = false;
+    RequestPipeline pipeline;
     bool has_failed = false;
+    size_t worker_index = 0;
 
-    void PerformHandshake();
-    bool EstablishConnection();
-    void ReceiveBitfield();
+    void Connect(Clock::time_point now);
+    void SetState(State new_state, Clock::time_point now);
+    void HandleConnectionError(const std::string& reason);
+    void SendHandshake();
+    void ProcessHandshake(std::string_view response);
+    void SendMessage(std::string_view data);
+    void ProcessReceivedData();
     void SendInterested();
     void RequestPiece(const Block* block);
-    void MainLoop();
+    void SendCancel(const PendingRequest& request);
+    bool FillRequestPipeline();
+    const Block* GetNextBlockToRequest();
+    const Block* GetEndgameBlock();
+    void UpdateEndgame();
+    PiecePtr FindPieceInProgress(size_t piece_index) const;
+    void ReturnPiecesInProgress(const std::string& reason);
+    void CheckTimeouts(Clock::time_point now);
     PiecePtr GetNextAvailablePiece();
-    void ProcessMessage(const std::string& messageData);
+    void ForgetPeerAvailability();
+    void ProcessMessage(std::string_view messageData);
 };
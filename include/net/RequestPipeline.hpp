@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+
+struct PendingRequest {
+    size_t piece;
+    size_t offset;
+    size_t length;
+    std::chrono::steady_clock::time_point sent_at;
+};
+
+// Tracks the kRequest messages a peer has not answered yet and sizes the
+// queue to the bandwidth-delay product measured on this connection.
+class RequestPipeline {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kMinDepth = 4;
+    static constexpr size_t kInitialDepth = 8;
+    static constexpr size_t kMaxDepth = 256;
+
+    RequestPipeline() = default;
+
+    void OnRequestSent(size_t piece, size_t offset, size_t length, Clock::time_point now);
+    bool OnBlockReceived(size_t piece, size_t offset, size_t length, Clock::time_point now);
+    // Forgets a request without taking an RTT or throughput sample.
+    bool Cancel(size_t piece, size_t offset);
+    bool Contains(size_t piece, size_t offset) const;
+    const std::deque<PendingRequest>& GetRequests() const;
+    void Clear();
+
+    size_t Size() const;
+    bool IsEmpty() const;
+    bool HasRoom() const;
+    size_t TargetDepth() const;
+    Clock::duration OldestRequestAge(Clock::time_point now) const;
+
+    double GetThroughput() const;
+    Clock::duration GetRoundTripTime() const;
+
+private:
+    void UpdateThroughput(Clock::time_point now);
+    void UpdateTargetDepth();
+
+    std::deque<PendingRequest> requests;
+    size_t target_depth = kInitialDepth;
+
+    // Latency samples include time spent queued behind our own earlier
+    // requests, so the RTT estimate is a windowed minimum rather than a mean.
+    Clock::duration min_rtt = Clock::duration::max();
+    Clock::duration window_min_rtt = Clock::duration::max();
+    Clock::time_point rtt_window_start;
+
+    double throughput = 0.0; // bytes per second, EWMA
+    size_t bytes_in_interval = 0;
+    Clock::time_point interval_start;
+    bool interval_started = false;
+};
@@ -1,38 +1,72 @@
 #pragma once
 
+#include "utils/RingBuffer.hpp"
+#include <deque>
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <stdexcept>
 #include <cstring>
 #include <iostream>
-#include <chrono>
+#include <cstdint>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/poll.h>
-#include <atomic>
 
+// Non-blocking TCP connection driven by an event loop. Incoming bytes are
+// read in large chunks into a receive ring and framed in place: popped
+// messages are views into the ring that stay valid until the next read.
+// Outgoing messages are queued and written together with one sendmsg: small
+// ones are appended to a shared segment whose storage is reused once sent,
+// large payloads are queued as segments of their own. Between Cork and
+// Uncork nothing is written at all. With direct I/O (the default) the object
+// issues recv/send itself; completion-based engines such as io_uring turn
+// it off and feed AppendReceived/ConsumeSent instead.
 class TcpConnect {
 public:
     explicit TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
     ~TcpConnect();
 
-    void EstablishConnection();
-    void SendData(const std::string& data) const;
-    std::string ReceiveData(size_t bufferSize = 0) const;
+    void StartConnect();
+    bool FinishConnect();
+    size_t ReadAvailable();
+    bool PopMessage(std::string_view& message);
+    bool PopBytes(size_t count, std::string_view& data);
+    void Send(std::string_view data);
+    void SendOwned(std::string data);
+    void Cork();
+    void Uncork();
+    bool FlushSendBuffer();
+    bool HasPendingSend() const;
+    size_t GetPendingSendSize() const;
+
+    void SetDirectIo(bool enabled);
+    void AppendReceived(const char* data, size_t length);
+    size_t CopyPendingSend(char* destination, size_t capacity) const;
+    void ConsumeSent(size_t length);
     void CloseConnection();
-    void ForceClose();
+
+    int GetFd() const;
+    uint64_t GetGeneration() const;
     const std::string& GetIp() const;
     int GetPort() const;
-    bool IsTerminated() const;
+    std::chrono::milliseconds GetConnectTimeout() const;
+    std::chrono::milliseconds GetReadTimeout() const;
 
 private:
     const std::string ip;
     const int port;
     std::chrono::milliseconds connect_timeout;
     std::chrono::milliseconds read_timeout;
-    mutable std::atomic<bool> force_close_{false};
-    mutable int sock;
+    int sock;
+    uint64_t generation = 0; // bumped for every new socket so stale events can be told apart
+    bool direct_io = true;
+    utils::RingBuffer receive_buffer;
+    std::deque<std::string> send_queue;
+    size_t send_queue_offset = 0; // bytes of send_queue.front() already written
+    size_t pending_send_bytes = 0;
+    std::string spare_segment;
+    int cork_depth = 0;
 };
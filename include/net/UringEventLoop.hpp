@@ -0,0 +1,60 @@
+#pragma once
+
+#include "net/EventLoop.hpp"
+#include "utils/IoUring.hpp"
+#include <vector>
+
+// Completion-based engine: socket receives and sends are submitted as SQEs
+// and flushed to the kernel in one io_uring_enter per loop iteration.
+// Receives pick their buffer from a kernel-provided buffer group at
+// completion time, so idle peers do not pin a buffer each.
+class UringEventLoop : public EventLoop {
+public:
+    UringEventLoop();
+    ~UringEventLoop() override;
+
+    const char* GetName() const override;
+
+protected:
+    void Loop() override;
+    void AdoptPeer(std::shared_ptr<PeerConnect> peer) override;
+    void TerminatePeers() override;
+
+private:
+    enum class Operation : uint8_t {
+        kPoll = 1,
+        kReceive,
+        kSend,
+        kWake,
+        kTimeout,
+        kProvideBuffers,
+    };
+
+    struct Entry {
+        std::shared_ptr<PeerConnect> peer;
+        bool poll_pending = false;
+        bool receive_pending = false;
+        bool send_pending = false;
+        std::vector<char> send_in_flight; // heap storage, stable while entries grow
+    };
+
+    io_uring_sqe* AcquireSqe();
+    void Arm(size_t slot);
+    void ArmWake();
+    void ArmTimeout(std::chrono::nanoseconds timeout);
+    void ProvideBuffer(uint16_t buffer_id);
+    void HandleCompletion(const io_uring_cqe& cqe);
+    void TickAll();
+    void WaitForInFlight();
+    char* BufferAt(uint16_t buffer_id);
+
+    utils::IoUring ring;
+    std::vector<char> receive_arena;
+    std::vector<Entry> entries;
+    __kernel_timespec tick_timeout{};
+    bool wake_pending = false;
+    bool timeout_pending = false;
+    bool receive_starved = false;
+    size_t in_flight = 0;
+    uint64_t wake_value = 0;
+};
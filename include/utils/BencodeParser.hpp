@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <openssl/sha.h>
@@ -9,11 +10,19 @@
 
 namespace utils {
 class BencodeParser {
+public:
+    // One entry of a multi-file torrent's `files` list.
+    struct FileEntry {
+        uint64_t length = 0;
+        std::vector<std::string> path;
+    };
+
 private:
     std::string to_decode;
     std::string info_hash;
     std::vector<std::string> parsed;
     std::vector<std::string> pieces_hashes;
+    std::vector<FileEntry> files;
     int index;
 
     std::string ReadFixedAmount(int amount);
@@ -21,6 +30,8 @@ private:
     std::string Process();
     void ProcessDict();
     void ProcessList();
+    void ProcessFileList();
+    void SkipValue();
 
 public:
     BencodeParser();
@@ -30,5 +41,6 @@ public:
     std::vector<std::string> ParseFromString(std::string str);
     std::string GetHash();
     std::vector<std::string> GetPieceHashes();
+    std::vector<FileEntry> GetFiles(); // empty for a single-file torrent
 };
 }
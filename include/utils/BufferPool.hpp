@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace utils {
+// Fixed-size, page-aligned buffers that go back to the pool instead of the
+// allocator, so piece-sized allocations happen once per concurrently
+// downloading piece rather than once per piece. At most `max_idle_buffers`
+// are kept around; the rest are freed on release. Thread-safe. Buffers hold
+// a reference to their pool, so they may outlive whoever created it.
+class BufferPool {
+public:
+    static constexpr size_t kAlignment = 4096;
+
+    struct Releaser {
+        std::shared_ptr<BufferPool> pool;
+        void operator()(char* data) const;
+    };
+    using Buffer = std::unique_ptr<char[], Releaser>;
+
+    static std::shared_ptr<BufferPool> Create(size_t buffer_size, size_t max_idle_buffers);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer Acquire();
+    size_t BufferSize() const;
+    size_t IdleCount() const;
+    size_t AllocationCount() const; // buffers ever taken from the allocator
+
+private:
+    BufferPool(size_t buffer_size, size_t max_idle_buffers);
+    void Release(char* data);
+
+    std::weak_ptr<BufferPool> self;
+    size_t buffer_size;
+    size_t allocation_size; // buffer_size rounded up to kAlignment
+    size_t max_idle_buffers;
+    mutable std::mutex mutex;
+    std::vector<char*> idle_buffers;
+    size_t allocation_count = 0;
+};
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace utils {
+// Minimal io_uring wrapper on top of the raw syscalls, so the build does not
+// depend on liburing. One instance must only be used from one thread.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    static bool IsSupported();
+
+    // Returns a zeroed SQE, or nullptr when the submission queue is full.
+    io_uring_sqe* GetSqe();
+    // Submits everything prepared so far and optionally waits for completions.
+    int Submit(unsigned wait_for = 0);
+    size_t ForEachCompletion(const std::function<void(const io_uring_cqe&)>& handler);
+    // Takes back the SQEs the kernel has not consumed, e.g. after Submit
+    // failed, handing each to `handler` first.
+    size_t DropUnsubmitted(const std::function<void(const io_uring_sqe&)>& handler);
+
+    unsigned GetSqEntries() const;
+
+private:
+    int ring_fd = -1;
+    unsigned sq_entries = 0;
+
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    unsigned local_sq_tail = 0;
+};
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+#include <vector>
+
+namespace utils {
+// Writes every byte of `vectors` to `fd` from `offset` with pwritev,
+// retrying short and interrupted writes and splitting at IOV_MAX parts.
+// `vectors` is consumed. Returns false with errno set on failure (0 if the
+// file stopped taking data).
+bool WriteAt(int fd, uint64_t offset, std::vector<iovec>& vectors);
+// Reads `length` bytes at `offset` into `data` with pread, retrying short
+// and interrupted reads. Returns false with errno set on failure (0 at the
+// end of the file).
+bool ReadAt(int fd, uint64_t offset, char* data, size_t length);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace utils {
+// How an output file gets its full size before the download starts.
+enum class PreallocationMode {
+    kNone,   // grows as pieces are written
+    kSparse, // ftruncate to the final size; blocks are allocated on write
+    kFull,   // fallocate (posix_fallocate where unsupported): blocks reserved up front
+};
+
+const char* GetPreallocationModeName(PreallocationMode mode);
+// "none", "sparse" or "full"; throws std::invalid_argument otherwise.
+PreallocationMode ParsePreallocationMode(const std::string& name);
+
+// Throws std::runtime_error if the filesystem holding `file` cannot take
+// the `length` bytes the file will have, minus what it already occupies.
+void CheckFreeSpace(const std::filesystem::path& file, uint64_t length);
+// The same for several files, which are assumed to share a filesystem and
+// may be in directories that do not exist yet.
+void CheckFreeSpace(const std::vector<std::pair<std::filesystem::path, uint64_t>>& files);
+
+// Brings the open file up to `length` bytes according to `mode`; never
+// shrinks it. Throws std::runtime_error on failure, e.g. ENOSPC.
+void PreallocateFile(int fd, uint64_t length, PreallocationMode mode);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace utils {
+// Byte queue for socket receives. Producers reserve space and write straight
+// into it; consumers read the unconsumed bytes as one contiguous view. Rather
+// than splitting a message across the wrap point, the (small) unconsumed tail
+// is moved back to the front when the end of the storage is reached, so
+// framed messages can always be handed out without copying.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t initial_capacity = 0);
+
+    // Makes at least `size` bytes writable at WritePointer(). Invalidates
+    // views returned by Peek().
+    void Reserve(size_t size);
+    char* WritePointer();
+    size_t WritableSize() const;
+    void Commit(size_t size);
+    void Append(const char* data, size_t size);
+
+    std::string_view Peek() const;
+    void Consume(size_t size);
+    size_t Size() const;
+    bool IsEmpty() const;
+    size_t Capacity() const;
+    void Clear();
+
+private:
+    std::vector<char> storage;
+    size_t read_position = 0;
+    size_t write_position = 0;
+};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+namespace utils {
+// Streaming SHA-1: feed the message in pieces with Update, then take the
+// 20-byte digest with Finalize. Reset starts a new message.
+class Sha1 {
+public:
+    static constexpr size_t kDigestSize = 20;
+
+    Sha1();
+    ~Sha1();
+
+    Sha1(const Sha1&) = delete;
+    Sha1& operator=(const Sha1&) = delete;
+
+    void Update(std::string_view data);
+    std::string Finalize();
+    void Reset();
+
+private:
+    EVP_MD_CTX* context;
+};
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace utils {
+// SHA-1 implementations for bulk verification. kShaNi hashes one message at
+// a time with the SHA extensions; kAvx2 and kAvx512 hash 8 and 16
+// independent messages at once, one per SIMD lane; kScalar is the portable
+// fallback.
+enum class Sha1Kernel {
+    kScalar,
+    kShaNi,
+    kAvx2,
+    kAvx512,
+};
+
+const char* GetSha1KernelName(Sha1Kernel kernel);
+bool IsSha1KernelSupported(Sha1Kernel kernel);
+// Supported kernels come from CPUID on first use. The fastest one for a
+// batch depends on how many messages there are to fill the lanes with.
+Sha1Kernel GetBestSha1Kernel(size_t batch_size);
+
+// SHA-1 of `count` independent messages; digests[i] gets the 20-byte
+// digest of messages[i]. Without a kernel, GetBestSha1Kernel(count).
+void CalculateSHA1Many(const std::string_view* messages, size_t count, std::string* digests);
+void CalculateSHA1Many(Sha1Kernel kernel, const std::string_view* messages, size_t count, std::string* digests);
+}
@@ -0,0 +1,189 @@
+#include "core/DirectStorage.hpp"
+#include "utils/PositionalWrite.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    // What the kernel asks of direct I/O on this file; older kernels do not
+    // say, and the page size is what every filesystem accepts.
+    size_t GetDirectIoAlignment(const std::filesystem::path& file) {
+        size_t alignment = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#ifdef STATX_DIOALIGN
+        struct statx file_statx;
+        if (statx(AT_FDCWD, file.c_str(), 0, STATX_DIOALIGN, &file_statx) == 0 &&
+            (file_statx.stx_mask & STATX_DIOALIGN) && file_statx.stx_dio_offset_align != 0) {
+            alignment = std::max<size_t>(file_statx.stx_dio_offset_align, file_statx.stx_dio_mem_align);
+        }
+#else
+        (void)file;
+#endif
+        return alignment;
+    }
+
+    struct FreeDeleter {
+        void operator()(char* data) const {
+            std::free(data);
+        }
+    };
+}
+
+// The files are assumed to share a filesystem, and so an alignment. The
+// first one is opened right away, so a filesystem without O_DIRECT
+// support fails here rather than on the first piece.
+DirectStorage::DirectStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files)
+    : direct_files(directory, files, O_WRONLY | O_DIRECT)
+    , buffered_files(directory, files)
+    , alignment(static_cast<size_t>(sysconf(_SC_PAGESIZE))) {
+    for (size_t i = 0; i < direct_files.GetFileCount(); ++i) {
+        if (direct_files.GetLength(i) > 0) {
+            alignment = GetDirectIoAlignment(direct_files.GetPath(i));
+            direct_files.GetDescriptor(i);
+            break;
+        }
+    }
+    split_alignment = std::max(alignment, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+}
+
+const char* DirectStorage::GetName() const {
+    return "direct";
+}
+
+size_t DirectStorage::GetAlignment() const {
+    return alignment;
+}
+
+void DirectStorage::Write(uint64_t offset, std::string_view data, Callback on_complete) {
+    WriteGathered(offset, {data}, std::move(on_complete));
+}
+
+void DirectStorage::WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                                  Callback on_complete) {
+    uint64_t length = 0;
+    for (std::string_view part : parts) {
+        length += part.size();
+    }
+    std::vector<FileSpan> spans;
+    direct_files.Map(offset, length, spans);
+
+    for (const FileSpan& span : spans) {
+        uint64_t begin = span.torrent_offset - offset;
+        if (!WriteSpan(span.file_index, span.file_offset, SliceParts(parts, begin, begin + span.length))) {
+            on_complete(false);
+            return;
+        }
+    }
+    on_complete(true);
+}
+
+bool DirectStorage::WriteSpan(size_t file_index, uint64_t file_offset, const std::vector<std::string_view>& parts) {
+    uint64_t length = 0;
+    for (std::string_view part : parts) {
+        length += part.size();
+    }
+    // Cut at page boundaries even where the device would take less: a page
+    // the buffered head or tail dirties must not overlap a direct write of
+    // the neighbouring piece, which another disk thread may be issuing at
+    // the same time. Written back later, that stale page would overwrite
+    // the direct data.
+    uint64_t end = file_offset + length;
+    uint64_t body_begin = std::min(end, (file_offset + split_alignment - 1) / split_alignment * split_alignment);
+    uint64_t body_end = std::max(body_begin, end / split_alignment * split_alignment);
+
+    return WriteBuffered(file_index, file_offset, SliceParts(parts, 0, body_begin - file_offset)) &&
+           WriteDirect(file_index, body_begin,
+                       SliceParts(parts, body_begin - file_offset, body_end - file_offset)) &&
+           WriteBuffered(file_index, body_end, SliceParts(parts, body_end - file_offset, length));
+}
+
+bool DirectStorage::WriteDirect(size_t file_index, uint64_t file_offset, const std::vector<std::string_view>& parts) {
+    if (parts.empty()) {
+        return true;
+    }
+
+    // Pooled piece buffers are aligned, so a whole piece at an aligned
+    // offset goes out as it is; anything else is gathered into one copy.
+    std::vector<iovec> vectors;
+    std::unique_ptr<char, FreeDeleter> copy;
+    bool is_aligned = std::all_of(parts.begin(), parts.end(), [this](std::string_view part) {
+        return reinterpret_cast<uintptr_t>(part.data()) % alignment == 0 && part.size() % alignment == 0;
+    });
+    if (is_aligned) {
+        for (std::string_view part : parts) {
+            vectors.push_back({const_cast<char*>(part.data()), part.size()});
+        }
+    } else {
+        size_t length = 0;
+        for (std::string_view part : parts) {
+            length += part.size();
+        }
+        copy.reset(static_cast<char*>(std::aligned_alloc(alignment, length)));
+        if (!copy) {
+            std::cerr << "Failed to allocate a " << length << " byte direct I/O buffer" << std::endl;
+            return false;
+        }
+        char* position = copy.get();
+        for (std::string_view part : parts) {
+            position = std::copy(part.begin(), part.end(), position);
+        }
+        vectors.push_back({copy.get(), length});
+    }
+
+    try {
+        if (!utils::WriteAt(direct_files.GetDescriptor(file_index), file_offset, vectors)) {
+            throw std::runtime_error(strerror(errno));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Direct write to " << direct_files.GetPath(file_index).string() << " at offset "
+                  << file_offset << " failed: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DirectStorage::WriteBuffered(size_t file_index, uint64_t file_offset,
+                                  const std::vector<std::string_view>& parts) {
+    std::vector<iovec> vectors;
+    for (std::string_view part : parts) {
+        vectors.push_back({const_cast<char*>(part.data()), part.size()});
+    }
+    if (vectors.empty()) {
+        return true;
+    }
+    try {
+        if (!utils::WriteAt(buffered_files.GetDescriptor(file_index), file_offset, vectors)) {
+            throw std::runtime_error(strerror(errno));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Write to " << buffered_files.GetPath(file_index).string() << " at offset " << file_offset
+                  << " failed: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void DirectStorage::Flush() {
+    // Direct writes bypass the page cache and are on the device when they
+    // complete; the buffered heads and tails are in the page cache.
+}
+
+// Direct writes skip the page cache, not the device's cache or the
+// filesystem's metadata, e.g. for blocks of a sparse file.
+void DirectStorage::Sync() {
+    auto sync = [](const FileSet& files) {
+        files.ForEachOpenDescriptor([&files](size_t file_index, int fd) {
+            if (fdatasync(fd) == -1) {
+                std::cerr << "fdatasync of " << files.GetPath(file_index).string() << " failed: "
+                          << strerror(errno) << std::endl;
+            }
+        });
+    };
+    sync(direct_files);
+    sync(buffered_files);
+}
@@ -0,0 +1,79 @@
+#include "core/DiskIoPool.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace {
+    // Enough to keep an NVMe queue busy with piece-sized writes; a write-back
+    // cache or io_uring in front of the disk needs no more than one.
+    constexpr size_t kDefaultThreads = 2;
+}
+
+DiskIoPool::DiskIoPool(size_t thread_count) {
+    thread_count = std::max<size_t>(1, thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back([this]() { Run(); });
+    }
+}
+
+DiskIoPool::~DiskIoPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopped = true;
+    }
+    has_work.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void DiskIoPool::Submit(Job job) {
+    queue_depth.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(job));
+    }
+    has_work.notify_one();
+}
+
+void DiskIoPool::Drain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    is_idle.wait(lock, [this]() { return queue_depth.load() == 0; });
+}
+
+size_t DiskIoPool::QueueDepth() const {
+    return queue_depth.load(std::memory_order_relaxed);
+}
+
+size_t DiskIoPool::ThreadCount() const {
+    return threads.size();
+}
+
+size_t DiskIoPool::DefaultThreadCount() {
+    return kDefaultThreads;
+}
+
+void DiskIoPool::Run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            has_work.wait(lock, [this]() { return is_stopped || !queue.empty(); });
+            if (queue.empty()) {
+                return; // stopped and drained
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        try {
+            job();
+        } catch (const std::exception& e) {
+            std::cerr << "Disk job failed: " << e.what() << std::endl;
+        }
+
+        if (queue_depth.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_idle.notify_all();
+        }
+    }
+}
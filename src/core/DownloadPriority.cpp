@@ -0,0 +1,113 @@
+#include "core/DownloadPriority.hpp"
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    constexpr size_t kAllFiles = std::numeric_limits<size_t>::max();
+
+    size_t ParseFileIndex(const std::string& text, const std::string& rule) {
+        if (text.empty() || text.find_first_not_of("0123456789") != std::string::npos) {
+            throw std::invalid_argument("Bad file index '" + text + "' in file priority " + rule);
+        }
+        return std::stoull(text);
+    }
+}
+
+const char* GetDownloadPriorityName(DownloadPriority priority) {
+    switch (priority) {
+        case DownloadPriority::kSkip:
+            return "skip";
+        case DownloadPriority::kLow:
+            return "low";
+        case DownloadPriority::kNormal:
+            return "normal";
+        case DownloadPriority::kHigh:
+            return "high";
+    }
+    return "unknown";
+}
+
+DownloadPriority ParseDownloadPriority(const std::string& name) {
+    for (DownloadPriority priority : {DownloadPriority::kSkip, DownloadPriority::kLow, DownloadPriority::kNormal,
+                                      DownloadPriority::kHigh}) {
+        if (name == GetDownloadPriorityName(priority)) {
+            return priority;
+        }
+    }
+    throw std::invalid_argument("Unknown download priority: " + name);
+}
+
+FilePriorityRule ParseFilePriorityRule(const std::string& rule) {
+    size_t equals = rule.rfind('=');
+    if (equals == std::string::npos) {
+        throw std::invalid_argument("File priority " + rule + " is not <files>=<priority>");
+    }
+
+    FilePriorityRule result;
+    result.priority = ParseDownloadPriority(rule.substr(equals + 1));
+    std::string files = rule.substr(0, equals);
+    if (files == "*") {
+        result.ranges.emplace_back(0, kAllFiles);
+        return result;
+    }
+
+    std::istringstream list(files);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        size_t dash = item.find('-');
+        if (dash == std::string::npos) {
+            size_t index = ParseFileIndex(item, rule);
+            result.ranges.emplace_back(index, index);
+            continue;
+        }
+        size_t first = ParseFileIndex(item.substr(0, dash), rule);
+        size_t last = ParseFileIndex(item.substr(dash + 1), rule);
+        if (last < first) {
+            throw std::invalid_argument("Empty file range " + item + " in file priority " + rule);
+        }
+        result.ranges.emplace_back(first, last);
+    }
+    if (result.ranges.empty()) {
+        throw std::invalid_argument("No files in file priority " + rule);
+    }
+    return result;
+}
+
+std::vector<DownloadPriority> ResolveFilePriorities(const std::vector<FilePriorityRule>& rules, size_t file_count) {
+    std::vector<DownloadPriority> priorities(file_count, DownloadPriority::kNormal);
+    for (const FilePriorityRule& rule : rules) {
+        for (auto [first, last] : rule.ranges) {
+            if (last == kAllFiles) {
+                last = file_count - 1;
+            } else if (last >= file_count) {
+                throw std::invalid_argument("No file " + std::to_string(last) + ": the torrent has " +
+                                            std::to_string(file_count) + " files");
+            }
+            for (size_t i = first; i <= last && i < file_count; ++i) {
+                priorities[i] = rule.priority;
+            }
+        }
+    }
+    return priorities;
+}
+
+// Each file raises the pieces it overlaps, so the cost is one pass over
+// the files plus one over the pieces, however the two line up.
+std::vector<DownloadPriority> GetPiecePriorities(const std::vector<TorrentFile::File>& files,
+                                                 const std::vector<DownloadPriority>& file_priorities,
+                                                 size_t piece_length, size_t piece_count) {
+    std::vector<DownloadPriority> priorities(piece_count, DownloadPriority::kSkip);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].length == 0 || file_priorities[i] == DownloadPriority::kSkip) {
+            continue;
+        }
+        size_t first = files[i].offset / piece_length;
+        size_t last = std::min(piece_count, (files[i].offset + files[i].length - 1) / piece_length + 1);
+        for (size_t piece = first; piece < last; ++piece) {
+            priorities[piece] = std::max(priorities[piece], file_priorities[i]);
+        }
+    }
+    return priorities;
+}
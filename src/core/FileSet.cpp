@@ -0,0 +1,96 @@
+#include "core/FileSet.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+FileSet::FileSet(const std::filesystem::path& directory, std::vector<TorrentFile::File> files, int open_flags)
+    : entries(std::make_unique<Entry[]>(files.size()))
+    , file_count(files.size())
+    , open_flags(open_flags) {
+    for (size_t i = 0; i < file_count; ++i) {
+        entries[i].path = directory / files[i].path;
+        entries[i].offset = files[i].offset;
+        entries[i].length = files[i].length;
+        total_length = std::max(total_length, files[i].offset + files[i].length);
+        if (files[i].length > 0) {
+            span_starts.push_back(files[i].offset);
+            span_files.push_back(i);
+        }
+    }
+}
+
+FileSet::~FileSet() {
+    for (size_t i = 0; i < file_count; ++i) {
+        if (entries[i].fd != -1) {
+            close(entries[i].fd);
+        }
+    }
+}
+
+size_t FileSet::GetFileCount() const {
+    return file_count;
+}
+
+const std::filesystem::path& FileSet::GetPath(size_t file_index) const {
+    return entries[file_index].path;
+}
+
+uint64_t FileSet::GetLength(size_t file_index) const {
+    return entries[file_index].length;
+}
+
+uint64_t FileSet::GetTotalLength() const {
+    return total_length;
+}
+
+void FileSet::Map(uint64_t offset, uint64_t length, std::vector<FileSpan>& spans) const {
+    uint64_t end = std::min(offset + length, total_length);
+    // The last non-empty file starting at or before `offset`.
+    size_t i = std::upper_bound(span_starts.begin(), span_starts.end(), offset) - span_starts.begin();
+    i = i == 0 ? 0 : i - 1;
+    for (; i < span_starts.size() && offset < end; ++i) {
+        const Entry& entry = entries[span_files[i]];
+        uint64_t file_end = entry.offset + entry.length;
+        if (offset >= file_end) {
+            continue;
+        }
+        offset = std::max(offset, entry.offset); // past a gap between files
+        if (offset >= end) {
+            break;
+        }
+        uint64_t span_end = std::min(end, file_end);
+        spans.push_back({span_files[i], offset - entry.offset, offset, span_end - offset});
+        offset = span_end;
+    }
+}
+
+int FileSet::GetDescriptor(size_t file_index) {
+    Entry& entry = entries[file_index];
+    int fd = entry.fd.load(std::memory_order_acquire);
+    if (fd != -1) {
+        return fd;
+    }
+
+    std::lock_guard<std::mutex> lock(open_mutex);
+    fd = entry.fd.load(std::memory_order_relaxed);
+    if (fd == -1) {
+        fd = open(entry.path.c_str(), open_flags | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open " + entry.path.string() + ": " + strerror(errno));
+        }
+        entry.fd.store(fd, std::memory_order_release);
+    }
+    return fd;
+}
+
+void FileSet::ForEachOpenDescriptor(const std::function<void(size_t file_index, int fd)>& visit) const {
+    for (size_t i = 0; i < file_count; ++i) {
+        int fd = entries[i].fd.load(std::memory_order_acquire);
+        if (fd != -1) {
+            visit(i, fd);
+        }
+    }
+}
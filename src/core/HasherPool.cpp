@@ -0,0 +1,84 @@
+#include "core/HasherPool.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace {
+    constexpr size_t kMaxDefaultThreads = 4;
+}
+
+HasherPool::HasherPool(size_t thread_count) {
+    thread_count = std::max<size_t>(1, thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (auto& worker : workers) {
+        worker->thread = std::thread([this, &worker = *worker]() { Run(worker); });
+    }
+}
+
+HasherPool::~HasherPool() {
+    for (auto& worker : workers) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->is_stopped = true;
+        }
+        worker->has_work.notify_one();
+    }
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+}
+
+void HasherPool::Submit(size_t key, Job job) {
+    Worker& worker = *workers[key % workers.size()];
+    queue_depth.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.queue.push_back(std::move(job));
+    }
+    worker.has_work.notify_one();
+}
+
+void HasherPool::Drain() {
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    is_idle.wait(lock, [this]() { return queue_depth.load() == 0; });
+}
+
+size_t HasherPool::QueueDepth() const {
+    return queue_depth.load(std::memory_order_relaxed);
+}
+
+size_t HasherPool::ThreadCount() const {
+    return workers.size();
+}
+
+size_t HasherPool::DefaultThreadCount() {
+    size_t cores = std::thread::hardware_concurrency();
+    return std::clamp<size_t>(cores / 2, 1, kMaxDefaultThreads);
+}
+
+void HasherPool::Run(Worker& worker) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            worker.has_work.wait(lock, [&worker]() { return worker.is_stopped || !worker.queue.empty(); });
+            if (worker.queue.empty()) {
+                return; // stopped and drained
+            }
+            job = std::move(worker.queue.front());
+            worker.queue.pop_front();
+        }
+
+        try {
+            job();
+        } catch (const std::exception& e) {
+            std::cerr << "Hasher job failed: " << e.what() << std::endl;
+        }
+
+        if (queue_depth.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            is_idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#include "core/MmapStorage.hpp"
+#include "utils/Preallocation.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+MmapStorage::MmapStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files)
+    : files(directory, files, O_RDWR)
+    , mappings(std::make_unique<std::atomic<char*>[]>(files.size())) {
+    for (size_t i = 0; i < files.size(); ++i) {
+        mappings[i] = nullptr;
+    }
+}
+
+MmapStorage::~MmapStorage() {
+    for (size_t i = 0; i < files.GetFileCount(); ++i) {
+        if (char* mapping = mappings[i].load()) {
+            munmap(mapping, files.GetLength(i)); // dirty pages stay in the page cache
+        }
+    }
+}
+
+const char* MmapStorage::GetName() const {
+    return "mmap";
+}
+
+char* MmapStorage::GetMapping(size_t file_index) {
+    char* mapping = mappings[file_index].load(std::memory_order_acquire);
+    if (mapping) {
+        return mapping;
+    }
+
+    std::lock_guard<std::mutex> lock(map_mutex);
+    mapping = mappings[file_index].load(std::memory_order_relaxed);
+    if (mapping) {
+        return mapping;
+    }
+    int fd = files.GetDescriptor(file_index);
+    uint64_t length = files.GetLength(file_index);
+    utils::PreallocateFile(fd, length, utils::PreallocationMode::kFull);
+    void* address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("Failed to map " + files.GetPath(file_index).string() + ": " + strerror(errno));
+    }
+    mapping = static_cast<char*>(address);
+    // Pieces land in any order and overwrite whole pages; reading around a
+    // faulting page would be wasted.
+    madvise(mapping, length, MADV_RANDOM);
+    mappings[file_index].store(mapping, std::memory_order_release);
+    return mapping;
+}
+
+// Disk threads copy disjoint pieces, so no lock is needed once a file
+// is mapped.
+void MmapStorage::Write(uint64_t offset, std::string_view data, Callback on_complete) {
+    std::vector<FileSpan> spans;
+    files.Map(offset, data.size(), spans);
+    for (const FileSpan& span : spans) {
+        try {
+            char* mapping = GetMapping(span.file_index);
+            std::memcpy(mapping + span.file_offset, data.data() + (span.torrent_offset - offset), span.length);
+            sync_file_range(files.GetDescriptor(span.file_index), static_cast<off64_t>(span.file_offset),
+                            static_cast<off64_t>(span.length), SYNC_FILE_RANGE_WRITE);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            on_complete(false);
+            return;
+        }
+    }
+    on_complete(true);
+}
+
+void MmapStorage::Flush() {
+    // Stores into the mappings are in the page cache the moment they are made.
+}
+
+void MmapStorage::Sync() {
+    for (size_t i = 0; i < files.GetFileCount(); ++i) {
+        char* mapping = mappings[i].load(std::memory_order_acquire);
+        if (mapping && msync(mapping, files.GetLength(i), MS_SYNC) == -1) {
+            std::cerr << "msync of " << files.GetPath(i).string() << " failed: " << strerror(errno) << std::endl;
+        }
+    }
+}
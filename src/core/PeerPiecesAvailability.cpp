@@ -0,0 +1,23 @@
+#include "core/PeerPiecesAvailability.hpp"
+
+PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield, size_t size) :
+    bitfield(std::move(bitfield)),
+    size(size) {
+    this->bitfield.resize(size, '\0'); // a short bitfield must not be read past its end
+}
+
+bool PeerPiecesAvailability::IsPieceAvailable(size_t piece_index) const {
+    if (piece_index >= (size << 3)) // size * 8
+        return false;
+    return (bitfield[piece_index >> 3] >> (7 - (piece_index & 7))) & 1; // piece_index % 8
+}
+
+void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
+    if (pieceIndex < (size << 3)) { // size * 8
+        bitfield[pieceIndex >> 3] |= (1 << (7 - (pieceIndex & 7))); // pieceIndex % 8
+    }
+}
+
+size_t PeerPiecesAvailability::Size() const {
+    return size;
+}
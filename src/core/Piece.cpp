@@ -2,40 +2,42 @@
 #include "utils/byte_tools.hpp"
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 
-Piece::Piece(size_t index, size_t length, const std::string& hash)
-    : index(index), length(length), hash(hash), bytes_downloaded(0) {
+Piece::Piece(size_t index, size_t length, const std::string& hash, std::shared_ptr<utils::BufferPool> buffer_pool)
+    : index(index), length(length), hash(hash), bytes_downloaded(0), buffer_pool(std::move(buffer_pool)) {
 
     size_t offset = 0;
     while (offset < length) {
         size_t block_length = std::min(kBlockSize, length - offset);
-        blocks.push_back(Block{index, offset, block_length, Block::kMissing, ""});
+        blocks.push_back(Block{index, offset, block_length, Block::kMissing, 0});
         offset += block_length;
     }
 }
 
 bool Piece::HashMatches() const {
-    if (!AllBlocksRetrieved()) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!AllBlocksRetrievedLocked() || digest.empty()) {
         return false;
     }
 
-    std::string piece_data = GetData();
-    std::string calculated_hash = utils::CalculateSHA1(piece_data);
-    bool matches = (calculated_hash == hash);
+    bool matches = (digest == hash);
 
     if (!matches) {
         std::cout << "Hash mismatch for piece " << index
                   << " (expected: " << utils::BytesToHex(hash)
-                  << ", got: " << utils::BytesToHex(calculated_hash) << ")" << std::endl;
+                  << ", got: " << utils::BytesToHex(digest) << ")" << std::endl;
     }
 
     return matches;
 }
 
 Block* Piece::GetFirstMissingBlock() {
+    std::lock_guard<std::mutex> lock(mutex);
     for (auto& block : blocks) {
         if (block.status == Block::kMissing) {
             block.status = Block::kPending;
+            block.request_count = 1;
             return &block;
         }
     }
@@ -46,51 +48,134 @@ size_t Piece::GetIndex() const {
     return index;
 }
 
-void Piece::SaveBlock(size_t blockOffset, std::string block_data) {
+const Block* Piece::GetBlockToDuplicate(size_t max_requests,
+                                       const std::function<bool(const Block&)>& already_requested) {
+    std::lock_guard<std::mutex> lock(mutex);
     for (auto& block : blocks) {
-        if (block.offset == blockOffset) {
-            if (block.status != Block::kPending) {
-                throw std::runtime_error("Block at offset " + std::to_string(blockOffset) +
-                                       " is not in pending state");
-            }
-
-            block.data = std::move(block_data);
-            block.status = Block::kRetrieved;
-            bytes_downloaded += block.data.size();
-            return;
+        if (block.status == Block::kPending && block.request_count < max_requests && !already_requested(block)) {
+            ++block.request_count;
+            return &block;
         }
     }
-    throw std::runtime_error("Block not found at offset " + std::to_string(blockOffset));
+    return nullptr;
+}
+
+void Piece::CancelBlockRequest(size_t blockOffset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Block* block = FindBlockLocked(blockOffset);
+    if (block && block->status == Block::kPending && block->request_count > 0) {
+        --block->request_count;
+    }
+}
+
+bool Piece::IsBlockRetrieved(size_t blockOffset) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    const Block* block = FindBlockLocked(blockOffset);
+    return block && block->status == Block::kRetrieved;
+}
+
+// A block is accepted whether it is pending or missing: a duplicate request
+// from endgame may still be answered after the piece was reset.
+Piece::SaveResult Piece::SaveBlock(size_t blockOffset, std::string_view block_data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Block* block = FindBlockLocked(blockOffset);
+    if (!block) {
+        throw std::runtime_error("Block not found at offset " + std::to_string(blockOffset));
+    }
+    if (block->status == Block::kRetrieved) {
+        return SaveResult::kDuplicate;
+    }
+    if (block_data.size() != block->length) {
+        throw std::runtime_error("Block at offset " + std::to_string(blockOffset) +
+                               " has length " + std::to_string(block_data.size()) +
+                               " instead of " + std::to_string(block->length));
+    }
+
+    if (!buffer) {
+        buffer = buffer_pool->Acquire();
+    }
+    std::memcpy(buffer.get() + block->offset, block_data.data(), block_data.size());
+    block->status = Block::kRetrieved;
+    bytes_downloaded += block_data.size();
+    return AllBlocksRetrievedLocked() ? SaveResult::kCompleted : SaveResult::kSaved;
 }
 
 bool Piece::AllBlocksRetrieved() const {
-    return std::all_of(blocks.begin(), blocks.end(), [](const Block& block) {
-        return block.status == Block::kRetrieved;
-    });
+    std::lock_guard<std::mutex> lock(mutex);
+    return AllBlocksRetrievedLocked();
 }
 
-std::string Piece::GetData() const {
-    std::string result;
-    result.reserve(length);
+bool Piece::AllBlocksRetrievedLocked() const {
+    return bytes_downloaded == length;
+}
+
+Block* Piece::FindBlockLocked(size_t blockOffset) {
+    if (blockOffset % kBlockSize != 0 || blockOffset / kBlockSize >= blocks.size()) {
+        return nullptr;
+    }
+    return &blocks[blockOffset / kBlockSize];
+}
 
-    for (const auto& block : blocks) {
+const Block* Piece::FindBlockLocked(size_t blockOffset) const {
+    return const_cast<Piece*>(this)->FindBlockLocked(blockOffset);
+}
+
+bool Piece::MarkHashScheduled() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (is_hash_scheduled) {
+        return false;
+    }
+    is_hash_scheduled = true;
+    return true;
+}
+
+// Retrieved blocks are never written again until Reset, which waits for
+// is_hashing to clear before touching the buffer.
+void Piece::HashRetrievedBlocks() {
+    std::unique_lock<std::mutex> lock(mutex);
+    is_hash_scheduled = false;
+    is_hashing = true;
+    while (hashed_bytes < length && blocks[hashed_bytes / kBlockSize].status == Block::kRetrieved) {
+        std::string_view block_data(buffer.get() + hashed_bytes, blocks[hashed_bytes / kBlockSize].length);
+        lock.unlock();
+        hasher.Update(block_data);
+        lock.lock();
+        hashed_bytes += block_data.size();
+    }
+    if (hashed_bytes == length && digest.empty()) {
+        digest = hasher.Finalize();
+    }
+    is_hashing = false;
+    hashing_finished.notify_all();
+}
+
+std::string_view Piece::GetData() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!buffer) {
+        return {};
+    }
+    return std::string_view(buffer.get(), length);
+}
+
+bool Piece::CopyRetrievedBlocks(std::vector<size_t>& offsets, std::string& data) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!buffer) {
+        return false;
+    }
+    size_t copied = 0;
+    for (const Block& block : blocks) {
         if (block.status == Block::kRetrieved) {
-            if (block.data.size() != block.length) {
-                std::cerr << "WARNING: Block at offset " << block.offset
-                          << " has incorrect size: " << block.data.size()
-                          << " != " << block.length << std::endl;
-            }
-            result += block.data;
-        } else {
-            result.append(block.length, '\0');
+            offsets.push_back(block.offset);
+            data.append(buffer.get() + block.offset, block.length);
+            ++copied;
         }
     }
-
-    return result;
+    return copied > 0;
 }
 
 std::string Piece::GetDataHash() const {
-    return utils::CalculateSHA1(GetData());
+    std::lock_guard<std::mutex> lock(mutex);
+    return digest;
 }
 
 const std::string& Piece::GetHash() const {
@@ -98,14 +183,29 @@ const std::string& Piece::GetHash() const {
 }
 
 void Piece::Reset() {
+    std::unique_lock<std::mutex> lock(mutex);
+    hashing_finished.wait(lock, [this]() { return !is_hashing; });
     bytes_downloaded = 0;
     for (auto& block : blocks) {
         block.status = Block::kMissing;
-        block.data.clear();
+        block.request_count = 0;
     }
+    buffer.reset();
+    hasher.Reset();
+    hashed_bytes = 0;
+    digest.clear();
+}
+
+// Hands the buffer of a piece that has been written out back to the pool;
+// the blocks stay marked as retrieved.
+void Piece::ReleaseData() {
+    std::unique_lock<std::mutex> lock(mutex);
+    hashing_finished.wait(lock, [this]() { return !is_hashing; });
+    buffer.reset();
 }
 
 bool Piece::IsDownloading() const {
+    std::lock_guard<std::mutex> lock(mutex);
     return std::any_of(blocks.begin(), blocks.end(), [](const Block& block) {
         return block.status == Block::kPending;
     });
@@ -120,5 +220,6 @@ size_t Piece::GetLength() const {
 }
 
 size_t Piece::GetBytesDownloaded() const {
+    std::lock_guard<std::mutex> lock(mutex);
     return bytes_downloaded;
 }
@@ -0,0 +1,164 @@
+#include "core/PiecePicker.hpp"
+
+PiecePicker::PiecePicker(size_t piece_count, size_t first_piece, size_t stride)
+    : piece_count(piece_count)
+    , first_piece(first_piece)
+    , stride(stride)
+    , availability(first_piece < piece_count ? (piece_count - first_piece + stride - 1) / stride : 0, 0)
+    , priorities(availability.size(), DownloadPriority::kNormal)
+    , position_in_bucket(availability.size(), kNotWaiting) {}
+
+bool PiecePicker::Owns(size_t piece_index) const {
+    return piece_index < piece_count && piece_index >= first_piece && (piece_index - first_piece) % stride == 0;
+}
+
+size_t PiecePicker::Slot(size_t piece_index) const {
+    return (piece_index - first_piece) / stride;
+}
+
+void PiecePicker::AddPiece(size_t piece_index) {
+    if (!Owns(piece_index) || IsWaiting(piece_index)) {
+        return;
+    }
+    Link(piece_index);
+    ++waiting_count;
+}
+
+void PiecePicker::RemovePiece(size_t piece_index) {
+    if (!IsWaiting(piece_index)) {
+        return;
+    }
+    Unlink(piece_index);
+    --waiting_count;
+}
+
+bool PiecePicker::IsWaiting(size_t piece_index) const {
+    return Owns(piece_index) && position_in_bucket[Slot(piece_index)] != kNotWaiting;
+}
+
+size_t PiecePicker::WaitingCount() const {
+    return waiting_count;
+}
+
+void PiecePicker::Clear() {
+    for (std::vector<std::vector<size_t>>& priority_buckets : buckets) {
+        for (std::vector<size_t>& bucket : priority_buckets) {
+            for (size_t piece_index : bucket) {
+                position_in_bucket[Slot(piece_index)] = kNotWaiting;
+            }
+            bucket.clear();
+        }
+    }
+    waiting_count = 0;
+}
+
+void PiecePicker::AddPeer(const PeerPiecesAvailability& peer) {
+    for (size_t i = first_piece; i < piece_count; i += stride) {
+        if (peer.IsPieceAvailable(i)) {
+            IncrementAvailability(i);
+        }
+    }
+}
+
+void PiecePicker::RemovePeer(const PeerPiecesAvailability& peer) {
+    for (size_t i = first_piece; i < piece_count; i += stride) {
+        if (peer.IsPieceAvailable(i)) {
+            DecrementAvailability(i);
+        }
+    }
+}
+
+void PiecePicker::IncrementAvailability(size_t piece_index) {
+    if (!Owns(piece_index)) {
+        return;
+    }
+    bool is_waiting = IsWaiting(piece_index);
+    if (is_waiting) {
+        Unlink(piece_index);
+    }
+    ++availability[Slot(piece_index)];
+    if (is_waiting) {
+        Link(piece_index);
+    }
+}
+
+void PiecePicker::DecrementAvailability(size_t piece_index) {
+    if (!Owns(piece_index) || availability[Slot(piece_index)] == 0) {
+        return;
+    }
+    bool is_waiting = IsWaiting(piece_index);
+    if (is_waiting) {
+        Unlink(piece_index);
+    }
+    --availability[Slot(piece_index)];
+    if (is_waiting) {
+        Link(piece_index);
+    }
+}
+
+size_t PiecePicker::GetAvailability(size_t piece_index) const {
+    return Owns(piece_index) ? availability[Slot(piece_index)] : 0;
+}
+
+void PiecePicker::SetPriority(size_t piece_index, DownloadPriority priority) {
+    if (!Owns(piece_index)) {
+        return;
+    }
+    bool is_waiting = IsWaiting(piece_index);
+    if (is_waiting) {
+        Unlink(piece_index);
+    }
+    priorities[Slot(piece_index)] = priority;
+    if (is_waiting) {
+        Link(piece_index);
+    }
+}
+
+DownloadPriority PiecePicker::GetPriority(size_t piece_index) const {
+    return Owns(piece_index) ? priorities[Slot(piece_index)] : DownloadPriority::kSkip;
+}
+
+size_t PiecePicker::PickRarest(const PeerPiecesAvailability* peer) const {
+    for (size_t priority = kDownloadPriorityCount; priority-- > 0;) {
+        const std::vector<std::vector<size_t>>& priority_buckets = buckets[priority];
+        // Bucket 0 holds pieces no connected peer has announced; only an
+        // unfiltered pick falls back to it.
+        for (size_t count = 1; count < priority_buckets.size(); ++count) {
+            for (size_t piece_index : priority_buckets[count]) {
+                if (!peer || peer->IsPieceAvailable(piece_index)) {
+                    return piece_index;
+                }
+            }
+        }
+        if (!peer && !priority_buckets.empty() && !priority_buckets[0].empty()) {
+            return priority_buckets[0].front();
+        }
+    }
+    return kNoPiece;
+}
+
+std::vector<size_t>& PiecePicker::BucketOf(size_t piece_index) {
+    std::vector<std::vector<size_t>>& priority_buckets = buckets[static_cast<size_t>(priorities[Slot(piece_index)])];
+    size_t count = availability[Slot(piece_index)];
+    if (count >= priority_buckets.size()) {
+        priority_buckets.resize(count + 1);
+    }
+    return priority_buckets[count];
+}
+
+void PiecePicker::Link(size_t piece_index) {
+    std::vector<size_t>& bucket = BucketOf(piece_index);
+    position_in_bucket[Slot(piece_index)] = bucket.size();
+    bucket.push_back(piece_index);
+}
+
+// O(1): the last piece of the bucket takes the removed piece's place.
+void PiecePicker::Unlink(size_t piece_index) {
+    std::vector<size_t>& bucket = BucketOf(piece_index);
+    size_t position = position_in_bucket[Slot(piece_index)];
+    size_t moved = bucket.back();
+    bucket[position] = moved;
+    position_in_bucket[Slot(moved)] = position;
+    bucket.pop_back();
+    position_in_bucket[Slot(piece_index)] = kNotWaiting;
+}
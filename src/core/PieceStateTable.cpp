@@ -0,0 +1,75 @@
+#include "core/PieceStateTable.hpp"
+
+PieceStateTable::PieceStateTable(size_t piece_count)
+    : piece_count(piece_count)
+    , word_count((piece_count + 63) / 64)
+    , states(new std::atomic<uint8_t>[piece_count])
+    , bits(new std::atomic<uint64_t>[kStateCount * word_count]) {
+    for (size_t i = 0; i < piece_count; ++i) {
+        states[i].store(static_cast<uint8_t>(PieceState::kMissing), std::memory_order_relaxed);
+    }
+    for (size_t w = 0; w < kStateCount * word_count; ++w) {
+        bits[w].store(0, std::memory_order_relaxed);
+    }
+    for (size_t w = 0; w < word_count; ++w) {
+        Word(PieceState::kMissing, w).store(ValidBits(w), std::memory_order_relaxed);
+    }
+    for (std::atomic<size_t>& count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    counts[static_cast<size_t>(PieceState::kMissing)].store(piece_count, std::memory_order_relaxed);
+}
+
+size_t PieceStateTable::Size() const {
+    return piece_count;
+}
+
+PieceState PieceStateTable::Get(size_t piece_index) const {
+    return static_cast<PieceState>(states[piece_index].load(std::memory_order_acquire));
+}
+
+bool PieceStateTable::Is(size_t piece_index, PieceState state) const {
+    return Get(piece_index) == state;
+}
+
+bool PieceStateTable::Transition(size_t piece_index, PieceState from, PieceState to) {
+    if (Get(piece_index) != from) {
+        return false;
+    }
+    states[piece_index].store(static_cast<uint8_t>(to), std::memory_order_release);
+    Move(piece_index, from, to);
+    return true;
+}
+
+PieceState PieceStateTable::Set(size_t piece_index, PieceState to) {
+    PieceState from = Get(piece_index);
+    states[piece_index].store(static_cast<uint8_t>(to), std::memory_order_release);
+    Move(piece_index, from, to);
+    return from;
+}
+
+size_t PieceStateTable::Count(PieceState state) const {
+    return counts[static_cast<size_t>(state)].load(std::memory_order_acquire);
+}
+
+// The bit is set in the new state before it leaves the old one, so a piece
+// is never missing from every walk while it moves.
+void PieceStateTable::Move(size_t piece_index, PieceState from, PieceState to) {
+    if (from == to) {
+        return;
+    }
+    uint64_t bit = uint64_t(1) << (piece_index % 64);
+    Word(to, piece_index / 64).fetch_or(bit, std::memory_order_release);
+    Word(from, piece_index / 64).fetch_and(~bit, std::memory_order_release);
+    counts[static_cast<size_t>(to)].fetch_add(1, std::memory_order_acq_rel);
+    counts[static_cast<size_t>(from)].fetch_sub(1, std::memory_order_acq_rel);
+}
+
+std::atomic<uint64_t>& PieceStateTable::Word(PieceState state, size_t word_index) const {
+    return bits[static_cast<size_t>(state) * word_count + word_index];
+}
+
+uint64_t PieceStateTable::ValidBits(size_t word_index) const {
+    size_t used = piece_count - word_index * 64;
+    return used >= 64 ? ~uint64_t(0) : (uint64_t(1) << used) - 1;
+}
@@ -1,79 +1,684 @@
 #include "core/PieceStorage.hpp"
 #include "core/Piece.hpp"
+#include "core/Recheck.hpp"
+#include "utils/PositionalWrite.hpp"
 #include <iostream>
 #include <algorithm>
+#include <thread>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    // Idle piece buffers kept for reuse, in bytes; at least one is kept.
+    constexpr size_t kMaxIdleBufferBytes = 64 * (1 << 20);
+    // Read-ahead deadlines are this far apart, so the window is requested
+    // in order and behind any piece a reader is blocked on.
+    constexpr auto kReadAheadSpacing = std::chrono::milliseconds(1);
+}
 
-PieceStorage::PieceStorage(const TorrentFile& torrent_file, const std::filesystem::path& output_directory)
-    : output_directory(output_directory)
+PieceStorage::Shard::Shard(size_t piece_count, size_t first_piece, size_t stride)
+    : picker(piece_count, first_piece, stride) {}
+
+PieceStorage::PieceStorage(const TorrentFile& torrent_file, const std::filesystem::path& output_directory,
+                           const PieceStorageOptions& options)
+    : states(torrent_file.piece_hashes.size())
+    , buffer_pool(utils::BufferPool::Create(
+          torrent_file.piece_length,
+          std::max<size_t>(1, kMaxIdleBufferBytes / std::max<size_t>(1, torrent_file.piece_length))))
+    , output_directory(output_directory)
+    , output_path(output_directory / torrent_file.name)
+    , files(GetTorrentFiles(torrent_file))
+    , file_priorities(ResolveFilePriorities(options.file_priorities, files.size()))
+    , resume_path(GetResumeDataPath(output_path))
+    , preallocation(options.preallocation)
+    , storage_backend(options.storage_backend)
+    , write_cache(options.write_cache)
+    , durability(options.durability)
     , default_piece_length(torrent_file.piece_length)
-    , torrent_file(torrent_file) {
-
-    total_piece_count = torrent_file.piece_hashes.size();
+    , read_ahead_pieces(options.read_ahead == 0
+          ? 0 : std::max<size_t>(1, options.read_ahead / std::max<size_t>(1, torrent_file.piece_length)))
+    , total_piece_count(torrent_file.piece_hashes.size())
+    , torrent_file(torrent_file)
+    , memory_budget(options.memory_budget)
+    , disk_pool(options.disk_threads)
+    , hasher_pool(options.hasher_threads) {
 
     std::cout << "=== PIECE STORAGE INIT ===" << std::endl;
     std::cout << "Total pieces: " << total_piece_count << std::endl;
     std::cout << "Piece length: " << torrent_file.piece_length << std::endl;
     std::cout << "Total length: " << torrent_file.length << std::endl;
+    if (files.size() > 1) {
+        std::cout << "Files: " << files.size() << std::endl;
+    }
+
+    uint64_t skipped_bytes = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (file_priorities[i] == DownloadPriority::kSkip) {
+            skipped_bytes += files[i].length;
+        } else {
+            wanted_files.push_back(files[i]);
+        }
+    }
+    if (wanted_files.size() < files.size()) {
+        std::cout << "Skipping " << (files.size() - wanted_files.size()) << " of " << files.size() << " files ("
+                  << skipped_bytes << " bytes)" << std::endl;
+    }
+    std::vector<DownloadPriority> piece_priorities =
+        GetPiecePriorities(files, file_priorities, torrent_file.piece_length, total_piece_count);
+
+    // A cache that cannot fill up before the budget stops new pieces
+    // would only ever be written out by its timeouts.
+    if (memory_budget > 0 && write_cache.capacity > memory_budget / 2) {
+        write_cache.capacity = memory_budget / 2;
+    }
+
+    size_t shard_count = std::max<size_t>(1, options.shard_count);
+    for (size_t i = 0; i < shard_count; ++i) {
+        shards.push_back(std::make_unique<Shard>(total_piece_count, i, shard_count));
+    }
+
+    std::optional<ResumeData> resume_data;
+    if (!options.force_recheck) {
+        resume_data = LoadConsistentResumeData();
+    }
+    bool is_rechecked = false;
+    if (!resume_data) {
+        resume_data = RecheckExistingFile();
+        is_rechecked = resume_data.has_value();
+    }
+    InitializeOutputFile(resume_data.has_value());
 
+    pieces.reserve(total_piece_count);
     for (size_t i = 0; i < total_piece_count; ++i) {
-        size_t pieceLength = (i == total_piece_count - 1)
-            ? (torrent_file.length % torrent_file.piece_length ?: torrent_file.piece_length)
-            : torrent_file.piece_length;
+        pieces.push_back(MakePiece(i));
+        if (resume_data && resume_data->IsPieceCompleted(i)) {
+            states.Set(i, PieceState::kDone);
+        } else if (piece_priorities[i] == DownloadPriority::kSkip) {
+            states.Set(i, PieceState::kSkipped);
+        } else {
+            ShardOf(i).picker.SetPriority(i, piece_priorities[i]);
+            AddWaitingPiece(ShardOf(i), i);
+        }
+    }
+    if (resume_data) {
+        RestorePartialPieces(*resume_data);
+    }
+
+    std::cout << "Initialized " << WaitingCount() << " pieces in queue ("
+              << PiecesSavedToDiscCount() << " already on disk";
+    if (states.Count(PieceState::kSkipped) > 0) {
+        std::cout << ", " << states.Count(PieceState::kSkipped) << " skipped";
+    }
+    std::cout << ")" << std::endl;
+    if (read_ahead_pieces > 0) {
+        std::lock_guard<std::mutex> lock(deadline_mutex);
+        UpdateReadAheadLocked();
+        std::cout << "Streaming: the next " << read_ahead_pieces << " pieces are requested in order" << std::endl;
+    }
+    if (is_rechecked) {
+        CheckpointResumeData(); // the next start can skip the recheck
+    }
+}
 
-        auto piece = std::make_shared<Piece>(i, pieceLength, torrent_file.piece_hashes[i]);
-        remaining_pieces_queue.push(piece);
+std::optional<ResumeData> PieceStorage::LoadConsistentResumeData() const {
+    ResumeData resume_data;
+    try {
+        resume_data = LoadResumeData(resume_path);
+    } catch (const std::exception& e) {
+        std::cout << "Not resuming: " << e.what() << std::endl;
+        return std::nullopt;
     }
 
-    InitializeOutputFile();
-    std::cout << "Initialized " << total_piece_count << " pieces in queue" << std::endl;
+    OutputFilesStamp stamp = GetOutputFilesStamp(output_directory, files);
+    const char* problem = nullptr;
+    if (resume_data.info_hash != torrent_file.info_hash || resume_data.piece_count != total_piece_count ||
+        resume_data.file_count != files.size()) {
+        problem = "the resume data is for another torrent";
+    } else if (stamp.existing_count == 0 || stamp.size != resume_data.file_size ||
+               stamp.size > torrent_file.length) {
+        problem = "the output file is missing or has the wrong size";
+    } else if (stamp.mtime != resume_data.file_mtime) {
+        problem = "the output file was modified after the last checkpoint";
+    }
+    if (problem) {
+        std::cout << "Not resuming: " << problem << std::endl;
+        return std::nullopt;
+    }
+
+    // A file skipped last time and wanted now was never written: the
+    // pieces it shares with the files that were are done only there.
+    size_t cleared_count = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].length == 0 || file_priorities[i] == DownloadPriority::kSkip || resume_data.IsFileWanted(i)) {
+            continue;
+        }
+        size_t first = files[i].offset / torrent_file.piece_length;
+        size_t last = (files[i].offset + files[i].length - 1) / torrent_file.piece_length;
+        for (size_t piece = first; piece <= last && piece < total_piece_count; ++piece) {
+            if (resume_data.IsPieceCompleted(piece)) {
+                resume_data.ClearPieceCompleted(piece);
+                ++cleared_count;
+            }
+        }
+    }
+    if (cleared_count > 0) {
+        std::cout << "Downloading " << cleared_count << " pieces again for files skipped last time" << std::endl;
+    }
+    return resume_data;
 }
 
-void PieceStorage::InitializeOutputFile() {
-    std::string filename = (output_directory / torrent_file.name).generic_string();
-    file.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+std::optional<ResumeData> PieceStorage::RecheckExistingFile() const {
+    OutputFilesStamp stamp = GetOutputFilesStamp(output_directory, files);
+    if (stamp.size == 0) {
+        return std::nullopt; // nothing on disk to keep
+    }
+    // Anything else that is not a clean recheck stops here: the caller
+    // would start over and truncate files that may hold a finished download.
+    if (stamp.size > torrent_file.length) {
+        throw std::runtime_error("Refusing to overwrite " + output_path.string() + ": it has " +
+                                 std::to_string(stamp.size) + " bytes, more than the torrent's " +
+                                 std::to_string(torrent_file.length));
+    }
+    try {
+        return RecheckOutputFiles(torrent_file, output_directory, std::max(1u, std::thread::hardware_concurrency()));
+    } catch (const std::exception& e) {
+        throw std::runtime_error("Recheck of " + output_path.string() + " failed: " + e.what());
+    }
+}
 
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open output file: " + filename);
+// Replaces the old zero-fill through the stream: sparse and full
+// preallocation take the same time whatever the torrent size. Every wanted
+// file is created, and sized, up front; the backends only open the ones
+// pieces are written to. Skipped files are neither created nor given to
+// the backend, so the bytes of a boundary piece that fall in one are
+// verified with the piece and then dropped.
+void PieceStorage::InitializeOutputFile(bool keep_existing) {
+    std::vector<std::pair<std::filesystem::path, uint64_t>> sizes;
+    for (const TorrentFile::File& file : wanted_files) {
+        sizes.emplace_back(output_directory / file.path, file.length);
     }
+    utils::CheckFreeSpace(sizes);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t wanted_length = 0;
+    for (const TorrentFile::File& file : wanted_files) {
+        wanted_length += file.length;
+        std::filesystem::path path = output_directory / file.path;
+        std::filesystem::create_directories(path.parent_path());
+        std::string filename = path.generic_string();
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (keep_existing ? 0 : O_TRUNC), 0644);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open output file: " + filename + ": " + strerror(errno));
+        }
+        try {
+            utils::PreallocateFile(fd, file.length, preallocation);
+        } catch (const std::exception& e) {
+            close(fd);
+            throw std::runtime_error("Failed to preallocate " + filename + ": " + e.what());
+        }
+        close(fd);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
 
+    std::cout << (keep_existing ? "Resuming into" : "Created") << " output file: " << output_path.generic_string()
+              << " (";
+    if (files.size() > 1) {
+        std::cout << wanted_files.size() << " files, ";
+    }
+    std::cout << wanted_length << " bytes, " << utils::GetPreallocationModeName(preallocation)
+              << " preallocation in " << elapsed.count() << " ms)" << std::endl;
+
+    storage = StorageBackend::Create(storage_backend, output_directory, wanted_files);
+    read_files = std::make_unique<FileSet>(output_directory, wanted_files, O_RDONLY);
+    std::cout << "Writing pieces through the " << storage->GetName() << " backend";
+    if (write_cache.capacity > 0) {
+        storage = std::make_unique<WriteBackCache>(std::move(storage), write_cache);
+        std::cout << " behind a " << (write_cache.capacity >> 20) << " MiB write-back cache";
+    }
+    std::cout << " (" << GetDurabilityModeName(durability) << " sync)" << std::endl;
+}
+
+// Blocks of a piece that turns out complete are verified and written as if
+// they had just arrived; a piece whose blocks do not fit is downloaded anew.
+void PieceStorage::RestorePartialPieces(const ResumeData& resume_data) {
+    size_t restored = 0;
+    for (const ResumeData::PartialPiece& partial : resume_data.partial_pieces) {
+        if (partial.index >= total_piece_count || !states.Is(partial.index, PieceState::kMissing)) {
+            continue;
+        }
+        PiecePtr piece = pieces[partial.index];
+        try {
+            size_t position = 0;
+            for (size_t offset : partial.block_offsets) {
+                if (offset >= piece->GetLength()) {
+                    throw std::runtime_error("block offset " + std::to_string(offset) + " past the piece end");
+                }
+                size_t block_length = std::min(kBlockSize, piece->GetLength() - offset);
+                piece->SaveBlock(offset, std::string_view(partial.data).substr(position, block_length));
+                position += block_length;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Discarding resume data of piece " << partial.index << ": " << e.what() << std::endl;
+            piece->Reset();
+            continue;
+        }
 
-    const size_t chunk_size = 100 * (1 << 20);
-    for (size_t offset = 0; offset < torrent_file.length; offset += chunk_size) {
-        size_t write_size = std::min(chunk_size, torrent_file.length - offset);
-        file.seekp(offset);
-        std::vector<char> buffer(write_size, 0);
-        file.write(buffer.data(), write_size);
+        BlockSaved(piece);
+        if (piece->AllBlocksRetrieved()) {
+            Shard& shard = ShardOf(partial.index);
+            {
+                auto lock = LockShard(shard);
+                TakePiece(shard, partial.index);
+            }
+            PieceProcessed(piece);
+        }
+        ++restored;
+    }
+    if (restored > 0) {
+        std::cout << "Restored blocks of " << restored << " partly downloaded pieces" << std::endl;
     }
-    file.flush();
+}
 
-    std::cout << "Created output file: " << filename << " (" << torrent_file.length << " bytes)" << std::endl;
+// The bitfield is taken before the file's size and mtime: a piece counted
+// as done has been written by then, so a file that still has that mtime
+// at startup holds every piece the bitfield claims. With periodic
+// durability those pieces are on the disk, not just in the page cache,
+// before the checkpoint that claims them is saved.
+void PieceStorage::CheckpointResumeData() {
+    std::lock_guard<std::mutex> lock(resume_mutex);
+    ResumeData resume_data;
+    resume_data.info_hash = torrent_file.info_hash;
+    resume_data.piece_count = total_piece_count;
+    resume_data.file_count = files.size();
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (file_priorities[i] != DownloadPriority::kSkip) {
+            resume_data.SetFileWanted(i);
+        }
+    }
+    states.ForEach(PieceState::kDone, [&](size_t piece_index) {
+        resume_data.SetPieceCompleted(piece_index);
+    });
+    states.ForEachNotDone([&](size_t piece_index) {
+        if (states.Is(piece_index, PieceState::kSkipped)) {
+            return;
+        }
+        PiecePtr piece;
+        {
+            auto shard_lock = LockShard(ShardOf(piece_index));
+            piece = pieces[piece_index];
+        }
+        ResumeData::PartialPiece partial;
+        partial.index = piece_index;
+        if (piece->CopyRetrievedBlocks(partial.block_offsets, partial.data)) {
+            resume_data.partial_pieces.push_back(std::move(partial));
+        }
+    });
+
+    try {
+        if (storage && durability == DurabilityMode::kPeriodic) {
+            storage->Sync();
+        } else if (storage) {
+            storage->Flush();
+        }
+        OutputFilesStamp stamp = GetOutputFilesStamp(output_directory, files);
+        resume_data.file_size = stamp.size;
+        resume_data.file_mtime = stamp.mtime;
+        SaveResumeData(resume_path, resume_data);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to save resume data: " << e.what() << std::endl;
+        return;
+    }
+    std::cout << "Saved resume data: " << PiecesSavedToDiscCount() << " pieces on disk, "
+              << resume_data.partial_pieces.size() << " partly downloaded" << std::endl;
 }
 
 size_t PieceStorage::GetMissingPiecesCount() const {
-    return GetMissingPieces().size();
+    return WantedPiecesCount() - states.Count(PieceState::kDone);
 }
 
 bool PieceStorage::HasActiveWork() const {
     return !QueueIsEmpty();
 }
 
-PiecePtr PieceStorage::GetNextPieceToDownload() {
-    std::lock_guard<std::mutex> lock(queue_mutex);
+PiecePtr PieceStorage::MakePiece(size_t piece_index) const {
+    size_t piece_length = (piece_index == total_piece_count - 1)
+        ? (torrent_file.length % torrent_file.piece_length ?: torrent_file.piece_length)
+        : torrent_file.piece_length;
+    return std::make_shared<Piece>(piece_index, piece_length, torrent_file.piece_hashes[piece_index], buffer_pool);
+}
+
+PieceStorage::Shard& PieceStorage::ShardOf(size_t piece_index) {
+    return *shards[piece_index % shards.size()];
+}
 
-    if (remaining_pieces_queue.empty()) {
+std::unique_lock<std::mutex> PieceStorage::LockShard(const Shard& shard) const {
+    std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        shard.contended_acquisitions.fetch_add(1, std::memory_order_relaxed);
+        lock.lock();
+    }
+    shard.lock_acquisitions.fetch_add(1, std::memory_order_relaxed);
+    return lock;
+}
+
+// Both called with the shard's lock held.
+PiecePtr PieceStorage::TakePiece(Shard& shard, size_t piece_index) {
+    if (piece_index == PiecePicker::kNoPiece) {
         return nullptr;
     }
+    shard.picker.RemovePiece(piece_index);
+    shard.waiting_count.store(shard.picker.WaitingCount(), std::memory_order_relaxed);
+    states.Set(piece_index, PieceState::kInFlight);
+
+    uint64_t in_flight = GetInFlightBytes();
+    uint64_t peak = peak_in_flight_bytes.load(std::memory_order_relaxed);
+    while (in_flight > peak && !peak_in_flight_bytes.compare_exchange_weak(peak, in_flight)) {
+    }
+    return pieces[piece_index];
+}
+
+void PieceStorage::AddWaitingPiece(Shard& shard, size_t piece_index) {
+    shard.picker.AddPiece(piece_index);
+    shard.waiting_count.store(shard.picker.WaitingCount(), std::memory_order_relaxed);
+    states.Set(piece_index, PieceState::kMissing);
+}
+
+bool PieceStorage::SetPieceState(size_t piece_index, PieceState from, PieceState to) {
+    auto lock = LockShard(ShardOf(piece_index));
+    return states.Transition(piece_index, from, to);
+}
+
+// Rarest-first holds within a shard; across shards the worker's own shard
+// wins, which is what keeps the event loops off each other's locks.
+PiecePtr PieceStorage::GetNextPieceToDownload(const PeerPiecesAvailability& peer, size_t worker_index) {
+    Shard& home = *shards[worker_index % shards.size()];
+    if (IsOverMemoryBudget()) {
+        throttled_picks.fetch_add(1, std::memory_order_relaxed);
+        // Verified pieces in the write-back cache count against the budget
+        // too, and with no new pieces coming the cache would only write
+        // them when it times out.
+        if (write_cache.capacity > 0 && states.Count(PieceState::kWriting) > 0 &&
+            !is_budget_flush_queued.exchange(true)) {
+            disk_pool.Submit([this]() {
+                is_budget_flush_queued = false;
+                if (storage) {
+                    storage->Flush();
+                }
+            });
+        }
+        return nullptr;
+    }
+    if (deadline_count.load(std::memory_order_relaxed) > 0) {
+        if (PiecePtr piece = TakeDeadlinePiece(peer)) {
+            home.picks.fetch_add(1, std::memory_order_relaxed);
+            return piece;
+        }
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        Shard& shard = *shards[(worker_index + i) % shards.size()];
+        if (shard.waiting_count.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        PiecePtr piece;
+        {
+            auto lock = LockShard(shard);
+            piece = TakePiece(shard, shard.picker.PickRarest(&peer));
+        }
+        if (piece) {
+            home.picks.fetch_add(1, std::memory_order_relaxed);
+            if (&shard != &home) {
+                home.stolen_picks.fetch_add(1, std::memory_order_relaxed);
+            }
+            return piece;
+        }
+    }
+    return nullptr;
+}
+
+// Every piece past kMissing and short of kDone holds a piece buffer, or
+// will once its first block arrives; counting them by state needs no lock.
+// Peers refused a piece keep working on the ones they have and ask again
+// on their next tick, by when the disk may have caught up. Event loops
+// checking at the same moment can each take one piece past the budget.
+bool PieceStorage::IsOverMemoryBudget() const {
+    if (memory_budget == 0) {
+        return false;
+    }
+    uint64_t in_flight = GetInFlightBytes();
+    return in_flight > 0 && in_flight + default_piece_length > memory_budget;
+}
+
+uint64_t PieceStorage::GetInFlightBytes() const {
+    size_t count = states.Count(PieceState::kInFlight) + states.Count(PieceState::kHashing) +
+                   states.Count(PieceState::kWriting);
+    return static_cast<uint64_t>(count) * default_piece_length;
+}
+
+// A piece keeps its deadline while it is in flight, so one that is
+// returned to the queue is picked first again.
+PiecePtr PieceStorage::TakeDeadlinePiece(const PeerPiecesAvailability& peer) {
+    std::lock_guard<std::mutex> lock(deadline_mutex);
+    for (const auto& [time, piece_index] : deadline_order) {
+        if (!states.Is(piece_index, PieceState::kMissing) || !peer.IsPieceAvailable(piece_index)) {
+            continue;
+        }
+        Shard& shard = ShardOf(piece_index);
+        auto shard_lock = LockShard(shard);
+        if (shard.picker.IsWaiting(piece_index)) {
+            return TakePiece(shard, piece_index);
+        }
+    }
+    return nullptr;
+}
+
+void PieceStorage::SetPieceDeadline(size_t piece_index, std::chrono::steady_clock::time_point deadline) {
+    if (piece_index >= total_piece_count) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(deadline_mutex);
+    SetDeadlineLocked(piece_index, deadline, false);
+}
+
+// PieceDone marks the piece kDone before it takes deadline_mutex, so a
+// deadline is either refused here or erased there.
+void PieceStorage::SetDeadlineLocked(size_t piece_index, Clock::time_point time, bool is_read_ahead) {
+    if (states.Is(piece_index, PieceState::kDone) || states.Is(piece_index, PieceState::kSkipped)) {
+        return;
+    }
+    EraseDeadlineLocked(piece_index);
+    deadlines[piece_index] = Deadline{time, is_read_ahead};
+    deadline_order.emplace(time, piece_index);
+    deadline_count.store(deadlines.size(), std::memory_order_relaxed);
+}
+
+void PieceStorage::EraseDeadlineLocked(size_t piece_index) {
+    auto it = deadlines.find(piece_index);
+    if (it == deadlines.end()) {
+        return;
+    }
+    deadline_order.erase({it->second.time, piece_index});
+    deadlines.erase(it);
+    deadline_count.store(deadlines.size(), std::memory_order_relaxed);
+}
+
+bool PieceStorage::HasRequestedDeadline(size_t piece_index) {
+    if (deadline_count.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(deadline_mutex);
+    auto it = deadlines.find(piece_index);
+    return it != deadlines.end() && !it->second.is_read_ahead;
+}
+
+// A reader jumping elsewhere takes the window with it: read-ahead
+// deadlines outside the new window are dropped, so they do not compete
+// with the pieces the reader needs now.
+void PieceStorage::MoveReadAheadLocked(size_t piece_index) {
+    if (piece_index == read_ahead_start) {
+        return;
+    }
+    std::vector<size_t> stale;
+    for (const auto& [index, deadline] : deadlines) {
+        if (deadline.is_read_ahead && (index < piece_index || index >= piece_index + read_ahead_pieces)) {
+            stale.push_back(index);
+        }
+    }
+    for (size_t index : stale) {
+        EraseDeadlineLocked(index);
+    }
+    read_ahead_start = piece_index;
+    read_ahead_end = piece_index;
+    UpdateReadAheadLocked();
+}
+
+// The window starts at the first piece at or after the reader that is
+// not on disk; without a reader it just runs through the torrent in order.
+void PieceStorage::UpdateReadAheadLocked() {
+    while (read_ahead_start < total_piece_count && (states.Is(read_ahead_start, PieceState::kDone) ||
+                                                    states.Is(read_ahead_start, PieceState::kSkipped))) {
+        ++read_ahead_start;
+    }
+    size_t window_end = std::min(total_piece_count, read_ahead_start + read_ahead_pieces);
+    Clock::time_point now = Clock::now();
+    for (size_t i = std::max(read_ahead_start, read_ahead_end); i < window_end; ++i) {
+        if (!deadlines.count(i)) {
+            SetDeadlineLocked(i, now + kReadAheadSpacing * (i - read_ahead_start), true);
+        }
+    }
+    read_ahead_end = std::max(read_ahead_end, window_end);
+}
 
-    PiecePtr piece = remaining_pieces_queue.front();
-    remaining_pieces_queue.pop();
-    return piece;
+void PieceStorage::PieceDone(size_t piece_index) {
+    if (deadline_count.load(std::memory_order_relaxed) > 0 || read_ahead_pieces > 0) {
+        std::lock_guard<std::mutex> lock(deadline_mutex);
+        EraseDeadlineLocked(piece_index);
+        if (read_ahead_pieces > 0) {
+            UpdateReadAheadLocked();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(done_mutex);
+    }
+    piece_done.notify_all();
+}
+
+std::string PieceStorage::Read(uint64_t offset, size_t length) {
+    if (offset > torrent_file.length || length > torrent_file.length - offset) {
+        throw std::out_of_range("Read of " + std::to_string(length) + " bytes at " + std::to_string(offset) +
+                                " is past the end of the torrent");
+    }
+    if (length == 0) {
+        return {};
+    }
+    std::string range = "bytes " + std::to_string(offset) + "-" + std::to_string(offset + length - 1);
+
+    // Bytes of a boundary piece that fall in a skipped file are not kept.
+    std::vector<FileSpan> spans;
+    uint64_t mapped = 0;
+    read_files->Map(offset, length, spans);
+    for (const FileSpan& span : spans) {
+        mapped += span.length;
+    }
+    if (mapped != length) {
+        throw std::runtime_error("Cannot read " + range + ": they are in a skipped file");
+    }
+
+    size_t first_piece = offset / default_piece_length;
+    size_t last_piece = (offset + length - 1) / default_piece_length;
+    {
+        std::lock_guard<std::mutex> lock(deadline_mutex);
+        if (read_ahead_pieces > 0) {
+            MoveReadAheadLocked(first_piece);
+        }
+        Clock::time_point now = Clock::now();
+        for (size_t i = first_piece; i <= last_piece; ++i) {
+            SetDeadlineLocked(i, now, false);
+        }
+    }
+
+    auto is_range_done = [&]() {
+        for (size_t i = first_piece; i <= last_piece; ++i) {
+            if (!states.Is(i, PieceState::kDone)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    {
+        std::unique_lock<std::mutex> lock(done_mutex);
+        piece_done.wait(lock, [&]() { return is_closed || is_range_done(); });
+        if (!is_range_done()) {
+            throw std::runtime_error("Cannot read " + range + ": the output file was closed before they arrived");
+        }
+    }
+
+    std::string data(length, '\0');
+    for (const FileSpan& span : spans) {
+        char* destination = data.data() + (span.torrent_offset - offset);
+        if (!utils::ReadAt(read_files->GetDescriptor(span.file_index), span.file_offset, destination, span.length)) {
+            throw std::runtime_error("Failed to read " + read_files->GetPath(span.file_index).string() + ": " +
+                                     (errno ? strerror(errno) : "unexpected end of file"));
+        }
+    }
+    return data;
+}
+
+void PieceStorage::AddPeerAvailability(const PeerPiecesAvailability& peer) {
+    for (auto& shard : shards) {
+        auto lock = LockShard(*shard);
+        shard->picker.AddPeer(peer);
+    }
+}
+
+void PieceStorage::RemovePeerAvailability(const PeerPiecesAvailability& peer) {
+    for (auto& shard : shards) {
+        auto lock = LockShard(*shard);
+        shard->picker.RemovePeer(peer);
+    }
+}
+
+void PieceStorage::AddPieceAvailability(size_t piece_index) {
+    Shard& shard = ShardOf(piece_index);
+    auto lock = LockShard(shard);
+    shard.picker.IncrementAvailability(piece_index);
+}
+
+// Every peer in endgame calls this on each refill. The in-flight pieces are
+// found without a lock; only the shards holding some are locked, one at a
+// time, to read pieces[].
+std::vector<PiecePtr> PieceStorage::GetPiecesInProgress(const PeerPiecesAvailability& peer) const {
+    std::vector<std::vector<size_t>> shard_pieces(shards.size());
+    states.ForEach(PieceState::kInFlight, [&](size_t piece_index) {
+        if (peer.IsPieceAvailable(piece_index)) {
+            shard_pieces[piece_index % shards.size()].push_back(piece_index);
+        }
+    });
+
+    std::vector<PiecePtr> result;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (shard_pieces[i].empty()) {
+            continue;
+        }
+        auto lock = LockShard(*shards[i]);
+        for (size_t piece_index : shard_pieces[i]) {
+            if (states.Is(piece_index, PieceState::kInFlight)) {
+                result.push_back(pieces[piece_index]);
+            }
+        }
+    }
+    return result;
 }
 
 bool PieceStorage::IsPieceAlreadySaved(size_t piece_index) const {
-    std::lock_guard<std::mutex> lock(file_mutex);
-    return std::find(indices_of_pieces_saved_to_disk.begin(),
-                    indices_of_pieces_saved_to_disk.end(),
-                    piece_index) != indices_of_pieces_saved_to_disk.end();
+    return piece_index < total_piece_count && states.Is(piece_index, PieceState::kDone);
+}
+
+const PieceStateTable& PieceStorage::GetPieceStates() const {
+    return states;
 }
 
 void PieceStorage::Enqueue(const PiecePtr& piece) {
@@ -83,33 +688,124 @@ void PieceStorage::Enqueue(const PiecePtr& piece) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(queue_mutex);
+    if (piece->GetIndex() >= total_piece_count) {
+        return;
+    }
+
+    // A piece that is no longer pieces[i] has been replaced already, by an
+    // earlier Enqueue or ForceRequeueMissingPieces. Otherwise a fresh piece
+    // takes its place: endgame peers may still hold this one, with blocks
+    // of it on the way, and must not fill the piece that waits in the queue.
+    Shard& shard = ShardOf(piece->GetIndex());
+    auto lock = LockShard(shard);
+    if (states.Is(piece->GetIndex(), PieceState::kDone) || pieces[piece->GetIndex()] != piece) {
+        return;
+    }
     piece->Reset();
-    remaining_pieces_queue.push(piece);
+    pieces[piece->GetIndex()] = MakePiece(piece->GetIndex());
+    AddWaitingPiece(shard, piece->GetIndex());
+}
+
+void PieceStorage::BlockSaved(const PiecePtr& piece) {
+    if (piece && piece->MarkHashScheduled()) {
+        hasher_pool.Submit(piece->GetIndex(), [piece]() { piece->HashRetrievedBlocks(); });
+    }
 }
 
+// A piece that was returned to the queue, or requeued by
+// ForceRequeueMissingPieces, after it was handed out has been replaced in
+// pieces[]; a copy an endgame peer completed after that is dropped.
 void PieceStorage::PieceProcessed(const PiecePtr& piece) {
     if (!piece) return;
 
+    {
+        auto lock = LockShard(ShardOf(piece->GetIndex()));
+        if (pieces[piece->GetIndex()] != piece ||
+            !states.Transition(piece->GetIndex(), PieceState::kInFlight, PieceState::kHashing)) {
+            return;
+        }
+    }
+    // Same key as the piece's BlockSaved jobs, so this runs after them.
+    hasher_pool.Submit(piece->GetIndex(), [this, piece]() { VerifyPiece(piece); });
+}
+
+// Runs on the hasher pool; every piece is hashed once, here or by the
+// BlockSaved jobs before it.
+void PieceStorage::VerifyPiece(const PiecePtr& piece) {
+    piece->HashRetrievedBlocks();
     if (!piece->HashMatches()) {
         std::cout << "Piece " << piece->GetIndex() << " hash mismatch, requeuing..." << std::endl;
         Enqueue(piece);
         return;
     }
 
-    SavePieceToDisk(piece);
+    if (!SetPieceState(piece->GetIndex(), PieceState::kHashing, PieceState::kWriting)) {
+        return;
+    }
+    disk_pool.Submit([this, piece]() { SavePieceToDisk(piece); });
 }
 
 bool PieceStorage::QueueIsEmpty() const {
-    std::lock_guard<std::mutex> lock(queue_mutex);
-    return remaining_pieces_queue.empty();
+    return WaitingCount() == 0;
+}
+
+size_t PieceStorage::WaitingCount() const {
+    size_t count = 0;
+    for (const auto& shard : shards) {
+        count += shard->waiting_count.load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+size_t PieceStorage::GetHashQueueDepth() const {
+    return hasher_pool.QueueDepth();
+}
+
+size_t PieceStorage::GetDiskQueueDepth() const {
+    return disk_pool.QueueDepth();
+}
+
+size_t PieceStorage::GetShardCount() const {
+    return shards.size();
+}
+
+PieceStorage::QueueStats PieceStorage::GetQueueStats() const {
+    QueueStats stats;
+    for (const auto& shard : shards) {
+        stats.lock_acquisitions += shard->lock_acquisitions.load(std::memory_order_relaxed);
+        stats.contended_acquisitions += shard->contended_acquisitions.load(std::memory_order_relaxed);
+        stats.picks += shard->picks.load(std::memory_order_relaxed);
+        stats.stolen_picks += shard->stolen_picks.load(std::memory_order_relaxed);
+    }
+    stats.throttled_picks = throttled_picks.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void PieceStorage::PrintQueueStats() const {
+    QueueStats stats = GetQueueStats();
+    std::cout << "=== QUEUE LOCK STATS ===" << std::endl;
+    std::cout << "Shards: " << shards.size() << std::endl;
+    std::cout << "Lock acquisitions: " << stats.lock_acquisitions
+              << " (contended: " << stats.contended_acquisitions << ")" << std::endl;
+    std::cout << "Pieces picked: " << stats.picks
+              << " (stolen from other shards: " << stats.stolen_picks << ")" << std::endl;
+    std::cout << "Hash queue depth: " << GetHashQueueDepth()
+              << " (" << hasher_pool.ThreadCount() << " hasher threads)" << std::endl;
+    std::cout << "Disk queue depth: " << GetDiskQueueDepth()
+              << " (" << disk_pool.ThreadCount() << " disk threads)" << std::endl;
+    std::cout << "Peak in flight: " << (peak_in_flight_bytes.load(std::memory_order_relaxed) >> 20) << " MiB";
+    if (memory_budget > 0) {
+        std::cout << " of a " << (memory_budget >> 20) << " MiB budget, " << stats.throttled_picks
+                  << " picks held back";
+    }
+    std::cout << std::endl;
 }
 
 void PieceStorage::PrintDownloadStatus() const {
     std::cout << "=== DOWNLOAD STATUS ===" << std::endl;
     std::cout << "Total pieces: " << total_piece_count << std::endl;
     std::cout << "Saved to disk: " << PiecesSavedToDiscCount() << std::endl;
-    std::cout << "In queue: " << remaining_pieces_queue.size() << std::endl;
+    std::cout << "In queue: " << WaitingCount() << std::endl;
     std::cout << "Download complete: " << (IsDownloadComplete() ? "YES" : "NO") << std::endl;
 }
 
@@ -117,114 +813,121 @@ void PieceStorage::PrintDetailedStatus() const {
     std::cout << "=== DETAILED STATUS ===" << std::endl;
     std::cout << "Total pieces: " << total_piece_count << std::endl;
     std::cout << "Saved: " << PiecesSavedToDiscCount() << std::endl;
-    std::cout << "In queue: " << remaining_pieces_queue.size() << std::endl;
+    std::cout << "In queue: " << WaitingCount() << std::endl;
 }
 
 void PieceStorage::PrintMissingPieces() const {
-    auto missing = GetMissingPieces();
+    size_t missing_count = GetMissingPiecesCount();
 
     std::cout << "=== MISSING PIECES ===" << std::endl;
     std::cout << "Total pieces: " << total_piece_count << std::endl;
-    std::cout << "Saved to disk: " << indices_of_pieces_saved_to_disk.size() << std::endl;
-    std::cout << "In queue: " << remaining_pieces_queue.size() << std::endl;
-    std::cout << "Missing pieces count: " << missing.size() << std::endl;
+    std::cout << "Saved to disk: " << PiecesSavedToDiscCount() << std::endl;
+    std::cout << "In queue: " << WaitingCount() << std::endl;
+    std::cout << "Missing pieces count: " << missing_count << std::endl;
 
-    if (!missing.empty()) {
+    if (missing_count > 0) {
         std::cout << "Missing pieces: ";
-        for (size_t i = 0; i < std::min(missing.size(), size_t(20)); ++i) {
-            std::cout << missing[i] << " ";
-        }
-        if (missing.size() > 20) {
-            std::cout << "... (and " << (missing.size() - 20) << " more)";
+        size_t printed = 0;
+        states.ForEachNotDone([&](size_t piece_index) {
+            if (!states.Is(piece_index, PieceState::kSkipped) && printed++ < 20) {
+                std::cout << piece_index << " ";
+            }
+        });
+        if (missing_count > 20) {
+            std::cout << "... (and " << (missing_count - 20) << " more)";
         }
         std::cout << std::endl;
     }
 }
 
 bool PieceStorage::IsDownloadComplete() const {
-    std::lock_guard<std::mutex> fileLock(file_mutex);
-    return indices_of_pieces_saved_to_disk.size() == total_piece_count;
+    return states.Count(PieceState::kDone) == WantedPiecesCount();
 }
 
 void PieceStorage::ForceRequeueMissingPieces() {
-    std::lock_guard<std::mutex> lock(queue_mutex);
-
-    while (!remaining_pieces_queue.empty()) {
-        remaining_pieces_queue.pop();
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& shard : shards) {
+        locks.push_back(LockShard(*shard));
+        shard->picker.Clear();
+        shard->waiting_count.store(0, std::memory_order_relaxed);
     }
 
-    auto missing = GetMissingPieces();
-    for (size_t piece_index : missing) {
-        size_t pieceLength = (piece_index == total_piece_count - 1)
-            ? (torrent_file.length % torrent_file.piece_length ?: torrent_file.piece_length)
-            : torrent_file.piece_length;
-
-        auto piece = std::make_shared<Piece>(piece_index, pieceLength, torrent_file.piece_hashes[piece_index]);
-        remaining_pieces_queue.push(piece);
-    }
+    // Pieces being written are left alone: they end up kDone, or requeue
+    // themselves if the write fails.
+    size_t requeued = 0;
+    states.ForEachNotDone([&](size_t piece_index) {
+        if (states.Is(piece_index, PieceState::kWriting) || states.Is(piece_index, PieceState::kSkipped)) {
+            return;
+        }
+        pieces[piece_index] = MakePiece(piece_index);
+        AddWaitingPiece(ShardOf(piece_index), piece_index);
+        ++requeued;
+    });
 
-    std::cout << "Requeued " << missing.size() << " missing pieces" << std::endl;
+    std::cout << "Requeued " << requeued << " missing pieces" << std::endl;
 }
 
 std::vector<size_t> PieceStorage::GetMissingPieces() const {
-    std::lock_guard<std::mutex> fileLock(file_mutex);
-
-    std::vector<bool> pieceStatus(total_piece_count, false);
-    for (size_t savedIndex : indices_of_pieces_saved_to_disk) {
-        if (savedIndex < total_piece_count) {
-            pieceStatus[savedIndex] = true;
+    std::vector<size_t> missing;
+    missing.reserve(GetMissingPiecesCount());
+    states.ForEachNotDone([&](size_t piece_index) {
+        if (!states.Is(piece_index, PieceState::kSkipped)) {
+            missing.push_back(piece_index);
         }
-    }
-
-    std::vector<size_t> missingPieces;
-    for (size_t i = 0; i < total_piece_count; ++i) {
-        if (!pieceStatus[i]) {
-            missingPieces.push_back(i);
-        }
-    }
-
-    return missingPieces;
+    });
+    return missing;
 }
 
 size_t PieceStorage::PiecesSavedToDiscCount() const {
-    std::lock_guard<std::mutex> lock(file_mutex);
-    return indices_of_pieces_saved_to_disk.size();
+    return states.Count(PieceState::kDone);
 }
 
+// Runs on the disk pool for pieces in kWriting, so each piece is written
+// once, and a backend that blocks holds up neither hashing nor the event
+// loops; the piece counts against the memory budget until then. Once the
+// write is done the piece's buffer goes back to the pool; endgame peers
+// still holding the piece only need to see that its blocks are retrieved.
 void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
     if (!piece) return;
 
-    std::lock_guard<std::mutex> lock(file_mutex);
+    size_t file_offset = piece->GetIndex() * default_piece_length;
+    std::string_view piece_data = piece->GetData();
 
-    if (std::find(indices_of_pieces_saved_to_disk.begin(),
-                 indices_of_pieces_saved_to_disk.end(),
-                 piece->GetIndex()) != indices_of_pieces_saved_to_disk.end()) {
+    if (piece_data.size() != piece->GetLength()) {
+        std::cerr << "ERROR: Piece " << piece->GetIndex()
+                  << " data size mismatch: " << piece_data.size()
+                  << " != " << piece->GetLength() << std::endl;
+        Enqueue(piece);
         return;
     }
 
-    try {
-        size_t file_offset = piece->GetIndex() * default_piece_length;
-        std::string piece_data = piece->GetData();
+    if (!storage) {
+        std::cerr << "Piece " << piece->GetIndex() << " verified after the output file was closed" << std::endl;
+        return;
+    }
 
-        if (piece_data.size() != piece->GetLength()) {
-            std::cerr << "ERROR: Piece " << piece->GetIndex()
-                      << " data size mismatch: " << piece_data.size()
-                      << " != " << piece->GetLength() << std::endl;
+    // The piece stays kWriting, and keeps its buffer, until the backend
+    // reports the write done, which may be before Write returns.
+    size_t piece_index = piece->GetIndex();
+    size_t piece_size = piece_data.size();
+    storage->Write(file_offset, piece_data, [this, piece, piece_index, piece_size](bool success) {
+        if (!success) {
+            std::cerr << "Failed to save piece " << piece_index << " to disk, requeuing" << std::endl;
+            Enqueue(piece);
             return;
         }
-
-        file.seekp(file_offset);
-        file.write(piece_data.data(), piece_data.size());
-        file.flush();
-
-        indices_of_pieces_saved_to_disk.push_back(piece->GetIndex());
-        std::cout << "Saved piece " << piece->GetIndex() << " to disk ("
-                  << piece_data.size() << " bytes)" << std::endl;
-
-    } catch (const std::exception& e) {
-        std::cerr << "Failed to save piece " << piece->GetIndex() << " to disk: "
-                  << e.what() << std::endl;
-        throw;
+        piece->ReleaseData();
+        SetPieceState(piece_index, PieceState::kWriting, PieceState::kDone);
+        std::cout << "Saved piece " << piece_index << " to disk (" << piece_size << " bytes)" << std::endl;
+        PieceDone(piece_index);
+    });
+
+    // No more pieces are coming to fill the write-back cache, or a reader
+    // is waiting for this one: write it now rather than when the cache
+    // times out.
+    if (states.Count(PieceState::kWriting) + states.Count(PieceState::kDone) == WantedPiecesCount() ||
+        HasRequestedDeadline(piece_index)) {
+        storage->Flush();
     }
 }
 
@@ -232,11 +935,29 @@ size_t PieceStorage::TotalPiecesCount() const {
     return total_piece_count;
 }
 
+size_t PieceStorage::WantedPiecesCount() const {
+    return total_piece_count - states.Count(PieceState::kSkipped);
+}
+
+const std::vector<TorrentFile::File>& PieceStorage::GetWantedFiles() const {
+    return wanted_files;
+}
+
 void PieceStorage::CloseOutputFile() {
-    std::lock_guard<std::mutex> lock(file_mutex);
-    if (file.is_open()) {
-        file.flush();
-        file.close();
+    hasher_pool.Drain(); // verified pieces still have to be written
+    disk_pool.Drain();
+    if (storage) {
+        if (durability == DurabilityMode::kNone) {
+            storage->Flush();
+        } else {
+            storage->Sync();
+        }
+        storage.reset(); // waits for queued writes and runs their callbacks
         std::cout << "Output file closed" << std::endl;
     }
+    {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        is_closed = true;
+    }
+    piece_done.notify_all(); // readers of pieces that never came give up
 }
@@ -0,0 +1,59 @@
+#include "core/PwriteStorage.hpp"
+#include "utils/PositionalWrite.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+PwriteStorage::PwriteStorage(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files)
+    : files(directory, files) {}
+
+const char* PwriteStorage::GetName() const {
+    return "pwrite";
+}
+
+void PwriteStorage::Write(uint64_t offset, std::string_view data, Callback on_complete) {
+    WriteGathered(offset, {data}, std::move(on_complete));
+}
+
+void PwriteStorage::WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                                  Callback on_complete) {
+    uint64_t length = 0;
+    for (std::string_view part : parts) {
+        length += part.size();
+    }
+    std::vector<FileSpan> spans;
+    files.Map(offset, length, spans);
+
+    for (const FileSpan& span : spans) {
+        std::vector<iovec> vectors;
+        for (std::string_view part : SliceParts(parts, span.torrent_offset - offset,
+                                                span.torrent_offset - offset + span.length)) {
+            vectors.push_back({const_cast<char*>(part.data()), part.size()});
+        }
+        try {
+            if (!utils::WriteAt(files.GetDescriptor(span.file_index), span.file_offset, vectors)) {
+                throw std::runtime_error(strerror(errno));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Write to " << files.GetPath(span.file_index).string() << " at offset "
+                      << span.file_offset << " failed: " << e.what() << std::endl;
+            on_complete(false);
+            return;
+        }
+    }
+    on_complete(true);
+}
+
+void PwriteStorage::Flush() {
+    // Every write has reached the page cache by the time it completes.
+}
+
+void PwriteStorage::Sync() {
+    files.ForEachOpenDescriptor([this](size_t file_index, int fd) {
+        if (fdatasync(fd) == -1) {
+            std::cerr << "fdatasync of " << files.GetPath(file_index).string() << " failed: " << strerror(errno)
+                      << std::endl;
+        }
+    });
+}
@@ -0,0 +1,216 @@
+#include "core/Recheck.hpp"
+#include "core/FileSet.hpp"
+#include "utils/Sha1Kernels.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    // Pieces hashed together: enough to fill the widest multi-buffer kernel.
+    constexpr size_t kBatchSize = 16;
+    constexpr auto kProgressInterval = std::chrono::seconds(1);
+
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::filesystem::path& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                throw std::runtime_error("Failed to open " + path.string() + ": " + strerror(errno));
+            }
+            struct stat file_stat;
+            if (fstat(fd, &file_stat) == -1) {
+                int error = errno;
+                close(fd);
+                throw std::runtime_error("Failed to stat " + path.string() + ": " + strerror(error));
+            }
+            size = static_cast<size_t>(file_stat.st_size);
+            if (size > 0) {
+                void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (address == MAP_FAILED) {
+                    int error = errno;
+                    close(fd);
+                    throw std::runtime_error("Failed to map " + path.string() + ": " + strerror(error));
+                }
+                data = static_cast<const char*>(address);
+                madvise(const_cast<char*>(data), size, MADV_SEQUENTIAL);
+            }
+            close(fd); // the mapping keeps the file
+        }
+
+        ~MappedFile() {
+            if (data) {
+                munmap(const_cast<char*>(data), size);
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // Starts reading [offset, offset + length) in the background.
+        void Prefetch(size_t offset, size_t length) const {
+            static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            if (offset >= size) {
+                return;
+            }
+            size_t start = offset / page_size * page_size;
+            size_t end = std::min(size, offset + length);
+            madvise(const_cast<char*>(data) + start, end - start, MADV_WILLNEED);
+        }
+
+        const char* data = nullptr;
+        size_t size = 0;
+    };
+}
+
+ResumeData RecheckOutputFiles(const TorrentFile& torrent_file, const std::filesystem::path& directory,
+                              size_t thread_count) {
+    std::vector<TorrentFile::File> torrent_files = GetTorrentFiles(torrent_file);
+    FileSet layout(directory, torrent_files); // only for its span index
+    std::vector<std::unique_ptr<MappedFile>> files;
+    for (size_t i = 0; i < layout.GetFileCount(); ++i) {
+        files.push_back(std::filesystem::exists(layout.GetPath(i)) ? std::make_unique<MappedFile>(layout.GetPath(i))
+                                                                   : nullptr);
+    }
+    const size_t piece_count = torrent_file.piece_hashes.size();
+    const size_t piece_length = torrent_file.piece_length;
+    const size_t batch_count = (piece_count + kBatchSize - 1) / kBatchSize;
+    thread_count = std::clamp<size_t>(thread_count, 1, std::max<size_t>(1, batch_count));
+
+    OutputFilesStamp stamp = GetOutputFilesStamp(directory, torrent_files);
+    ResumeData resume_data;
+    resume_data.info_hash = torrent_file.info_hash;
+    resume_data.piece_count = piece_count;
+    resume_data.file_size = stamp.size;
+    resume_data.file_mtime = stamp.mtime;
+    resume_data.completed_pieces.assign((piece_count + 7) >> 3, '\0');
+    // A valid piece was read back from every file it overlaps.
+    resume_data.file_count = torrent_files.size();
+    for (size_t i = 0; i < torrent_files.size(); ++i) {
+        resume_data.SetFileWanted(i);
+    }
+    std::mutex resume_mutex;
+
+    std::cout << "Rechecking " << piece_count << " pieces of " << (directory / torrent_file.name).string()
+              << " (" << stamp.existing_count << "/" << torrent_files.size() << " files present) on "
+              << thread_count << " threads (" << utils::GetSha1KernelName(utils::GetBestSha1Kernel(kBatchSize))
+              << " SHA-1)" << std::endl;
+
+    std::atomic<size_t> next_batch = 0;
+    std::atomic<size_t> checked_pieces = 0;
+    std::atomic<size_t> valid_pieces = 0;
+    std::atomic<uint64_t> checked_bytes = 0;
+    size_t running = thread_count;
+    std::mutex progress_mutex;
+    std::condition_variable all_finished;
+
+    auto prefetch = [&](uint64_t offset, uint64_t length) {
+        std::vector<FileSpan> spans;
+        layout.Map(offset, length, spans);
+        for (const FileSpan& span : spans) {
+            if (files[span.file_index]) {
+                files[span.file_index]->Prefetch(span.file_offset, span.length);
+            }
+        }
+    };
+
+    // Batches are handed out in payload order, so the threads together
+    // sweep the files front to back; each one asks for the batch the
+    // threads will reach after this round to be read ahead.
+    auto check_batches = [&]() {
+        std::string_view messages[kBatchSize];
+        std::string digests[kBatchSize];
+        std::string copies[kBatchSize]; // pieces that span files
+        std::vector<FileSpan> spans;
+        for (size_t batch; (batch = next_batch.fetch_add(1)) < batch_count;) {
+            size_t first = batch * kBatchSize;
+            size_t count = std::min(kBatchSize, piece_count - first);
+            prefetch((first + thread_count * kBatchSize) * piece_length, kBatchSize * piece_length);
+
+            // Pieces the files are missing or too short for are left out
+            // and stay missing.
+            size_t hashed = 0;
+            size_t indices[kBatchSize];
+            for (size_t i = first; i < first + count; ++i) {
+                size_t offset = i * piece_length;
+                size_t length = std::min(piece_length, torrent_file.length - offset);
+                spans.clear();
+                layout.Map(offset, length, spans);
+                bool is_present = std::all_of(spans.begin(), spans.end(), [&](const FileSpan& span) {
+                    return files[span.file_index] && span.file_offset + span.length <= files[span.file_index]->size;
+                });
+                if (!is_present) {
+                    continue;
+                }
+                if (spans.size() == 1) {
+                    messages[hashed] = std::string_view(files[spans[0].file_index]->data + spans[0].file_offset,
+                                                        length);
+                } else {
+                    copies[hashed].clear();
+                    for (const FileSpan& span : spans) {
+                        copies[hashed].append(files[span.file_index]->data + span.file_offset, span.length);
+                    }
+                    messages[hashed] = copies[hashed];
+                }
+                indices[hashed++] = i;
+            }
+            utils::CalculateSHA1Many(messages, hashed, digests);
+            size_t valid = 0;
+            uint64_t bytes = 0;
+            for (size_t i = 0; i < hashed; ++i) {
+                bytes += messages[i].size();
+                if (digests[i] == torrent_file.piece_hashes[indices[i]]) {
+                    std::lock_guard<std::mutex> lock(resume_mutex);
+                    resume_data.SetPieceCompleted(indices[i]);
+                    ++valid;
+                }
+            }
+            valid_pieces.fetch_add(valid, std::memory_order_relaxed);
+            checked_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            checked_pieces.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        if (--running == 0) {
+            all_finished.notify_one();
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(check_batches);
+    }
+
+    auto report = [&](const char* label) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << label << checked_pieces.load() << "/" << piece_count << " pieces ("
+                  << valid_pieces.load() << " valid), "
+                  << static_cast<size_t>(checked_bytes.load() / std::max(seconds, 1e-6) / (1 << 20)) << " MiB/s"
+                  << std::endl;
+    };
+    {
+        std::unique_lock<std::mutex> lock(progress_mutex);
+        while (!all_finished.wait_for(lock, kProgressInterval, [&]() { return running == 0; })) {
+            report("Rechecked ");
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    report("Recheck finished: ");
+    return resume_data;
+}
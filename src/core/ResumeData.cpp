@@ -0,0 +1,197 @@
+#include "core/ResumeData.hpp"
+#include "utils/byte_tools.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+
+namespace {
+    // Bump the version whenever the layout changes; older files are ignored.
+    const std::string kMagic = "TRESUME2";
+    constexpr size_t kChecksumSize = 20;
+
+    class Reader {
+    public:
+        explicit Reader(std::string_view bytes) : bytes(bytes) {}
+
+        std::string_view Take(size_t size) {
+            if (size > bytes.size()) {
+                throw std::runtime_error("resume data is truncated");
+            }
+            std::string_view result = bytes.substr(0, size);
+            bytes.remove_prefix(size);
+            return result;
+        }
+
+        uint64_t TakeInt() {
+            return utils::BytesToInt64(std::string(Take(8)));
+        }
+
+        bool AtEnd() const {
+            return bytes.empty();
+        }
+
+    private:
+        std::string_view bytes;
+    };
+
+    // Bitfields keep bit 0 in the high bit of byte 0, as in the peer
+    // protocol.
+    bool GetBit(const std::string& bits, size_t index) {
+        size_t byte = index >> 3;
+        return byte < bits.size() && (bits[byte] >> (7 - (index & 7)) & 1);
+    }
+
+    void SetBit(std::string& bits, size_t count, size_t index, bool value) {
+        if (bits.size() < (count + 7) >> 3) {
+            bits.resize((count + 7) >> 3, '\0');
+        }
+        char mask = static_cast<char>(1 << (7 - (index & 7)));
+        bits[index >> 3] = value ? (bits[index >> 3] | mask) : (bits[index >> 3] & ~mask);
+    }
+}
+
+bool ResumeData::IsPieceCompleted(size_t piece_index) const {
+    return GetBit(completed_pieces, piece_index);
+}
+
+void ResumeData::SetPieceCompleted(size_t piece_index) {
+    SetBit(completed_pieces, piece_count, piece_index, true);
+}
+
+void ResumeData::ClearPieceCompleted(size_t piece_index) {
+    SetBit(completed_pieces, piece_count, piece_index, false);
+}
+
+bool ResumeData::IsFileWanted(size_t file_index) const {
+    return GetBit(wanted_files, file_index);
+}
+
+void ResumeData::SetFileWanted(size_t file_index) {
+    SetBit(wanted_files, file_count, file_index, true);
+}
+
+std::filesystem::path GetResumeDataPath(const std::filesystem::path& output_file) {
+    std::filesystem::path path = output_file;
+    path += ".resume";
+    return path;
+}
+
+int64_t GetFileModificationTime(const std::filesystem::path& file) {
+    return std::filesystem::last_write_time(file).time_since_epoch().count();
+}
+
+OutputFilesStamp GetOutputFilesStamp(const std::filesystem::path& directory,
+                                     const std::vector<TorrentFile::File>& files) {
+    OutputFilesStamp stamp;
+    for (const TorrentFile::File& file : files) {
+        std::error_code error;
+        std::filesystem::path path = directory / file.path;
+        uint64_t size = std::filesystem::file_size(path, error);
+        if (error) {
+            continue;
+        }
+        int64_t mtime = GetFileModificationTime(path); // ticks may be negative
+        stamp.mtime = stamp.existing_count == 0 ? mtime : std::max(stamp.mtime, mtime);
+        stamp.size += size;
+        ++stamp.existing_count;
+    }
+    return stamp;
+}
+
+// Layout: magic, then big-endian 64-bit integers and raw bytes, then the
+// SHA-1 of everything before it:
+//   info hash (20) | piece count | file size | file mtime | completed bitfield
+//   file count | wanted files bitfield
+//   partial piece count | per partial piece: index, block count,
+//                         block offsets, data length, data
+ResumeData LoadResumeData(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("no resume data at " + path.string());
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string contents = buffer.str();
+
+    if (contents.size() < kMagic.size() + kChecksumSize ||
+        contents.compare(0, kMagic.size(), kMagic) != 0) {
+        throw std::runtime_error("not a resume data file: " + path.string());
+    }
+    std::string_view body(contents.data(), contents.size() - kChecksumSize);
+    if (utils::CalculateSHA1(body) != std::string_view(contents).substr(body.size())) {
+        throw std::runtime_error("resume data checksum mismatch: " + path.string());
+    }
+
+    Reader reader(body.substr(kMagic.size()));
+    ResumeData resume_data;
+    resume_data.info_hash = std::string(reader.Take(20));
+    resume_data.piece_count = reader.TakeInt();
+    resume_data.file_size = reader.TakeInt();
+    resume_data.file_mtime = static_cast<int64_t>(reader.TakeInt());
+    resume_data.completed_pieces = std::string(reader.Take((resume_data.piece_count + 7) >> 3));
+    resume_data.file_count = reader.TakeInt();
+    resume_data.wanted_files = std::string(reader.Take((resume_data.file_count + 7) >> 3));
+
+    size_t partial_count = reader.TakeInt();
+    for (size_t i = 0; i < partial_count; ++i) {
+        ResumeData::PartialPiece partial;
+        partial.index = reader.TakeInt();
+        size_t block_count = reader.TakeInt();
+        for (size_t b = 0; b < block_count; ++b) {
+            partial.block_offsets.push_back(reader.TakeInt());
+        }
+        partial.data = std::string(reader.Take(reader.TakeInt()));
+        resume_data.partial_pieces.push_back(std::move(partial));
+    }
+    if (!reader.AtEnd()) {
+        throw std::runtime_error("trailing bytes in resume data: " + path.string());
+    }
+    return resume_data;
+}
+
+void SaveResumeData(const std::filesystem::path& path, const ResumeData& resume_data) {
+    std::string contents = kMagic;
+    contents += resume_data.info_hash;
+    contents.resize(kMagic.size() + 20, '\0');
+    contents += utils::Int64ToBytes(resume_data.piece_count);
+    contents += utils::Int64ToBytes(resume_data.file_size);
+    contents += utils::Int64ToBytes(static_cast<uint64_t>(resume_data.file_mtime));
+    std::string completed_pieces = resume_data.completed_pieces;
+    completed_pieces.resize((resume_data.piece_count + 7) >> 3, '\0');
+    contents += completed_pieces;
+    contents += utils::Int64ToBytes(resume_data.file_count);
+    std::string wanted_files = resume_data.wanted_files;
+    wanted_files.resize((resume_data.file_count + 7) >> 3, '\0');
+    contents += wanted_files;
+
+    contents += utils::Int64ToBytes(resume_data.partial_pieces.size());
+    for (const ResumeData::PartialPiece& partial : resume_data.partial_pieces) {
+        contents += utils::Int64ToBytes(partial.index);
+        contents += utils::Int64ToBytes(partial.block_offsets.size());
+        for (size_t offset : partial.block_offsets) {
+            contents += utils::Int64ToBytes(offset);
+        }
+        contents += utils::Int64ToBytes(partial.data.size());
+        contents += partial.data;
+    }
+    contents += utils::CalculateSHA1(contents);
+
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), contents.size());
+        file.flush();
+        if (!file) {
+            throw std::runtime_error("failed to write resume data to " + temporary.string());
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        throw std::runtime_error("failed to replace " + path.string() + ": " + error.message());
+    }
+}
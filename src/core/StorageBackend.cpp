@@ -0,0 +1,145 @@
+#include "core/StorageBackend.hpp"
+#include "core/DirectStorage.hpp"
+#include "core/MmapStorage.hpp"
+#include "core/PwriteStorage.hpp"
+#ifdef TORRENT_WITH_IO_URING
+#include "core/UringDiskWriter.hpp"
+#include "utils/IoUring.hpp"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+
+const char* GetStorageBackendName(StorageBackendType type) {
+    switch (type) {
+        case StorageBackendType::kAuto:
+            return "auto";
+        case StorageBackendType::kPwrite:
+            return "pwrite";
+        case StorageBackendType::kMmap:
+            return "mmap";
+        case StorageBackendType::kDirect:
+            return "direct";
+        case StorageBackendType::kUring:
+            return "uring";
+    }
+    return "unknown";
+}
+
+StorageBackendType ParseStorageBackendType(const std::string& name) {
+    for (StorageBackendType type : {StorageBackendType::kAuto, StorageBackendType::kPwrite,
+                                    StorageBackendType::kMmap, StorageBackendType::kDirect,
+                                    StorageBackendType::kUring}) {
+        if (name == GetStorageBackendName(type)) {
+            return type;
+        }
+    }
+    throw std::invalid_argument("Unknown storage backend: " + name);
+}
+
+const char* GetDurabilityModeName(DurabilityMode mode) {
+    switch (mode) {
+        case DurabilityMode::kNone:
+            return "none";
+        case DurabilityMode::kPeriodic:
+            return "periodic";
+        case DurabilityMode::kOnComplete:
+            return "on-complete";
+    }
+    return "unknown";
+}
+
+DurabilityMode ParseDurabilityMode(const std::string& name) {
+    for (DurabilityMode mode : {DurabilityMode::kNone, DurabilityMode::kPeriodic, DurabilityMode::kOnComplete}) {
+        if (name == GetDurabilityModeName(mode)) {
+            return mode;
+        }
+    }
+    throw std::invalid_argument("Unknown durability mode: " + name);
+}
+
+void StorageBackend::WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                                   Callback on_complete) {
+    if (parts.empty()) {
+        on_complete(true);
+        return;
+    }
+    Callback on_part_complete = JoinCallbacks(parts.size(), std::move(on_complete));
+    for (std::string_view part : parts) {
+        Write(offset, part, on_part_complete);
+        offset += part.size();
+    }
+}
+
+StorageBackend::Callback StorageBackend::JoinCallbacks(size_t count, Callback on_complete) {
+    struct Pending {
+        std::atomic<size_t> remaining;
+        std::atomic<bool> success{true};
+        Callback on_complete;
+    };
+    auto pending = std::make_shared<Pending>();
+    pending->remaining = count;
+    pending->on_complete = std::move(on_complete);
+    return [pending](bool success) {
+        if (!success) {
+            pending->success = false;
+        }
+        if (pending->remaining.fetch_sub(1) == 1) {
+            pending->on_complete(pending->success);
+        }
+    };
+}
+
+std::vector<std::string_view> StorageBackend::SliceParts(const std::vector<std::string_view>& parts, uint64_t begin,
+                                                         uint64_t end) {
+    std::vector<std::string_view> slice;
+    uint64_t part_begin = 0;
+    for (std::string_view part : parts) {
+        uint64_t part_end = part_begin + part.size();
+        if (part_end > begin && part_begin < end) {
+            uint64_t from = std::max(begin, part_begin) - part_begin;
+            uint64_t to = std::min(end, part_end) - part_begin;
+            slice.push_back(part.substr(from, to - from));
+        }
+        if (part_end >= end) {
+            break;
+        }
+        part_begin = part_end;
+    }
+    return slice;
+}
+
+std::unique_ptr<StorageBackend> StorageBackend::Create(StorageBackendType type, const std::filesystem::path& directory,
+                                                       const std::vector<TorrentFile::File>& files) {
+    switch (type) {
+        case StorageBackendType::kPwrite:
+            return std::make_unique<PwriteStorage>(directory, files);
+        case StorageBackendType::kMmap:
+            return std::make_unique<MmapStorage>(directory, files);
+        case StorageBackendType::kDirect:
+            return std::make_unique<DirectStorage>(directory, files);
+        case StorageBackendType::kUring:
+#ifdef TORRENT_WITH_IO_URING
+            return std::make_unique<UringDiskWriter>(directory, files);
+#else
+            throw std::runtime_error("This build has no io_uring support");
+#endif
+        case StorageBackendType::kAuto:
+            break;
+    }
+
+#ifdef TORRENT_WITH_IO_URING
+    if (utils::IoUring::IsSupported()) {
+        try {
+            return std::make_unique<UringDiskWriter>(directory, files);
+        } catch (const std::exception& e) {
+            std::cerr << "io_uring disk writer unavailable (" << e.what()
+                      << "), writing pieces with pwrite" << std::endl;
+        }
+    } else {
+        std::cout << "Kernel does not support io_uring, writing pieces with pwrite" << std::endl;
+    }
+#endif
+    return std::make_unique<PwriteStorage>(directory, files);
+}
@@ -1,13 +1,22 @@
 #include "core/TorrentClient.hpp"
+#include "core/Recheck.hpp"
+#include "core/ResumeData.hpp"
 #include "net/PeerConnect.hpp"
+#include "net/EventLoop.hpp"
 #include <iostream>
 #include <chrono>
+#include <fstream>
 #include <random>
 #include <thread>
 #include <algorithm>
 
 using namespace std::chrono_literals;
 
+namespace {
+    constexpr auto kResumeCheckpointInterval = 30s;
+    constexpr size_t kStreamChunkSize = 1 << 20;
+}
+
 TorrentClient::TorrentClient(const std::string& peer_id)
     : peer_id(peer_id + GenerateRandomSuffix()) {}
 
@@ -27,7 +36,6 @@ std::string TorrentClient::GenerateRandomSuffix(size_t length) {
 bool TorrentClient::RunDownloadMultithread(PieceStorage& pieces,
                                            const TorrentFile& torrent_file,
                                            const TorrentTracker& tracker) {
-    std::vector<std::thread> peer_threads;
     std::vector<std::shared_ptr<PeerConnect>> peer_connections;
 
     for (const Peer& peer : tracker.GetPeers()) {
@@ -46,58 +54,41 @@ bool TorrentClient::RunDownloadMultithread(PieceStorage& pieces,
         return true;
     }
 
-    peer_threads.reserve(peer_connections.size());
+    EventLoopGroup event_loops;
     for (auto& peer_connect_ptr : peer_connections) {
-        peer_threads.emplace_back([peer_connect_ptr]() {
-            while (!peer_connect_ptr->IsTerminated()) {
-                try {
-                    peer_connect_ptr->Run();
-                } catch (const std::exception& e) {
-                    std::cerr << "Peer " << " error: "
-                              << e.what() << " - reconnecting..." << std::endl;
-
-                    if (!peer_connect_ptr->IsTerminated()) {
-                        std::this_thread::sleep_for(5s);
-                    }
-                }
-            }
-            std::cout << "Peer thread for " << " terminated" << std::endl;
-        });
+        event_loops.Add(peer_connect_ptr);
     }
+    event_loops.Start();
 
-    std::cout << "Started " << peer_threads.size() << " threads for peers" << std::endl;
+    std::cout << "Started " << event_loops.GetThreadCount() << " " << event_loops.GetEngineName()
+              << " event loop threads for "
+              << peer_connections.size() << " peers" << std::endl;
 
-    const size_t target_pieces = pieces.TotalPiecesCount();
+    const size_t target_pieces = pieces.WantedPiecesCount();
 
     std::cout << "=== DOWNLOAD STARTED ===" << std::endl;
     std::cout << "Target pieces: " << target_pieces << std::endl;
     std::cout << "Initial saved pieces: " << pieces.PiecesSavedToDiscCount() << std::endl;
 
     bool endgame_mode = false;
-    auto last_requeue_time = std::chrono::steady_clock::now();
-    const auto requeue_interval = std::chrono::seconds(10);
+    auto last_checkpoint = std::chrono::steady_clock::now();
 
     while (!is_terminated && !pieces.IsDownloadComplete()) {
-        size_t missing_count = pieces.GetMissingPieces().size();
+        if (event_loops.GetPeerCount() == 0) {
+            std::cout << "All peer connections have given up" << std::endl;
+            break;
+        }
 
-        if (!endgame_mode && missing_count <= 10) {
+        // Peers switch to duplicate block requests on their own once
+        // nothing is left to hand out; this only reports it.
+        if (!endgame_mode && pieces.QueueIsEmpty()) {
             endgame_mode = true;
             std::cout << "=== ENTERING ENDGAME MODE ===" << std::endl;
-            std::cout << "Missing pieces: " << missing_count << std::endl;
-        }
-
-        if (endgame_mode && pieces.QueueIsEmpty()) {
-            auto now = std::chrono::steady_clock::now();
-            if (now - last_requeue_time > requeue_interval) {
-                std::cout << "ENDGAME: Forcing requeue of " << missing_count << " missing pieces" << std::endl;
-                pieces.ForceRequeueMissingPieces();
-                last_requeue_time = now;
-            }
+            std::cout << "Missing pieces: " << pieces.GetMissingPiecesCount() << std::endl;
         }
 
         if (!pieces.HasActiveWork()) {
-            auto missing = pieces.GetMissingPieces();
-            std::cout << "No active work. Missing: " << missing.size()
+            std::cout << "No active work. Missing: " << pieces.GetMissingPiecesCount()
                       << ", Queue: " << (pieces.QueueIsEmpty() ? "empty" : "has work")
                       << (endgame_mode ? " [ENDGAME]" : "") << std::endl;
 
@@ -109,8 +100,16 @@ bool TorrentClient::RunDownloadMultithread(PieceStorage& pieces,
         size_t current_saved_count = pieces.PiecesSavedToDiscCount();
         if (current_saved_count % 5 == 0 || current_saved_count == target_pieces || endgame_mode) {
             std::cout << "Progress: " << current_saved_count << "/" << target_pieces
+                      << ", hash queue: " << pieces.GetHashQueueDepth()
+                      << ", disk queue: " << pieces.GetDiskQueueDepth()
+                      << ", in flight: " << (pieces.GetInFlightBytes() >> 20) << " MiB"
                       << (endgame_mode ? " [ENDGAME]" : "") << std::endl;
         }
+
+        if (std::chrono::steady_clock::now() - last_checkpoint >= kResumeCheckpointInterval) {
+            pieces.CheckpointResumeData();
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
     }
 
     std::cout << "=== DOWNLOAD FINISHED ===" << std::endl;
@@ -120,21 +119,11 @@ bool TorrentClient::RunDownloadMultithread(PieceStorage& pieces,
     std::cout << "Terminating peer connections..." << std::endl;
 
     is_terminated = true;
-
-    for (auto& peer_connect_ptr : peer_connections) {
-        peer_connect_ptr->Terminate();
-    }
-
-    for (auto& thread : peer_threads) {
-        if (thread.joinable()) {
-            thread.join();
-        } else {
-            thread.detach();
-        }
-    }
+    event_loops.Stop();
 
     std::cout << "=== FINAL DIAGNOSTICS ===" << std::endl;
     pieces.PrintMissingPieces();
+    pieces.PrintQueueStats();
 
     bool download_complete = pieces.IsDownloadComplete();
     if (download_complete) {
@@ -193,14 +182,14 @@ void TorrentClient::DownloadFromTracker(const TorrentFile& torrent_file, PieceSt
         std::cout << "Total unique peers: " << all_peers.size() << std::endl;
 
         size_t saved_count = pieces.PiecesSavedToDiscCount();
-        size_t total_count = pieces.TotalPiecesCount();
-        auto missing = pieces.GetMissingPieces();
+        size_t total_count = pieces.WantedPiecesCount();
+        size_t missing_count = pieces.GetMissingPiecesCount();
         std::cout << "Progress: " << saved_count << "/" << total_count
-                  << " (missing: " << missing.size() << " pieces)" << std::endl;
+                  << " (missing: " << missing_count << " pieces)" << std::endl;
 
-        if (!missing.empty() && missing.size() <= 10) {
+        if (missing_count > 0 && missing_count <= 10) {
             std::cout << "Missing pieces: ";
-            for (size_t piece : missing) {
+            for (size_t piece : pieces.GetMissingPieces()) {
                 std::cout << piece << " ";
             }
             std::cout << std::endl;
@@ -229,7 +218,7 @@ void TorrentClient::DownloadFromTracker(const TorrentFile& torrent_file, PieceSt
                 break;
             }
 
-            std::cout << "Still missing " << missing.size() << " pieces (retry "
+            std::cout << "Still missing " << pieces.GetMissingPiecesCount() << " pieces (retry "
                       << retry_count << "/" << max_retries << ")" << std::endl;
             std::cout << "Waiting 30s before next tracker cycle..." << std::endl;
             std::this_thread::sleep_for(30s);
@@ -258,28 +247,51 @@ void TorrentClient::DownloadTorrent(const std::filesystem::path& torrent_file_pa
     TorrentFile torrentFile = LoadTorrentFile(torrent_file_path);
 
     std::cout << "Downloading " << torrentFile.piece_hashes.size() << " pieces" << std::endl;
-    std::cout << "File: " << torrentFile.name << " (" << torrentFile.length << " bytes)" << std::endl;
+    std::cout << "File: " << torrentFile.name << " (" << torrentFile.length << " bytes";
+    if (torrentFile.files.size() > 1) {
+        std::cout << " in " << torrentFile.files.size() << " files";
+    }
+    std::cout << ")" << std::endl;
     std::cout << "Peer ID: " << peer_id << std::endl;
 
-    PieceStorage pieces(torrentFile, output_directory);
+    PieceStorageOptions options = storage_options;
+    options.shard_count = EventLoopGroup::DefaultThreadCount();
+    PieceStorage pieces(torrentFile, output_directory, options);
+
+    std::thread stream_thread;
+    if (!stream_output.empty()) {
+        stream_thread = std::thread([this, &pieces]() { StreamPayload(pieces); });
+    }
 
     auto start_time = std::chrono::steady_clock::now();
-    DownloadFromTracker(torrentFile, pieces);
+    try {
+        DownloadFromTracker(torrentFile, pieces);
+    } catch (...) {
+        pieces.CloseOutputFile();
+        if (stream_thread.joinable()) {
+            stream_thread.join();
+        }
+        throw;
+    }
     auto end_time = std::chrono::steady_clock::now();
 
     pieces.CloseOutputFile();
+    pieces.CheckpointResumeData();
+    if (stream_thread.joinable()) {
+        stream_thread.join(); // once closed, a read of a missing piece fails instead of waiting
+    }
 
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(end_time - start_time);
 
     size_t saved_count = pieces.PiecesSavedToDiscCount();
-    size_t total_count = torrentFile.piece_hashes.size();
+    size_t total_count = pieces.WantedPiecesCount();
     bool is_complete = pieces.IsDownloadComplete();
 
     std::cout << "=== TORRENT DOWNLOAD FINISHED ===" << std::endl;
     std::cout << "Download time: " << duration.count() << " seconds" << std::endl;
     std::cout << "Saved " << saved_count << "/" << total_count << " pieces to disk" << std::endl;
     std::cout << "All pieces complete and valid: " << (is_complete ? "YES" : "NO") << std::endl;
-    std::cout << "Completion: " << (saved_count * 100 / total_count) << "%" << std::endl;
+    std::cout << "Completion: " << (total_count > 0 ? saved_count * 100 / total_count : 100) << "%" << std::endl;
 
     if (is_complete) {
         std::cout << "Download completed successfully!" << std::endl;
@@ -290,3 +302,79 @@ void TorrentClient::DownloadTorrent(const std::filesystem::path& torrent_file_pa
         pieces.PrintDownloadStatus();
     }
 }
+
+// Runs next to the download. Each Read blocks until its pieces are on disk
+// and moves the read-ahead window along, so the payload is requested in
+// the order it is written out.
+void TorrentClient::StreamPayload(PieceStorage& pieces) {
+    std::ofstream out(stream_output, std::ios::binary);
+    if (!out) {
+        std::cerr << "Cannot open stream output " << stream_output.string() << std::endl;
+        return;
+    }
+
+    uint64_t streamed = 0;
+    try {
+        for (const TorrentFile::File& file : pieces.GetWantedFiles()) {
+            for (uint64_t position = 0; position < file.length;) {
+                size_t chunk = static_cast<size_t>(std::min<uint64_t>(kStreamChunkSize, file.length - position));
+                std::string data = pieces.Read(file.offset + position, chunk);
+                if (!out.write(data.data(), static_cast<std::streamsize>(data.size()))) {
+                    throw std::runtime_error("write to " + stream_output.string() + " failed");
+                }
+                position += chunk;
+                streamed += chunk;
+            }
+        }
+        out.flush();
+        std::cout << "Streamed " << streamed << " bytes to " << stream_output.string() << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Streaming stopped after " << streamed << " bytes: " << e.what() << std::endl;
+    }
+}
+
+// Reads the output files and nothing else: a PieceStorage would open them
+// for writing and size them, which must not happen to files that are only
+// being checked.
+bool TorrentClient::VerifyTorrent(const std::filesystem::path& torrent_file_path,
+                                  const std::filesystem::path& output_directory) {
+    TorrentFile torrentFile = LoadTorrentFile(torrent_file_path);
+    std::filesystem::path output_file = output_directory / torrentFile.name;
+    if (!std::filesystem::exists(output_file)) {
+        throw std::runtime_error("Nothing to verify: " + output_file.string() + " does not exist");
+    }
+
+    ResumeData resume_data = RecheckOutputFiles(torrentFile, output_directory,
+                                                std::max(1u, std::thread::hardware_concurrency()));
+    SaveResumeData(GetResumeDataPath(output_file), resume_data);
+
+    std::vector<TorrentFile::File> files = GetTorrentFiles(torrentFile);
+    std::vector<DownloadPriority> piece_priorities = GetPiecePriorities(
+        files, ResolveFilePriorities(storage_options.file_priorities, files.size()), torrentFile.piece_length,
+        torrentFile.piece_hashes.size());
+    std::vector<size_t> missing;
+    size_t total_count = 0;
+    for (size_t i = 0; i < piece_priorities.size(); ++i) {
+        if (piece_priorities[i] == DownloadPriority::kSkip) {
+            continue;
+        }
+        ++total_count;
+        if (!resume_data.IsPieceCompleted(i)) {
+            missing.push_back(i);
+        }
+    }
+
+    std::cout << "=== VERIFY FINISHED ===" << std::endl;
+    std::cout << "Valid pieces: " << (total_count - missing.size()) << "/" << total_count << std::endl;
+    if (!missing.empty()) {
+        std::cout << "Missing pieces: ";
+        for (size_t i = 0; i < missing.size() && i < 20; ++i) {
+            std::cout << missing[i] << " ";
+        }
+        if (missing.size() > 20) {
+            std::cout << "... (and " << (missing.size() - 20) << " more)";
+        }
+        std::cout << std::endl;
+    }
+    return missing.empty();
+}
@@ -5,6 +5,16 @@
 #include <fstream>
 #include <variant>
 #include <sstream>
+#include <stdexcept>
+
+namespace {
+    // A name from the torrent becomes part of a path under the output
+    // directory, so it must not be able to leave it.
+    bool IsSafePathComponent(const std::string& component) {
+        return !component.empty() && component != "." && component != ".." &&
+               component.find('/') == std::string::npos && component.find('\0') == std::string::npos;
+    }
+}
 
 TorrentFile LoadTorrentFile(const std::string& filename) {
     std::cout << "Loading torrent file...\n";
@@ -47,5 +57,41 @@ TorrentFile LoadTorrentFile(const std::string& filename) {
 
     result.info_hash = myParser.GetHash();
     result.piece_hashes = myParser.GetPieceHashes();
+
+    if (!IsSafePathComponent(result.name)) {
+        throw std::runtime_error("Unsafe torrent name: " + result.name);
+    }
+    std::vector<utils::BencodeParser::FileEntry> entries = myParser.GetFiles();
+    if (entries.empty()) {
+        result.files.push_back({result.name, 0, result.length});
+        return result;
+    }
+
+    // A multi-file torrent has no top-level length; the files' lengths
+    // were picked up above, so it is recomputed here.
+    result.length = 0;
+    for (const utils::BencodeParser::FileEntry& entry : entries) {
+        std::filesystem::path path = result.name;
+        for (const std::string& component : entry.path) {
+            if (!IsSafePathComponent(component)) {
+                throw std::runtime_error("Unsafe path component in torrent: " + component);
+            }
+            path /= component;
+        }
+        if (entry.path.empty()) {
+            throw std::runtime_error("File without a path in torrent");
+        }
+        result.files.push_back({path, result.length, entry.length});
+        result.length += entry.length;
+    }
+    std::cout << "Multi-file torrent: " << result.files.size() << " files, " << result.length << " bytes"
+              << std::endl;
     return result;
 }
+
+std::vector<TorrentFile::File> GetTorrentFiles(const TorrentFile& torrent_file) {
+    if (!torrent_file.files.empty()) {
+        return torrent_file.files;
+    }
+    return {{torrent_file.name, 0, torrent_file.length}};
+}
@@ -0,0 +1,227 @@
+#include "core/UringDiskWriter.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace {
+    constexpr unsigned kRingEntries = 256;
+    constexpr size_t kMaxBatch = 128;
+}
+
+UringDiskWriter::UringDiskWriter(const std::filesystem::path& directory, const std::vector<TorrentFile::File>& files)
+    : files(directory, files)
+    , ring(kRingEntries) {
+    thread = std::thread([this]() { Run(); });
+}
+
+UringDiskWriter::~UringDiskWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopped = true;
+    }
+    has_work.notify_all();
+    thread.join();
+}
+
+const char* UringDiskWriter::GetName() const {
+    return "io_uring";
+}
+
+void UringDiskWriter::Write(uint64_t offset, std::string_view data, Callback on_complete) {
+    WriteGathered(offset, {data}, std::move(on_complete));
+}
+
+void UringDiskWriter::WriteGathered(uint64_t offset, const std::vector<std::string_view>& parts,
+                                    Callback on_complete) {
+    uint64_t length = 0;
+    for (std::string_view part : parts) {
+        length += part.size();
+    }
+    std::vector<FileSpan> spans;
+    files.Map(offset, length, spans);
+    if (spans.empty()) {
+        on_complete(length == 0);
+        return;
+    }
+
+    std::vector<Job> jobs;
+    Callback on_span_complete = spans.size() == 1 ? std::move(on_complete)
+                                                  : JoinCallbacks(spans.size(), std::move(on_complete));
+    for (const FileSpan& span : spans) {
+        std::vector<iovec> vectors;
+        for (std::string_view part : SliceParts(parts, span.torrent_offset - offset,
+                                                span.torrent_offset - offset + span.length)) {
+            vectors.push_back({const_cast<char*>(part.data()), part.size()});
+        }
+        try {
+            jobs.push_back(Job{files.GetDescriptor(span.file_index), span.file_offset, std::move(vectors),
+                               on_span_complete});
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            on_span_complete(false);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Job& job : jobs) {
+            queue.push_back(std::move(job));
+        }
+    }
+    has_work.notify_one();
+}
+
+void UringDiskWriter::Flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    is_idle.wait(lock, [this]() { return queue.empty() && !is_busy; });
+}
+
+size_t UringDiskWriter::GetWriteCount() const {
+    return write_count;
+}
+
+void UringDiskWriter::Sync() {
+    Flush();
+    files.ForEachOpenDescriptor([this](size_t file_index, int fd) {
+        if (fdatasync(fd) == -1) {
+            std::cerr << "fdatasync of " << files.GetPath(file_index).string() << " failed: " << strerror(errno)
+                      << std::endl;
+        }
+    });
+}
+
+void UringDiskWriter::Run() {
+    while (true) {
+        std::vector<Job> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            has_work.wait(lock, [this]() { return is_stopped || !queue.empty(); });
+            if (queue.empty()) {
+                break; // stopped and fully drained
+            }
+
+            size_t count = std::min(kMaxBatch, queue.size());
+            for (size_t i = 0; i < count; ++i) {
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            is_busy = true;
+        }
+
+        ProcessBatch(batch);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_busy = false;
+        }
+        is_idle.notify_all();
+    }
+}
+
+// The kernel reads from the pieces the batch points at, and
+// reports completions by index into the batch, until every write it was
+// handed has completed; so the batch is not let go before then, even when
+// the ring fails. After a failure, writes the kernel has not taken are
+// failed right away and the ones it has are waited for, polling the
+// completion queue if io_uring_enter keeps failing. The next batch starts
+// on an empty ring and tries again.
+void UringDiskWriter::ProcessBatch(std::vector<Job>& batch) {
+    current_batch = &batch;
+    size_t remaining = batch.size();
+    bool is_ring_failed = false;
+
+    auto finish = [&](Job& job, bool success) {
+        --remaining;
+        Callback on_complete = std::move(job.on_complete);
+        job.on_complete = nullptr;
+        if (on_complete) {
+            on_complete(success);
+        }
+    };
+    auto resubmit = [&](size_t job_index) {
+        if (is_ring_failed || !SubmitJob(job_index)) {
+            finish(batch[job_index], false);
+        }
+    };
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        resubmit(i);
+    }
+
+    while (remaining > 0) {
+        if (is_ring_failed) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        } else if (ring.Submit(1) < 0) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            is_ring_failed = true;
+            ring.DropUnsubmitted([&](const io_uring_sqe& sqe) { finish(batch[sqe.user_data], false); });
+        }
+
+        ring.ForEachCompletion([&](const io_uring_cqe& cqe) {
+            Job& job = batch[cqe.user_data];
+
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                resubmit(cqe.user_data);
+                return;
+            }
+
+            bool failed = cqe.res <= 0;
+            if (!failed) {
+                Advance(job, static_cast<size_t>(cqe.res));
+                if (job.first_vector < job.vectors.size()) {
+                    resubmit(cqe.user_data); // short write, continue where it stopped
+                    return;
+                }
+            } else {
+                std::cerr << "io_uring write at offset " << job.offset << " failed: "
+                          << strerror(-cqe.res) << std::endl;
+            }
+            finish(job, !failed);
+        });
+    }
+    current_batch = nullptr;
+}
+
+bool UringDiskWriter::SubmitJob(size_t job_index) {
+    Job& job = (*current_batch)[job_index];
+
+    io_uring_sqe* sqe = ring.GetSqe();
+    if (!sqe) {
+        ring.Submit();
+        sqe = ring.GetSqe();
+    }
+    if (!sqe) {
+        std::cerr << "io_uring submission queue is full, failing the write at offset " << job.offset << std::endl;
+        return false;
+    }
+
+    // A fixed-buffer write would need the piece copied into a registered
+    // buffer first, which costs more than the page pinning it saves. The
+    // kernel reads the iovecs themselves too, so they stay put until the
+    // write completes.
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = job.fd;
+    sqe->off = job.offset + job.written;
+    sqe->addr = reinterpret_cast<uint64_t>(job.vectors.data() + job.first_vector);
+    sqe->len = static_cast<uint32_t>(std::min<size_t>(job.vectors.size() - job.first_vector, IOV_MAX));
+    sqe->user_data = job_index;
+    ++write_count;
+    return true;
+}
+
+void UringDiskWriter::Advance(Job& job, size_t count) {
+    job.written += count;
+    while (job.first_vector < job.vectors.size() && count >= job.vectors[job.first_vector].iov_len) {
+        count -= job.vectors[job.first_vector].iov_len;
+        ++job.first_vector;
+    }
+    if (count > 0) {
+        iovec& vector = job.vectors[job.first_vector];
+        vector.iov_base = static_cast<char*>(vector.iov_base) + count;
+        vector.iov_len -= count;
+    }
+}
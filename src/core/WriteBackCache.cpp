@@ -0,0 +1,131 @@
+#include "core/WriteBackCache.hpp"
+#include <algorithm>
+
+WriteBackCache::WriteBackCache(std::unique_ptr<StorageBackend> backend, WriteBackCacheOptions options)
+    : backend(std::move(backend))
+    , options(options) {
+    thread = std::thread(&WriteBackCache::Run, this);
+}
+
+WriteBackCache::~WriteBackCache() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        is_stopped = true;
+    }
+    has_work.notify_one();
+    thread.join();
+}
+
+const char* WriteBackCache::GetName() const {
+    return backend->GetName();
+}
+
+void WriteBackCache::Write(uint64_t offset, std::string_view data, Callback on_complete) {
+    std::unique_lock<std::mutex> lock(mutex);
+    // A piece larger than the whole cache still goes in, on its own.
+    has_space.wait(lock, [&]() { return entries.empty() || cached_bytes + data.size() <= options.capacity; });
+
+    Clock::time_point now = Clock::now();
+    bool is_first = entries.empty(); // the flusher has no deadline to wake up at yet
+    if (is_first) {
+        oldest_write = now;
+    }
+    latest_write = now;
+    entries.push_back({offset, data, std::move(on_complete)});
+    cached_bytes += data.size();
+    bool is_full = cached_bytes >= options.capacity;
+    lock.unlock();
+    if (is_first || is_full) {
+        has_work.notify_one();
+    }
+}
+
+void WriteBackCache::Flush() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        is_flush_requested = true;
+        has_work.notify_one();
+        is_idle.wait(lock, [this]() { return entries.empty() && !is_flushing; });
+    }
+    backend->Flush();
+}
+
+void WriteBackCache::Sync() {
+    Flush();
+    backend->Sync();
+}
+
+size_t WriteBackCache::GetWriteCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return write_count;
+}
+
+const StorageBackend& WriteBackCache::GetBackend() const {
+    return *backend;
+}
+
+void WriteBackCache::Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (entries.empty()) {
+            is_flush_requested = false;
+            is_idle.notify_all();
+            if (is_stopped) {
+                break;
+            }
+            has_work.wait(lock, [this]() { return is_stopped || !entries.empty(); });
+            continue;
+        }
+
+        Clock::time_point deadline = std::min(oldest_write + options.max_age, latest_write + options.idle_time);
+        bool is_due = is_stopped || is_flush_requested || cached_bytes >= options.capacity ||
+                      Clock::now() >= deadline;
+        if (!is_due) {
+            // A new piece pushes the idle deadline back, so wake up and look again.
+            has_work.wait_until(lock, deadline);
+            continue;
+        }
+
+        std::vector<Entry> batch;
+        batch.swap(entries);
+        is_flushing = true;
+        lock.unlock();
+        WriteOut(batch);
+        lock.lock();
+        is_flushing = false;
+        for (const Entry& entry : batch) {
+            cached_bytes -= entry.data.size();
+        }
+        has_space.notify_all();
+    }
+}
+
+void WriteBackCache::WriteOut(std::vector<Entry>& batch) {
+    std::sort(batch.begin(), batch.end(), [](const Entry& a, const Entry& b) { return a.offset < b.offset; });
+
+    size_t writes = 0;
+    for (size_t first = 0; first < batch.size();) {
+        std::vector<std::string_view> parts{batch[first].data};
+        size_t last = first + 1;
+        while (last < batch.size() && batch[last].offset == batch[last - 1].offset + batch[last - 1].data.size()) {
+            parts.push_back(batch[last++].data);
+        }
+
+        // The backend may complete the write on its own thread, after
+        // the batch is gone.
+        auto callbacks = std::make_shared<std::vector<Callback>>();
+        for (size_t i = first; i < last; ++i) {
+            callbacks->push_back(std::move(batch[i].on_complete));
+        }
+        backend->WriteGathered(batch[first].offset, parts, [callbacks](bool success) {
+            for (Callback& on_complete : *callbacks) {
+                on_complete(success);
+            }
+        });
+        ++writes;
+        first = last;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    write_count += writes;
+}
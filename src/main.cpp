@@ -1,4 +1,6 @@
 #include "core/TorrentClient.hpp"
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <filesystem>
 #include <cstring>
@@ -8,12 +10,43 @@ void PrintUsage(const char* program_name) {
     std::cout << "Usage: " << program_name << " -d <output_directory> <torrent_file>" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -d <directory>   Output directory for downloaded file" << std::endl;
+    std::cout << "  --hashers <n>    Piece hashing threads (default: half the cores, at most 4)" << std::endl;
+    std::cout << "  --disk-threads <n>" << std::endl;
+    std::cout << "                   Threads writing verified pieces (default: 2)" << std::endl;
+    std::cout << "  --memory-budget <MiB>" << std::endl;
+    std::cout << "                   Memory for pieces being downloaded or written; peers are asked for" << std::endl;
+    std::cout << "                   no new pieces past it, 0 for no limit (default: 256)" << std::endl;
+    std::cout << "  --preallocate <none|sparse|full>" << std::endl;
+    std::cout << "                   How the output file is sized up front (default: sparse)" << std::endl;
+    std::cout << "  --storage <auto|pwrite|mmap|direct|uring>" << std::endl;
+    std::cout << "                   How verified pieces are written (default: auto)" << std::endl;
+    std::cout << "  --write-cache <MiB>" << std::endl;
+    std::cout << "                   Verified pieces gathered into larger writes, 0 to disable (default: 32)" << std::endl;
+    std::cout << "  --durability <none|periodic|on-complete>" << std::endl;
+    std::cout << "                   When written pieces are synced to disk (default: periodic)" << std::endl;
+    std::cout << "  --file-priority <files>=<skip|low|normal|high>" << std::endl;
+    std::cout << "                   Priority of files by index: \"*\" or a list like 0,4-7; repeatable," << std::endl;
+    std::cout << "                   later settings win (default: normal)" << std::endl;
+    std::cout << "  --sequential     Download in order through a read-ahead window instead of rarest first" << std::endl;
+    std::cout << "  --read-ahead <MiB>" << std::endl;
+    std::cout << "                   Size of the sequential read-ahead window (default: 16)" << std::endl;
+    std::cout << "  --stream-to <path>" << std::endl;
+    std::cout << "                   Write the payload to <path>, e.g. a FIFO, in order as it arrives;" << std::endl;
+    std::cout << "                   implies --sequential" << std::endl;
+    std::cout << "  --list-files     List the torrent's files with their indices and exit" << std::endl;
+    std::cout << "  --verify         Recheck the downloaded file on all cores and exit" << std::endl;
     std::cout << "  -h, --help       Show this help message" << std::endl;
 }
 
 int main(int argc, char *argv[]) {
     std::string output_directory;
     std::string torrent_file;
+    PieceStorageOptions storage_options;
+    bool verify_only = false;
+    bool list_files = false;
+    bool sequential = false;
+    size_t read_ahead = 16 << 20;
+    std::string stream_output;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -21,6 +54,70 @@ int main(int argc, char *argv[]) {
         if (arg == "-d" && i + 1 < argc) {
             output_directory = argv[++i];
         }
+        else if (arg == "--hashers" && i + 1 < argc) {
+            storage_options.hasher_threads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--disk-threads" && i + 1 < argc) {
+            storage_options.disk_threads = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--memory-budget" && i + 1 < argc) {
+            storage_options.memory_budget = static_cast<uint64_t>(std::max(0, std::atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--preallocate" && i + 1 < argc) {
+            try {
+                storage_options.preallocation = utils::ParsePreallocationMode(argv[++i]);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--storage" && i + 1 < argc) {
+            try {
+                storage_options.storage_backend = ParseStorageBackendType(argv[++i]);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--write-cache" && i + 1 < argc) {
+            storage_options.write_cache.capacity = static_cast<size_t>(std::max(0, std::atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--durability" && i + 1 < argc) {
+            try {
+                storage_options.durability = ParseDurabilityMode(argv[++i]);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--file-priority" && i + 1 < argc) {
+            try {
+                storage_options.file_priorities.push_back(ParseFilePriorityRule(argv[++i]));
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--sequential") {
+            sequential = true;
+        }
+        else if (arg == "--read-ahead" && i + 1 < argc) {
+            read_ahead = static_cast<size_t>(std::max(1, std::atoi(argv[++i]))) << 20;
+        }
+        else if (arg == "--stream-to" && i + 1 < argc) {
+            stream_output = argv[++i];
+            sequential = true;
+        }
+        else if (arg == "--list-files") {
+            list_files = true;
+        }
+        else if (arg == "--verify") {
+            verify_only = true;
+        }
         else if (arg == "-h" || arg == "--help") {
             PrintUsage(argv[0]);
             return 0;
@@ -41,6 +138,24 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (sequential) {
+        storage_options.read_ahead = read_ahead;
+    }
+
+    if (list_files) {
+        try {
+            TorrentFile torrent = LoadTorrentFile(torrent_file);
+            std::vector<TorrentFile::File> files = GetTorrentFiles(torrent);
+            for (size_t i = 0; i < files.size(); ++i) {
+                std::cout << i << "\t" << files[i].length << "\t" << files[i].path.generic_string() << std::endl;
+            }
+            return 0;
+        } catch (const std::exception& e) {
+            std::cerr << "Fatal error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     if (output_directory.empty()) {
         std::cerr << "Error: No output directory specified" << std::endl;
         PrintUsage(argv[0]);
@@ -57,12 +172,25 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (verify_only) {
+        try {
+            TorrentClient client;
+            client.SetStorageOptions(storage_options);
+            return client.VerifyTorrent(torrent_file, output_directory) ? 0 : 2;
+        } catch (const std::exception& e) {
+            std::cerr << "Fatal error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     try {
         std::cout << "Starting torrent download..." << std::endl;
         std::cout << "Torrent file: " << torrent_file << std::endl;
         std::cout << "Output directory: " << output_directory << std::endl;
 
         TorrentClient client;
+        client.SetStorageOptions(storage_options);
+        client.SetStreamOutput(stream_output);
         client.DownloadTorrent(torrent_file, output_directory);
 
         std::cout << "Download completed successfully!" << std::endl;
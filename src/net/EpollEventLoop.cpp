@@ -0,0 +1,181 @@
+#include "net/EpollEventLoop.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+namespace {
+    constexpr int kMaxEvents = 256;
+    constexpr auto kTickInterval = 100ms;
+    constexpr uint64_t kWakeToken = UINT64_MAX;
+
+    // epoll data carries the slot and the low bits of the socket generation,
+    // so events still queued for a socket that was closed are ignored.
+    uint64_t PackEventData(size_t slot, uint64_t generation) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(generation)) << 32) | static_cast<uint32_t>(slot);
+    }
+}
+
+EpollEventLoop::EpollEventLoop() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        throw std::runtime_error("Failed to create epoll instance: " + std::string(strerror(errno)));
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = kWakeToken;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        close(epoll_fd);
+        throw std::runtime_error("Failed to register eventfd: " + std::string(strerror(errno)));
+    }
+}
+
+EpollEventLoop::~EpollEventLoop() {
+    Stop();
+    close(epoll_fd);
+}
+
+const char* EpollEventLoop::GetName() const {
+    return "epoll";
+}
+
+void EpollEventLoop::Loop() {
+    epoll_event events[kMaxEvents];
+    auto next_tick = std::chrono::steady_clock::now();
+
+    while (!is_stopped) {
+        AdoptNewPeers();
+
+        auto now = std::chrono::steady_clock::now();
+        auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(next_tick - now);
+        int count = epoll_wait(epoll_fd, events, kMaxEvents, std::max<int>(0, timeout.count()));
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.u64 == kWakeToken) {
+                DrainWakeFd();
+                continue;
+            }
+            Dispatch(events[i].data.u64, events[i].events);
+        }
+
+        now = std::chrono::steady_clock::now();
+        if (now >= next_tick) {
+            TickAll();
+            next_tick = now + kTickInterval;
+        }
+    }
+}
+
+void EpollEventLoop::AdoptPeer(std::shared_ptr<PeerConnect> peer) {
+    entries.push_back(Entry{std::move(peer)});
+    if (is_stopped) {
+        return;
+    }
+    entries.back().peer->Start();
+    Sync(entries.size() - 1);
+}
+
+void EpollEventLoop::TerminatePeers() {
+    for (Entry& entry : entries) {
+        entry.peer->Terminate();
+    }
+    entries.clear();
+}
+
+void EpollEventLoop::Dispatch(uint64_t data, uint32_t events) {
+    size_t slot = static_cast<uint32_t>(data);
+    uint32_t generation = static_cast<uint32_t>(data >> 32);
+    if (slot >= entries.size()) {
+        return;
+    }
+
+    PeerConnect& peer = *entries[slot].peer;
+    auto is_current = [&]() {
+        return static_cast<uint32_t>(peer.GetSocketGeneration()) == generation && peer.GetFd() != -1;
+    };
+
+    try {
+        if (is_current() && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            peer.OnWritable();
+        }
+        if (is_current() && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            peer.OnReadable();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled peer error: " << e.what() << std::endl;
+    }
+    Sync(slot);
+}
+
+void EpollEventLoop::TickAll() {
+    auto now = std::chrono::steady_clock::now();
+    size_t live_peers = 0;
+
+    for (size_t slot = 0; slot < entries.size(); ++slot) {
+        PeerConnect& peer = *entries[slot].peer;
+        if (peer.IsTerminated()) {
+            Sync(slot);
+            continue;
+        }
+
+        try {
+            peer.OnTick(now);
+        } catch (const std::exception& e) {
+            std::cerr << "Unhandled peer error: " << e.what() << std::endl;
+        }
+        Sync(slot);
+        live_peers += peer.IsTerminated() ? 0 : 1;
+    }
+
+    SetLivePeerCount(live_peers);
+}
+
+void EpollEventLoop::Sync(size_t slot) {
+    Entry& entry = entries[slot];
+    const PeerConnect& peer = *entry.peer;
+    int fd = peer.GetFd();
+    uint64_t generation = peer.GetSocketGeneration();
+
+    if (entry.fd != -1 && (entry.fd != fd || entry.generation != generation)) {
+        // Closing the socket usually removed it already; ENOENT/EBADF are expected.
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry.fd, nullptr);
+        entry.fd = -1;
+        entry.events = 0;
+    }
+
+    if (fd == -1) {
+        return;
+    }
+
+    uint32_t wanted = EPOLLIN | (peer.WantsWrite() ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    epoll_event event{};
+    event.events = wanted;
+    event.data.u64 = PackEventData(slot, generation);
+
+    if (entry.fd == -1) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            std::cerr << "Failed to register peer socket: " << strerror(errno) << std::endl;
+            return;
+        }
+        entry.fd = fd;
+        entry.generation = generation;
+        entry.events = wanted;
+    } else if (entry.events != wanted) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0) {
+            entry.events = wanted;
+        }
+    }
+}
@@ -0,0 +1,152 @@
+#include "net/EventLoop.hpp"
+#include "net/EpollEventLoop.hpp"
+#ifdef TORRENT_WITH_IO_URING
+#include "net/UringEventLoop.hpp"
+#include "utils/IoUring.hpp"
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace {
+    constexpr size_t kMaxThreads = 4;
+}
+
+EventLoop::EventLoop() {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        throw std::runtime_error("Failed to create eventfd: " + std::string(strerror(errno)));
+    }
+}
+
+EventLoop::~EventLoop() {
+    // Derived engines stop the thread in their own destructor, while Loop
+    // is still callable.
+    close(wake_fd);
+}
+
+std::unique_ptr<EventLoop> EventLoop::Create() {
+#ifdef TORRENT_WITH_IO_URING
+    if (utils::IoUring::IsSupported()) {
+        try {
+            return std::make_unique<UringEventLoop>();
+        } catch (const std::exception& e) {
+            std::cerr << "io_uring engine unavailable (" << e.what()
+                      << "), falling back to epoll" << std::endl;
+        }
+    } else {
+        std::cerr << "Kernel does not support io_uring, falling back to epoll" << std::endl;
+    }
+#endif
+    return std::make_unique<EpollEventLoop>();
+}
+
+void EventLoop::Add(std::shared_ptr<PeerConnect> peer) {
+    {
+        std::lock_guard<std::mutex> lock(new_peers_mutex);
+        new_peers.push_back(std::move(peer));
+    }
+    ++peer_count;
+    Wake();
+}
+
+void EventLoop::Start() {
+    is_stopped = false;
+    thread = std::thread([this]() { Loop(); });
+}
+
+void EventLoop::Stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+
+    is_stopped = true;
+    Wake();
+    thread.join();
+
+    AdoptNewPeers();
+    TerminatePeers();
+}
+
+size_t EventLoop::GetPeerCount() const {
+    return peer_count;
+}
+
+void EventLoop::Wake() {
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd, &one, sizeof(one));
+    (void) written; // a full counter already guarantees a wakeup
+}
+
+void EventLoop::DrainWakeFd() {
+    uint64_t value;
+    while (read(wake_fd, &value, sizeof(value)) > 0) {
+    }
+}
+
+void EventLoop::AdoptNewPeers() {
+    std::vector<std::shared_ptr<PeerConnect>> adopted;
+    {
+        std::lock_guard<std::mutex> lock(new_peers_mutex);
+        adopted.swap(new_peers);
+    }
+
+    for (auto& peer : adopted) {
+        AdoptPeer(std::move(peer));
+    }
+}
+
+void EventLoop::SetLivePeerCount(size_t live_peers) {
+    std::lock_guard<std::mutex> lock(new_peers_mutex);
+    peer_count = live_peers + new_peers.size();
+}
+
+EventLoopGroup::EventLoopGroup(size_t thread_count) {
+    thread_count = std::max<size_t>(1, thread_count);
+    for (size_t i = 0; i < thread_count; ++i) {
+        loops.push_back(EventLoop::Create());
+    }
+}
+
+void EventLoopGroup::Add(std::shared_ptr<PeerConnect> peer) {
+    peer->SetWorkerIndex(next_loop);
+    loops[next_loop]->Add(std::move(peer));
+    next_loop = (next_loop + 1) % loops.size();
+}
+
+void EventLoopGroup::Start() {
+    for (auto& loop : loops) {
+        loop->Start();
+    }
+}
+
+void EventLoopGroup::Stop() {
+    for (auto& loop : loops) {
+        loop->Stop();
+    }
+}
+
+size_t EventLoopGroup::GetPeerCount() const {
+    size_t count = 0;
+    for (const auto& loop : loops) {
+        count += loop->GetPeerCount();
+    }
+    return count;
+}
+
+size_t EventLoopGroup::GetThreadCount() const {
+    return loops.size();
+}
+
+const char* EventLoopGroup::GetEngineName() const {
+    return loops.front()->GetName();
+}
+
+size_t EventLoopGroup::DefaultThreadCount() {
+    size_t cores = std::thread::hardware_concurrency();
+    return std::clamp<size_t>(cores, 1, kMaxThreads);
+}
@@ -1,28 +1,114 @@
 #include "net/Message.hpp"
-#include "utils/byte_tools.hpp"
 
-Message Message::Parse(const std::string& message_string) {
-    size_t length = utils::BytesToInt(message_string.substr(0, 4));
-    if (length == 0) {
-        return { MessageId(10), 0, "" };
+namespace {
+    uint32_t ReadUint32(const char* data) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(data[0])) << 24) |
+               (static_cast<uint32_t>(static_cast<unsigned char>(data[1])) << 16) |
+               (static_cast<uint32_t>(static_cast<unsigned char>(data[2])) << 8) |
+               static_cast<uint32_t>(static_cast<unsigned char>(data[3]));
     }
 
-    uint8_t id = uint8_t((unsigned char) message_string[4]);
-    std::string payload;
-    if (id > 3) {
-        payload = message_string.substr(5);
+    void WriteUint32(uint32_t value, char* out) {
+        out[0] = static_cast<char>((value >> 24) & 0xFF);
+        out[1] = static_cast<char>((value >> 16) & 0xFF);
+        out[2] = static_cast<char>((value >> 8) & 0xFF);
+        out[3] = static_cast<char>(value & 0xFF);
     }
+}
+
+Message Message::Parse(std::string_view message_string) {
+    if (message_string.size() < kLengthSize) {
+        return { MessageId::kKeepAlive, 0, {} };
+    }
+
+    size_t length = ReadUint32(message_string.data());
+    if (length == 0 || message_string.size() < kHeaderSize) {
+        return { MessageId::kKeepAlive, 0, {} };
+    }
+
+    auto id = static_cast<MessageId>(static_cast<unsigned char>(message_string[kLengthSize]));
+    return { id, length, message_string.substr(kHeaderSize) };
+}
+
+bool Message::Decode(HaveMessage& have) const {
+    if (payload.size() < 4) {
+        return false;
+    }
+    have.piece_index = ReadUint32(payload.data());
+    return true;
+}
+
+bool Message::Decode(RequestMessage& request) const {
+    if (payload.size() < 12) {
+        return false;
+    }
+    request.piece_index = ReadUint32(payload.data());
+    request.offset = ReadUint32(payload.data() + 4);
+    request.length = ReadUint32(payload.data() + 8);
+    return true;
+}
+
+bool Message::Decode(PieceMessage& piece) const {
+    if (payload.size() < 8) {
+        return false;
+    }
+    piece.piece_index = ReadUint32(payload.data());
+    piece.offset = ReadUint32(payload.data() + 4);
+    piece.block = payload.substr(8);
+    return true;
+}
+
+bool Message::Decode(PortMessage& port) const {
+    if (payload.size() < 2) {
+        return false;
+    }
+    port.port = static_cast<uint16_t>((static_cast<unsigned char>(payload[0]) << 8) |
+                                      static_cast<unsigned char>(payload[1]));
+    return true;
+}
+
+size_t Message::EncodeKeepAlive(char* out) {
+    WriteUint32(0, out);
+    return kKeepAliveSize;
+}
+
+size_t Message::EncodeHeader(MessageId id, size_t payload_length, char* out) {
+    WriteUint32(static_cast<uint32_t>(payload_length + 1), out);
+    out[kLengthSize] = static_cast<char>(id);
+    return kHeaderSize;
+}
+
+size_t Message::Encode(MessageId id, char* out) {
+    if (id == MessageId::kKeepAlive) {
+        return EncodeKeepAlive(out);
+    }
+    return EncodeHeader(id, 0, out);
+}
+
+size_t Message::Encode(const HaveMessage& have, char* out) {
+    EncodeHeader(MessageId::kHave, 4, out);
+    WriteUint32(have.piece_index, out + kHeaderSize);
+    return kHaveSize;
+}
 
-    return { MessageId(id), length, payload };
+size_t Message::Encode(MessageId id, const RequestMessage& request, char* out) {
+    EncodeHeader(id, 12, out);
+    WriteUint32(request.piece_index, out + kHeaderSize);
+    WriteUint32(request.offset, out + kHeaderSize + 4);
+    WriteUint32(request.length, out + kHeaderSize + 8);
+    return kRequestSize;
 }
 
-Message Message::Init(MessageId id, const std::string& payload) {
-    return { id, payload.size() + 1, payload };
+size_t Message::Encode(const PortMessage& port, char* out) {
+    EncodeHeader(MessageId::kPort, 2, out);
+    out[kHeaderSize] = static_cast<char>((port.port >> 8) & 0xFF);
+    out[kHeaderSize + 1] = static_cast<char>(port.port & 0xFF);
+    return kPortSize;
 }
 
-std::string Message::ToString() const {
-    std::string message_id;
-    unsigned char ch = static_cast<uint8_t>(id) & 0xFF;
-    message_id += ch;
-    return utils::IntToBytes(messageLength) + message_id + payload;
+size_t Message::EncodePieceHeader(uint32_t piece_index, uint32_t offset, size_t block_length, char* out) {
+    EncodeHeader(MessageId::kPiece, 8 + block_length, out);
+    WriteUint32(piece_index, out + kHeaderSize);
+    WriteUint32(offset, out + kHeaderSize + 4);
+    return kPieceHeaderSize;
 }
@@ -1,30 +1,12 @@
 #include "net/PeerConnect.hpp"
-#include "utils/byte_tools.hpp"
 #include "net/Message.hpp"
-#include <thread>
 #include <algorithm>
 #include <iostream>
 
 using namespace std::chrono_literals;
 
-PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield, size_t size) :
-    bitfield(std::move(bitfield)),
-    size(size) {}
-
-bool PeerPiecesAvailability::IsPieceAvailable(size_t piece_index) const {
-    if (piece_index >= (size << 3)) // size * 8
-        return false;
-    return (bitfield[piece_index >> 3] >> (7 - (piece_index & 7))) & 1; // piece_index % 8
-}
-
-void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
-    if (pieceIndex < (size << 3)) { // size * 8
-        bitfield[pieceIndex >> 3] |= (1 << (7 - (pieceIndex & 7))); // pieceIndex % 8
-    }
-}
-
-size_t PeerPiecesAvailability::Size() const {
-    return size;
+namespace {
+    constexpr size_t kMaxRequestsPerBlock = 3;
 }
 
 PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &torrent_file,
@@ -32,286 +14,415 @@ PeerConnect::PeerConnect(const Peer& peer, const TorrentFile &torrent_file,
     : torrent_file(torrent_file)
     , socket(peer.ip, peer.port, 3500ms, 3500ms)
     , self_peer_id(std::move(self_peer_id))
-    , pieces_availability("", 0)
+    , pieces_availability("", (torrent_file.piece_hashes.size() + 7) >> 3)
     , piece_storage(piece_storage) {}
 
-void PeerConnect::Run() {
-    int total_failures = 0;
-    const int max_total_failures = 20;
+void PeerConnect::SetWorkerIndex(size_t index) {
+    worker_index = index;
+}
 
-    while (!is_terminated && total_failures < max_total_failures) {
-        try {
-            if (total_failures > 0) {
-                int backoff = std::min(10, total_failures);
-                for (int i = 0; i < backoff * 10 && !is_terminated; ++i) {
-                    std::this_thread::sleep_for(100ms);
-                }
-                if (is_terminated) break;
-            }
+void PeerConnect::Start() {
+    if (state == State::kIdle && !is_terminated) {
+        Connect(Clock::now());
+    }
+}
 
-            if (is_terminated) break;
+void PeerConnect::Connect(Clock::time_point now) {
+    try {
+        socket.StartConnect();
+        SetState(State::kConnecting, now);
+    } catch (const std::exception& e) {
+        HandleConnectionError(e.what());
+    }
+}
 
-            if (EstablishConnection()) {
-                total_failures = 0;
-                MainLoop();
-            } else {
-                total_failures++;
-            }
-        } catch (const std::exception& e) {
-            if (!is_terminated) {
-                total_failures++;
-                std::cerr << "Peer " << socket.GetIp() << ":" << socket.GetPort()
-                            << " error: " << e.what()
-                            << " (total failures: " << total_failures << ")" << std::endl;
-                HandleConnectionError();
+void PeerConnect::SetState(State new_state, Clock::time_point now) {
+    state = new_state;
+    state_changed_at = now;
+    last_activity_time = now;
+}
+
+void PeerConnect::OnWritable() {
+    try {
+        if (state == State::kConnecting) {
+            if (!socket.FinishConnect()) {
+                return;
             }
+            SetState(State::kHandshaking, Clock::now());
+            SendHandshake();
+            return;
         }
+
+        if (state == State::kHandshaking || state == State::kConnected) {
+            socket.FlushSendBuffer();
+        }
+    } catch (const std::exception& e) {
+        HandleConnectionError(e.what());
     }
+}
 
-    if (total_failures >= max_total_failures) {
-        std::cout << "Permanently giving up on peer " << socket.GetIp()
-                    << " after " << total_failures << " failures" << std::endl;
-        has_failed = true;
+void PeerConnect::OnReadable() {
+    if (state != State::kHandshaking && state != State::kConnected) {
+        return;
     }
 
-    Terminate();
+    try {
+        socket.ReadAvailable();
+    } catch (const std::exception& e) {
+        HandleConnectionError(e.what());
+        return;
+    }
+    ProcessReceivedData();
 }
 
-bool PeerConnect::IsTerminated() const {
-    return is_terminated;
+void PeerConnect::OnDataReceived() {
+    if (state == State::kHandshaking || state == State::kConnected) {
+        ProcessReceivedData();
+    }
 }
 
-void PeerConnect::HandleConnectionError() {
-    has_failed = true;
+void PeerConnect::OnSocketError(const std::string& reason) {
+    if (state != State::kIdle && state != State::kFinished) {
+        HandleConnectionError(reason);
+    }
+}
 
-    if (piece_is_in_progress && !piece_is_in_progress->AllBlocksRetrieved()) {
-            if (!piece_storage.IsPieceAlreadySaved(piece_is_in_progress->GetIndex())) {
-                std::cout << "DEBUG: Returning piece " << piece_is_in_progress->GetIndex()
-                          << " to queue due to connection error" << std::endl;
-                piece_is_in_progress->Reset();
-                piece_storage.Enqueue(piece_is_in_progress);
-            } else {
-                std::cout << "DEBUG: Piece " << piece_is_in_progress->GetIndex()
-                          << " already saved, not returning to queue" << std::endl;
+void PeerConnect::ProcessReceivedData() {
+    try {
+        last_activity_time = Clock::now();
+        // Everything queued while handling this batch (interested, requests)
+        // leaves in a single sendmsg; a connection error resets the cork.
+        socket.Cork();
+
+        if (state == State::kHandshaking) {
+            static constexpr int kResponseSize = 68;
+            std::string_view response;
+            if (socket.PopBytes(kResponseSize, response)) {
+                ProcessHandshake(response);
+                SetState(State::kConnected, Clock::now());
+                total_failures = 0;
+                SendInterested();
             }
-            piece_is_in_progress.reset();
         }
 
-    block_is_pending = false;
-
-    try {
-        socket.CloseConnection();
-    } catch (...) {
-    }
+        // Frame everything that arrived with this wakeup; the views point
+        // into the receive ring and are consumed before the next read.
+        std::string_view message;
+        while (state == State::kConnected && socket.PopMessage(message)) {
+            ProcessMessage(message);
+        }
 
-    if (!is_terminated) {
-        std::this_thread::sleep_for(2s);
+        if (state == State::kConnected && !is_choked) {
+            FillRequestPipeline();
+        }
+        socket.Uncork();
+    } catch (const std::exception& e) {
+        HandleConnectionError(e.what());
     }
 }
 
-void PeerConnect::PerformHandshake() {
-    std::string handshake_message;
-    handshake_message += static_cast<char>(19); // pstrlen
-    handshake_message += "BitTorrent protocol"; // pstr
-    handshake_message += std::string(8, '\0'); // reserved
-    handshake_message += torrent_file.info_hash; // info_hash
-    handshake_message += self_peer_id; // peer_id
+void PeerConnect::OnTick(Clock::time_point now) {
+    try {
+        switch (state) {
+            case State::kIdle:
+                if (!is_terminated && now >= retry_at) {
+                    Connect(now);
+                }
+                break;
 
-    socket.SendData(handshake_message);
+            case State::kConnecting:
+                if (now - state_changed_at > socket.GetConnectTimeout()) {
+                    throw std::runtime_error("Connection timeout");
+                }
+                break;
 
-    static constexpr int kResponseSize = 68;
-    std::string response = socket.ReceiveData(kResponseSize);
+            case State::kHandshaking:
+                if (now - state_changed_at > socket.GetReadTimeout()) {
+                    throw std::runtime_error("Handshake timeout");
+                }
+                break;
 
-    if (response.size() < kResponseSize) {
-        throw std::runtime_error("Handshake response too short");
+            case State::kConnected:
+                CheckTimeouts(now);
+                socket.Cork();
+                if (!is_choked && FillRequestPipeline()) {
+                    last_activity_time = now;
+                }
+                socket.Uncork();
+                break;
+
+            case State::kFinished:
+                break;
+        }
+    } catch (const std::exception& e) {
+        HandleConnectionError(e.what());
     }
+}
 
-    static constexpr int kPeerInfoHashSize = 28;
-    std::string peer_info_hash = response.substr(kPeerInfoHashSize, 20);
-    if (peer_info_hash != torrent_file.info_hash) {
-        throw std::runtime_error("Peer sent mismatching info hash");
+void PeerConnect::CheckTimeouts(Clock::time_point now) {
+    constexpr auto inactivity_timeout = 30s;
+    constexpr auto block_timeout = 15s;
+
+    // Only a peer we are waiting on can be inactive; an idle connection with
+    // nothing left to request is kept open.
+    bool is_waiting = is_choked || !pipeline.IsEmpty();
+    if (is_waiting && now - last_activity_time > inactivity_timeout) {
+        throw std::runtime_error("Connection timeout due to inactivity");
     }
 
-    static constexpr int kPeerIdSize = 48;
-    peer_id = response.substr(kPeerIdSize, 20);
+    if (pipeline.OldestRequestAge(now) > block_timeout) {
+        std::cout << "DEBUG: Block timeout from " << socket.GetIp()
+                  << " with " << pipeline.Size() << " requests outstanding" << std::endl;
+        ReturnPiecesInProgress("block timeout");
+    }
 }
 
-bool PeerConnect::EstablishConnection() {
-    try {
-        socket.EstablishConnection();
-        PerformHandshake();
-        ReceiveBitfield();
-        SendInterested();
-        return true;
-    } catch (const std::exception& e) {
-        std::cerr << "Failed to establish connection with " << socket.GetIp()
-                  << ":" << socket.GetPort() << " - " << e.what() << std::endl;
-        try {
-            socket.CloseConnection();
-        } catch (...) {
-        }
-        return false;
-    }
+TcpConnect& PeerConnect::GetSocket() {
+    return socket;
 }
 
-void PeerConnect::ReceiveBitfield() {
-    std::string message = socket.ReceiveData();
+int PeerConnect::GetFd() const {
+    return socket.GetFd();
+}
 
-    if (message.empty()) {
-        throw std::runtime_error("Empty message received");
-    }
+uint64_t PeerConnect::GetSocketGeneration() const {
+    return socket.GetGeneration();
+}
 
-    int messageLength = utils::BytesToInt(message.substr(0, 4));
-    if (messageLength == 0) {
-        return; // Keep-alive
+bool PeerConnect::IsConnecting() const {
+    return state == State::kConnecting;
+}
+
+bool PeerConnect::WantsWrite() const {
+    return state == State::kConnecting || socket.HasPendingSend();
+}
+
+bool PeerConnect::IsTerminated() const {
+    return is_terminated;
+}
+
+void PeerConnect::HandleConnectionError(const std::string& reason) {
+    constexpr int max_total_failures = 20;
+
+    ReturnPiecesInProgress("connection error");
+    ForgetPeerAvailability();
+    socket.CloseConnection();
+    is_choked = true;
+
+    if (is_terminated) {
+        SetState(State::kFinished, Clock::now());
+        return;
     }
 
-    uint8_t messageId = static_cast<uint8_t>(message[4]);
+    total_failures++;
+    std::cerr << "Peer " << socket.GetIp() << ":" << socket.GetPort()
+              << " error: " << reason
+              << " (total failures: " << total_failures << ")" << std::endl;
 
-    if (messageId == static_cast<uint8_t>(MessageId::kUnchoke)) {
-        is_choked = false;
+    if (total_failures >= max_total_failures) {
+        std::cout << "Permanently giving up on peer " << socket.GetIp()
+                  << " after " << total_failures << " failures" << std::endl;
+        has_failed = true;
+        Terminate();
         return;
     }
 
-    if (messageId == static_cast<uint8_t>(MessageId::kBitField)) {
-        std::string bitfield = message.substr(5);
-        size_t bitfield_size = (torrent_file.piece_hashes.size() + 7) >> 3; // ceil(pieceCount / 8)
-        pieces_availability = PeerPiecesAvailability(bitfield, bitfield_size);
+    auto now = Clock::now();
+    SetState(State::kIdle, now);
+    retry_at = now + 2s + std::chrono::seconds(std::min(10, total_failures));
+}
+
+void PeerConnect::ReturnPiecesInProgress(const std::string& reason) {
+    // Pieces other peers own stay with them; only our requests are dropped.
+    for (const PendingRequest& request : pipeline.GetRequests()) {
+        for (const PiecePtr& piece : endgame_pieces) {
+            if (piece->GetIndex() == request.piece) {
+                piece->CancelBlockRequest(request.offset);
+            }
+        }
     }
+    pipeline.Clear();
+    endgame_pieces.clear();
+
+    for (const PiecePtr& piece : pieces_in_progress) {
+        if (piece->IsComplete()) {
+            continue; // finished by an endgame peer, which processes it
+        }
+        if (piece_storage.IsPieceAlreadySaved(piece->GetIndex())) {
+            std::cout << "DEBUG: Piece " << piece->GetIndex()
+                      << " already saved, not returning to queue" << std::endl;
+            continue;
+        }
+        std::cout << "DEBUG: Returning piece " << piece->GetIndex()
+                  << " to queue due to " << reason << std::endl;
+        piece->Reset();
+        piece_storage.Enqueue(piece);
+    }
+    pieces_in_progress.clear();
 }
 
-void PeerConnect::SendInterested() {
-    Message message = Message::Init(MessageId::kInterested, "");
-    socket.SendData(message.ToString());
+void PeerConnect::SendHandshake() {
+    std::string handshake_message;
+    handshake_message += static_cast<char>(19); // pstrlen
+    handshake_message += "BitTorrent protocol"; // pstr
+    handshake_message += std::string(8, '\0'); // reserved
+    handshake_message += torrent_file.info_hash; // info_hash
+    handshake_message += self_peer_id; // peer_id
+
+    SendMessage(handshake_message);
 }
 
-void PeerConnect::Terminate() {
-    is_terminated = true;
-    if (piece_is_in_progress && !piece_is_in_progress->AllBlocksRetrieved()) {
-        std::cout << "DEBUG: Returning piece " << piece_is_in_progress->GetIndex()
-                  << " to queue due to termination" << std::endl;
-        piece_is_in_progress->Reset();
-        piece_storage.Enqueue(piece_is_in_progress);
-        piece_is_in_progress.reset();
+void PeerConnect::ProcessHandshake(std::string_view response) {
+    static constexpr int kPeerInfoHashSize = 28;
+    std::string_view peer_info_hash = response.substr(kPeerInfoHashSize, 20);
+    if (peer_info_hash != torrent_file.info_hash) {
+        throw std::runtime_error("Peer sent mismatching info hash");
     }
 
-    try {
-        socket.CloseConnection();
-    } catch (const std::exception& e) {
-        // Ignore errors during cleanup
-    }
+    static constexpr int kPeerIdSize = 48;
+    peer_id.assign(response.substr(kPeerIdSize, 20));
 }
 
-void PeerConnect::MainLoop() {
-    auto last_activity_time = std::chrono::steady_clock::now();
-    constexpr auto inactivity_timeout = 30s;
-    auto last_block_request_time = std::chrono::steady_clock::now();
-    constexpr auto block_timeout = 15s;
+void PeerConnect::SendMessage(std::string_view data) {
+    socket.Send(data);
+}
 
-    while (!is_terminated) {
-        try {
-            auto now = std::chrono::steady_clock::now();
+void PeerConnect::SendInterested() {
+    char message[Message::kHeaderSize];
+    SendMessage(std::string_view(message, Message::Encode(MessageId::kInterested, message)));
+}
 
-            if (now - last_activity_time > inactivity_timeout) {
-                throw std::runtime_error("Connection timeout due to inactivity");
-            }
+void PeerConnect::Terminate() {
+    is_terminated = true;
+    ReturnPiecesInProgress("termination");
+    ForgetPeerAvailability();
+    socket.CloseConnection();
+    SetState(State::kFinished, Clock::now());
+}
 
-            if (block_is_pending && (now - last_block_request_time > block_timeout)) {
-                std::cout << "DEBUG: Block timeout for piece "
-                            << piece_is_in_progress->GetIndex() << ", returning to queue" << std::endl;
-                piece_is_in_progress->Reset();
-                piece_storage.Enqueue(piece_is_in_progress);
-                piece_is_in_progress.reset();
-                block_is_pending = false;
-                continue;
-            }
+bool PeerConnect::FillRequestPipeline() {
+    auto now = std::chrono::steady_clock::now();
+    bool sent_any = false;
 
-            if (!piece_is_in_progress || piece_is_in_progress->AllBlocksRetrieved()) {
-                piece_is_in_progress = GetNextAvailablePiece();
-                if (!piece_is_in_progress) {
-                    if (piece_storage.QueueIsEmpty() || is_terminated) {
-                        break;
-                    }
-                    std::this_thread::sleep_for(100ms);
-                    continue;
-                }
-            }
+    // Once in endgame the list is refreshed on every fill, so a piece its
+    // owner has since returned to the queue is not requested through it.
+    if (!endgame_pieces.empty() || piece_storage.QueueIsEmpty()) {
+        UpdateEndgame();
+    }
 
-            if (!is_choked && !block_is_pending) {
-                Block* block = piece_is_in_progress->GetFirstMissingBlock();
-                if (block) {
-                    RequestPiece(block);
-                    block_is_pending = true;
-                    last_block_request_time = now;
-                    last_activity_time = now;
-                }
-            }
+    while (pipeline.HasRoom() && !is_terminated) {
+        const Block* block = GetNextBlockToRequest();
+        if (!block) {
+            break;
+        }
+        RequestPiece(block);
+        pipeline.OnRequestSent(block->piece, block->offset, block->length, now);
+        sent_any = true;
+    }
+    return sent_any;
+}
 
-            std::string received_data;
-            try {
-                received_data = socket.ReceiveData();
-            } catch (const std::runtime_error& e) {
-                if (std::string(e.what()) == "Connection terminated") {
-                    break;
-                }
-                throw;
-            }
+const Block* PeerConnect::GetNextBlockToRequest() {
+    for (const PiecePtr& piece : pieces_in_progress) {
+        if (Block* block = piece->GetFirstMissingBlock()) {
+            return block;
+        }
+    }
 
-            if (!received_data.empty()) {
-                ProcessMessage(received_data);
-                last_activity_time = std::chrono::steady_clock::now();
-            }
+    // Only take on as many pieces as the current queue depth can keep busy.
+    size_t max_pieces = pipeline.TargetDepth() * kBlockSize / torrent_file.piece_length + 1;
+    if (pieces_in_progress.size() >= max_pieces) {
+        return nullptr;
+    }
 
-        } catch (const std::exception& e) {
-            if (!is_terminated) {
-                HandleConnectionError();
-                throw;
-            }
+    PiecePtr piece = GetNextAvailablePiece();
+    if (!piece) {
+        return GetEndgameBlock();
+    }
+    pieces_in_progress.push_back(piece);
+    return piece->GetFirstMissingBlock();
+}
+
+// Endgame starts once every remaining piece has been handed out. From then
+// on the unfinished blocks of pieces other peers are downloading are
+// requested here too, from at most a few peers at once so a large swarm
+// does not fetch every block hundreds of times. Whichever copy arrives
+// first is kept; UpdateEndgame cancels the requests still outstanding.
+const Block* PeerConnect::GetEndgameBlock() {
+    for (const PiecePtr& piece : endgame_pieces) {
+        if (const Block* block = piece->GetFirstMissingBlock()) {
+            return block;
+        }
+        auto already_requested = [this](const Block& block) {
+            return pipeline.Contains(block.piece, block.offset);
+        };
+        if (const Block* block = piece->GetBlockToDuplicate(kMaxRequestsPerBlock, already_requested)) {
+            return block;
         }
     }
+    return nullptr;
 }
 
-PiecePtr PeerConnect::GetNextAvailablePiece() {
-    while (!is_terminated) {
-        PiecePtr piece = piece_storage.GetNextPieceToDownload();
-        if (!piece) {
-            if (piece_storage.IsDownloadComplete()) {
-                break;
-            }
-            continue;
+void PeerConnect::UpdateEndgame() {
+    std::vector<PendingRequest> redundant;
+    for (const PendingRequest& request : pipeline.GetRequests()) {
+        PiecePtr piece = FindPieceInProgress(request.piece);
+        if (!piece || piece->IsBlockRetrieved(request.offset)) {
+            redundant.push_back(request);
+        }
+    }
+    for (const PendingRequest& request : redundant) {
+        pipeline.Cancel(request.piece, request.offset);
+        SendCancel(request);
+        if (PiecePtr piece = FindPieceInProgress(request.piece)) {
+            piece->CancelBlockRequest(request.offset);
         }
+    }
 
-        size_t missing_count = piece_storage.GetMissingPieces().size();
-        bool endgame_mode = missing_count <= 10;
+    // Pieces finished through another peer are that peer's to process.
+    auto is_finished = [](const PiecePtr& piece) { return piece->IsComplete(); };
+    pieces_in_progress.erase(std::remove_if(pieces_in_progress.begin(), pieces_in_progress.end(), is_finished),
+                             pieces_in_progress.end());
 
-        if (pieces_availability.IsPieceAvailable(piece->GetIndex()) || endgame_mode) {
-            if (endgame_mode && !pieces_availability.IsPieceAvailable(piece->GetIndex())) {
-                std::cout << "ENDGAME: Trying piece " << piece->GetIndex()
-                          << " even though peer doesn't have it in bitfield" << std::endl;
-            }
-            return piece;
+    endgame_pieces.clear();
+    if (!piece_storage.QueueIsEmpty()) {
+        return; // pieces are waiting again: take one of those instead
+    }
+    for (PiecePtr& piece : piece_storage.GetPiecesInProgress(pieces_availability)) {
+        if (!piece->IsComplete() && !FindPieceInProgress(piece->GetIndex())) {
+            endgame_pieces.push_back(std::move(piece));
         }
+    }
+}
 
-        piece_storage.Enqueue(piece);
+PiecePtr PeerConnect::FindPieceInProgress(size_t piece_index) const {
+    auto has_index = [piece_index](const PiecePtr& piece) { return piece->GetIndex() == piece_index; };
+    auto it = std::find_if(pieces_in_progress.begin(), pieces_in_progress.end(), has_index);
+    if (it != pieces_in_progress.end()) {
+        return *it;
     }
-    return nullptr;
+    it = std::find_if(endgame_pieces.begin(), endgame_pieces.end(), has_index);
+    return it != endgame_pieces.end() ? *it : nullptr;
+}
+
+PiecePtr PeerConnect::GetNextAvailablePiece() {
+    return piece_storage.GetNextPieceToDownload(pieces_availability, worker_index);
+}
+
+void PeerConnect::ForgetPeerAvailability() {
+    piece_storage.RemovePeerAvailability(pieces_availability);
+    pieces_availability = PeerPiecesAvailability("", pieces_availability.Size());
 }
 
-void PeerConnect::ProcessMessage(const std::string& message_data) {
+void PeerConnect::ProcessMessage(std::string_view message_data) {
     Message message = Message::Parse(message_data);
 
     switch (message.id) {
         case MessageId::kChoke:
             std::cout << "DEBUG: Peer " << socket.GetIp() << " choked us" << std::endl;
             is_choked = true;
-            block_is_pending = false;
-            if (piece_is_in_progress && !piece_is_in_progress->AllBlocksRetrieved()) {
-                std::cout << "DEBUG: Returning piece " << piece_is_in_progress->GetIndex()
-                          << " to queue due to choke" << std::endl;
-                piece_is_in_progress->Reset();
-                piece_storage.Enqueue(piece_is_in_progress);
-                piece_is_in_progress.reset();
-            }
+            // A choking peer discards every request it has not served yet.
+            ReturnPiecesInProgress("choke");
             break;
 
         case MessageId::kUnchoke:
@@ -319,40 +430,54 @@ void PeerConnect::ProcessMessage(const std::string& message_data) {
             is_choked = false;
             break;
 
+        case MessageId::kBitField: {
+            size_t bitfield_size = (torrent_file.piece_hashes.size() + 7) >> 3; // ceil(pieceCount / 8)
+            piece_storage.RemovePeerAvailability(pieces_availability);
+            pieces_availability = PeerPiecesAvailability(std::string(message.payload), bitfield_size);
+            piece_storage.AddPeerAvailability(pieces_availability);
+            break;
+        }
+
         case MessageId::kHave: {
-            if (message.payload.size() >= 4) {
-                size_t pieceIndex = utils::BytesToInt(message.payload.substr(0, 4));
-                pieces_availability.SetPieceAvailability(pieceIndex);
-                std::cout << "DEBUG: Peer " << socket.GetIp() << " now has piece " << pieceIndex << std::endl;
+            HaveMessage have;
+            if (message.Decode(have) && !pieces_availability.IsPieceAvailable(have.piece_index)) {
+                pieces_availability.SetPieceAvailability(have.piece_index);
+                piece_storage.AddPieceAvailability(have.piece_index);
+                std::cout << "DEBUG: Peer " << socket.GetIp() << " now has piece " << have.piece_index << std::endl;
             }
             break;
         }
 
         case MessageId::kPiece: {
-            if (message.payload.size() >= 8) {
-                size_t piece_index = utils::BytesToInt(message.payload.substr(0, 4));
-                size_t block_offset = utils::BytesToInt(message.payload.substr(4, 4));
-                std::string block_data = message.payload.substr(8);
-
-                if (piece_is_in_progress && piece_is_in_progress->GetIndex() == piece_index) {
-                    piece_is_in_progress->SaveBlock(block_offset, block_data);
-                    block_is_pending = false;
-
-                    if (piece_is_in_progress->AllBlocksRetrieved()) {
-
-                        if (piece_is_in_progress->HashMatches()) {
-                            piece_storage.PieceProcessed(piece_is_in_progress);
-                            piece_is_in_progress.reset();
-
-                        } else {
-                            std::cout << "DEBUG: Piece " << piece_index << " hash mismatch from "
-                                      << socket.GetIp() << std::endl;
-
-                            piece_is_in_progress->Reset();
-                            piece_storage.Enqueue(piece_is_in_progress);
-                            piece_is_in_progress.reset();
-                        }
-                    }
+            PieceMessage block;
+            if (message.Decode(block)) {
+                size_t piece_index = block.piece_index;
+                size_t block_offset = block.offset;
+
+                // Blocks we no longer wait for (e.g. requested before a choke
+                // or cancelled in endgame) are dropped.
+                auto now = std::chrono::steady_clock::now();
+                if (!pipeline.OnBlockReceived(piece_index, block_offset, block.block.size(), now)) {
+                    break;
+                }
+
+                PiecePtr piece = FindPieceInProgress(piece_index);
+                if (!piece) {
+                    break;
+                }
+
+                // Hashing happens on the hasher pool. Only the connection that
+                // completes the piece hands it over for verification; in
+                // endgame the others see it finished and cancel.
+                Piece::SaveResult result = piece->SaveBlock(block_offset, block.block);
+                if (result == Piece::SaveResult::kSaved) {
+                    piece_storage.BlockSaved(piece);
+                } else if (result == Piece::SaveResult::kCompleted) {
+                    pieces_in_progress.erase(std::remove(pieces_in_progress.begin(), pieces_in_progress.end(), piece),
+                                             pieces_in_progress.end());
+                    endgame_pieces.erase(std::remove(endgame_pieces.begin(), endgame_pieces.end(), piece),
+                                         endgame_pieces.end());
+                    piece_storage.PieceProcessed(piece);
                 }
             }
             break;
@@ -370,13 +495,19 @@ void PeerConnect::RequestPiece(const Block* block) {
     if (!block)
         return;
 
-    std::string payload;
-    payload += utils::IntToBytes(static_cast<uint32_t>(block->piece));
-    payload += utils::IntToBytes(static_cast<uint32_t>(block->offset));
-    payload += utils::IntToBytes(static_cast<uint32_t>(block->length));
+    RequestMessage request{static_cast<uint32_t>(block->piece),
+                           static_cast<uint32_t>(block->offset),
+                           static_cast<uint32_t>(block->length)};
+    char message[Message::kRequestSize];
+    SendMessage(std::string_view(message, Message::Encode(MessageId::kRequest, request, message)));
+}
 
-    Message message = Message::Init(MessageId::kRequest, payload);
-    socket.SendData(message.ToString());
+void PeerConnect::SendCancel(const PendingRequest& pending) {
+    RequestMessage request{static_cast<uint32_t>(pending.piece),
+                           static_cast<uint32_t>(pending.offset),
+                           static_cast<uint32_t>(pending.length)};
+    char message[Message::kRequestSize];
+    SendMessage(std::string_view(message, Message::Encode(MessageId::kCancel, request, message)));
 }
 
 bool PeerConnect::Failed() const {
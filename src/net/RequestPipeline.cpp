@@ -0,0 +1,133 @@
+#include "net/RequestPipeline.hpp"
+#include "core/Piece.hpp"
+#include <algorithm>
+#include <cmath>
+
+using namespace std::chrono_literals;
+
+namespace {
+    constexpr auto kThroughputInterval = 500ms;
+    constexpr auto kRttWindow = 10s;
+    constexpr double kThroughputWeight = 0.3;
+    constexpr double kDepthHeadroom = 1.5;
+}
+
+void RequestPipeline::OnRequestSent(size_t piece, size_t offset, size_t length, Clock::time_point now) {
+    if (!interval_started) {
+        interval_start = now;
+        rtt_window_start = now;
+        interval_started = true;
+    }
+    requests.push_back(PendingRequest{piece, offset, length, now});
+}
+
+bool RequestPipeline::OnBlockReceived(size_t piece, size_t offset, size_t length, Clock::time_point now) {
+    auto it = std::find_if(requests.begin(), requests.end(), [&](const PendingRequest& request) {
+        return request.piece == piece && request.offset == offset;
+    });
+    if (it == requests.end()) {
+        return false;
+    }
+
+    Clock::duration sample = now - it->sent_at;
+    min_rtt = std::min(min_rtt, sample);
+    window_min_rtt = std::min(window_min_rtt, sample);
+    if (now - rtt_window_start > kRttWindow) {
+        min_rtt = window_min_rtt;
+        window_min_rtt = Clock::duration::max();
+        rtt_window_start = now;
+    }
+
+    requests.erase(it);
+    bytes_in_interval += length;
+    UpdateThroughput(now);
+    return true;
+}
+
+bool RequestPipeline::Cancel(size_t piece, size_t offset) {
+    auto it = std::find_if(requests.begin(), requests.end(), [&](const PendingRequest& request) {
+        return request.piece == piece && request.offset == offset;
+    });
+    if (it == requests.end()) {
+        return false;
+    }
+    requests.erase(it);
+    return true;
+}
+
+bool RequestPipeline::Contains(size_t piece, size_t offset) const {
+    return std::any_of(requests.begin(), requests.end(), [&](const PendingRequest& request) {
+        return request.piece == piece && request.offset == offset;
+    });
+}
+
+const std::deque<PendingRequest>& RequestPipeline::GetRequests() const {
+    return requests;
+}
+
+void RequestPipeline::Clear() {
+    requests.clear();
+    bytes_in_interval = 0;
+    interval_started = false;
+}
+
+size_t RequestPipeline::Size() const {
+    return requests.size();
+}
+
+bool RequestPipeline::IsEmpty() const {
+    return requests.empty();
+}
+
+bool RequestPipeline::HasRoom() const {
+    return requests.size() < target_depth;
+}
+
+size_t RequestPipeline::TargetDepth() const {
+    return target_depth;
+}
+
+RequestPipeline::Clock::duration RequestPipeline::OldestRequestAge(Clock::time_point now) const {
+    if (requests.empty()) {
+        return Clock::duration::zero();
+    }
+    return now - requests.front().sent_at;
+}
+
+double RequestPipeline::GetThroughput() const {
+    return throughput;
+}
+
+RequestPipeline::Clock::duration RequestPipeline::GetRoundTripTime() const {
+    return min_rtt;
+}
+
+void RequestPipeline::UpdateThroughput(Clock::time_point now) {
+    auto elapsed = now - interval_start;
+    if (elapsed < kThroughputInterval) {
+        return;
+    }
+
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double rate = bytes_in_interval / seconds;
+    throughput = (throughput == 0.0)
+        ? rate
+        : (1.0 - kThroughputWeight) * throughput + kThroughputWeight * rate;
+
+    bytes_in_interval = 0;
+    interval_start = now;
+    UpdateTargetDepth();
+}
+
+void RequestPipeline::UpdateTargetDepth() {
+    if (min_rtt == Clock::duration::max() || throughput == 0.0) {
+        return;
+    }
+
+    // Throughput is capped by depth * block / rtt, so sizing with headroom
+    // lets the queue grow geometrically until the link itself is the limit.
+    double rtt_seconds = std::chrono::duration<double>(min_rtt).count();
+    double bdp_blocks = throughput * rtt_seconds / kBlockSize;
+    size_t depth = static_cast<size_t>(std::ceil(bdp_blocks * kDepthHeadroom)) + 2;
+    target_depth = std::clamp(depth, kMinDepth, kMaxDepth);
+}
@@ -1,6 +1,17 @@
 #include "net/TcpConnect.hpp"
 #include "utils/byte_tools.hpp"
-#include <cstdio>
+#include <algorithm>
+#include <cerrno>
+#include <sys/uio.h>
+
+namespace {
+    constexpr size_t kReadChunkSize = 256 * 1024;
+    constexpr size_t kMaxSendSegments = 64;
+    constexpr size_t kMaxCoalescedSize = 64 * 1024;
+    // Only guards against garbage length prefixes; bitfields of very large
+    // torrents and oversized blocks are legitimate.
+    constexpr size_t kMaxMessageSize = 16 * 1024 * 1024;
+}
 
 TcpConnect::TcpConnect(std::string ip, int port,
                        std::chrono::milliseconds connect_timeout,
@@ -8,7 +19,7 @@ TcpConnect::TcpConnect(std::string ip, int port,
     : ip(ip), port(port),
       connect_timeout(connect_timeout),
       read_timeout(read_timeout),
-      force_close_(false) {
+      receive_buffer(kReadChunkSize) {
     sock = -1;
 }
 
@@ -17,172 +28,264 @@ TcpConnect::~TcpConnect() {
 }
 
 void TcpConnect::CloseConnection() {
-    force_close_.store(true);
     if (sock != -1) {
         shutdown(sock, SHUT_RDWR);
         close(sock);
         sock = -1;
     }
+    receive_buffer.Clear();
+    send_queue.clear();
+    send_queue_offset = 0;
+    pending_send_bytes = 0;
+    cork_depth = 0;
 }
 
-bool TcpConnect::IsTerminated() const {
-    return force_close_.load();
-}
-
-void TcpConnect::ForceClose() {
-    force_close_.store(true);
-    if (sock != -1) {
-        close(sock);
-        sock = -1;
-    }
-}
-
-void TcpConnect::EstablishConnection() {
-    force_close_.store(false);
-
-    if (sock != -1) {
-        close(sock);
-    }
+void TcpConnect::StartConnect() {
+    CloseConnection();
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock == -1) {
         throw std::runtime_error("Failed to create socket: " + std::string(strerror(errno)));
     }
+    ++generation;
 
     struct sockaddr_in server;
     server.sin_addr.s_addr = inet_addr(ip.c_str());
     server.sin_family = AF_INET;
     server.sin_port = htons(port);
 
-    fd_set fdset;
-    struct timeval time_val;
-
-    int current_state = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, current_state | O_NONBLOCK);
     int code = connect(sock, (struct sockaddr*) &server, sizeof(struct sockaddr_in));
-    if (code == 0) {
-        current_state = fcntl(sock, F_GETFL, 0);
-        fcntl(sock, F_SETFL, current_state & ~O_NONBLOCK);
-        return;
+    if (code != 0 && errno != EINPROGRESS) {
+        int error = errno;
+        CloseConnection();
+        throw std::runtime_error("Socket connection error: " + std::string(strerror(error)));
     }
+}
 
-    FD_ZERO(&fdset);
-    FD_SET(sock, &fdset);
-    time_val.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(connect_timeout).count();
-    time_val.tv_usec = 0;
+bool TcpConnect::FinishConnect() {
+    if (sock == -1) {
+        throw std::runtime_error("Connection closed");
+    }
 
-    code = select(sock + 1, NULL, &fdset, NULL, &time_val);
-    switch (code) {
-        case 0:
-            close(sock);
-            sock = -1;
-            throw std::runtime_error("Connection timeout");
-            break;
+    int so_error = 0;
+    socklen_t length = sizeof so_error;
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &length) < 0) {
+        so_error = errno;
+    }
+    if (so_error != 0) {
+        CloseConnection();
+        throw std::runtime_error("Socket connection error: " + std::string(strerror(so_error)));
+    }
+
+    // SO_ERROR stays 0 while the handshake is still in progress.
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof peer;
+    return getpeername(sock, (struct sockaddr*) &peer, &peer_length) == 0;
+}
 
-        case 1:
-        default:
-            int soError;
-            socklen_t ln = sizeof soError;
-            getsockopt(sock, SOL_SOCKET, SO_ERROR, &soError, &ln);
+size_t TcpConnect::ReadAvailable() {
+    if (sock == -1) {
+        throw std::runtime_error("Connection closed");
+    }
 
-            if (soError == 0) {
-                current_state = fcntl(sock, F_GETFL, 0);
-                fcntl(sock, F_SETFL, current_state & ~O_NONBLOCK);
-                return;
+    size_t total = 0;
+    while (true) {
+        // Keep a full chunk free so every recv can drain up to 256 KB.
+        receive_buffer.Reserve(kReadChunkSize);
+        size_t capacity = receive_buffer.WritableSize();
+        ssize_t received = recv(sock, receive_buffer.WritePointer(), capacity, 0);
+        if (received > 0) {
+            receive_buffer.Commit(received);
+            total += received;
+            if (static_cast<size_t>(received) < capacity) {
+                break;
             }
+            continue;
+        }
+        if (received == 0) {
+            throw std::runtime_error("Connection closed by peer");
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        throw std::runtime_error("Read error: " + std::string(strerror(errno)));
+    }
+    return total;
+}
+
+bool TcpConnect::PopMessage(std::string_view& message) {
+    std::string_view available = receive_buffer.Peek();
+    if (available.size() < 4) {
+        return false;
+    }
 
-            close(sock);
-            sock = -1;
-            throw std::runtime_error("Socket connection error");
+    size_t length = static_cast<uint32_t>(utils::BytesToInt(available));
+    if (length > kMaxMessageSize) {
+        throw std::runtime_error("Message of " + std::to_string(length) + " bytes exceeds the limit");
+    }
+    if (available.size() < 4 + length) {
+        // Make the rest of the message fit behind what is already buffered.
+        receive_buffer.Reserve(4 + length - available.size());
+        return false;
     }
+
+    message = available.substr(0, 4 + length);
+    receive_buffer.Consume(4 + length);
+    return true;
 }
 
-void TcpConnect::SendData(const std::string& data) const {
-    if (force_close_.load() || sock == -1) {
-        throw std::runtime_error("Connection closed");
+bool TcpConnect::PopBytes(size_t count, std::string_view& data) {
+    std::string_view available = receive_buffer.Peek();
+    if (available.size() < count) {
+        return false;
     }
 
-    char to_send[BUFSIZ];
-    for (size_t i = 0; i < data.size(); ++i) {
-        to_send[i] = data[i];
+    data = available.substr(0, count);
+    receive_buffer.Consume(count);
+    return true;
+}
+
+void TcpConnect::Send(std::string_view data) {
+    if (sock == -1) {
+        throw std::runtime_error("Connection closed");
+    }
+    if (data.empty()) {
+        return;
     }
 
-    if ((send(sock, to_send, data.size(), 0)) < 0) {
-        if (!force_close_.load()) {
-            std::cout << "Send error: " << strerror(errno) << ' ' << errno << '\n';
-        }
-        throw std::runtime_error("Send error");
+    if (send_queue.empty() || send_queue.back().size() + data.size() > kMaxCoalescedSize) {
+        send_queue.push_back(std::move(spare_segment));
+        spare_segment.clear();
+    }
+    send_queue.back().append(data);
+    pending_send_bytes += data.size();
+    if (cork_depth == 0) {
+        FlushSendBuffer();
     }
 }
 
-std::string TcpConnect::ReceiveData(size_t buffer_size) const {
-    if (force_close_.load() || sock == -1) {
+void TcpConnect::SendOwned(std::string data) {
+    if (sock == -1) {
         throw std::runtime_error("Connection closed");
     }
+    if (data.empty()) {
+        return;
+    }
 
-    std::string message;
-    if (!buffer_size) {
-        struct pollfd fd;
-        fd.fd = sock;
-        fd.events = POLLIN;
-        int cd = poll(&fd, 1, read_timeout.count());
+    pending_send_bytes += data.size();
+    send_queue.push_back(std::move(data));
+    if (cork_depth == 0) {
+        FlushSendBuffer();
+    }
+}
 
-        if (force_close_.load()) {
-            throw std::runtime_error("Connection terminated");
-        }
+void TcpConnect::Cork() {
+    ++cork_depth;
+}
 
-        switch (cd) {
-            case -1:
-                if (!force_close_.load()) {
-                    throw std::runtime_error("Poll error");
-                }
-                throw std::runtime_error("Connection terminated");
-
-            case 0:
-                throw std::runtime_error("Read timeout");
-
-            default:
-                char data[4];
-                int received = recv(sock, data, sizeof(data), 0);
-                if (received <= 0) {
-                    if (!force_close_.load()) {
-                        throw std::runtime_error("Read error");
-                    }
-                    throw std::runtime_error("Connection terminated");
-                }
-                for (int i = 0; i < received; ++i) {
-                    message += data[i];
-                }
-        }
+void TcpConnect::Uncork() {
+    if (cork_depth > 0 && --cork_depth == 0 && sock != -1) {
+        FlushSendBuffer();
+    }
+}
 
-        buffer_size = utils::BytesToInt(message);
+bool TcpConnect::FlushSendBuffer() {
+    if (sock == -1) {
+        throw std::runtime_error("Connection closed");
+    }
+    if (!direct_io) {
+        return send_queue.empty(); // the engine owns the send path
     }
 
-    if (buffer_size > 100'000) {
-        throw std::runtime_error("Too much data");
+    while (!send_queue.empty()) {
+        iovec segments[kMaxSendSegments];
+        size_t count = 0;
+        for (auto it = send_queue.begin(); it != send_queue.end() && count < kMaxSendSegments; ++it, ++count) {
+            size_t skip = count == 0 ? send_queue_offset : 0;
+            segments[count].iov_base = const_cast<char*>(it->data()) + skip;
+            segments[count].iov_len = it->size() - skip;
+        }
+
+        msghdr header{};
+        header.msg_iov = segments;
+        header.msg_iovlen = count;
+        ssize_t sent = sendmsg(sock, &header, MSG_NOSIGNAL);
+        if (sent > 0) {
+            ConsumeSent(sent);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        throw std::runtime_error("Send error: " + std::string(strerror(errno)));
     }
 
-    int to_read = buffer_size;
-    char data_2[buffer_size];
-    while (to_read > 0) {
-        if (force_close_.load()) {
-            throw std::runtime_error("Connection terminated");
+    return send_queue.empty();
+}
+
+bool TcpConnect::HasPendingSend() const {
+    return !send_queue.empty();
+}
+
+size_t TcpConnect::GetPendingSendSize() const {
+    return pending_send_bytes;
+}
+
+void TcpConnect::SetDirectIo(bool enabled) {
+    direct_io = enabled;
+}
+
+void TcpConnect::AppendReceived(const char* data, size_t length) {
+    receive_buffer.Append(data, length);
+}
+
+size_t TcpConnect::CopyPendingSend(char* destination, size_t capacity) const {
+    size_t copied = 0;
+    size_t skip = send_queue_offset;
+    for (const std::string& segment : send_queue) {
+        if (copied == capacity) {
+            break;
         }
+        size_t length = std::min(capacity - copied, segment.size() - skip);
+        std::memcpy(destination + copied, segment.data() + skip, length);
+        copied += length;
+        skip = 0;
+    }
+    return copied;
+}
 
-        int read = recv(sock, data_2, sizeof(data_2), 0);
-        if (read <= 0) {
-            if (!force_close_.load()) {
-                throw std::runtime_error("Read error");
-            }
-            throw std::runtime_error("Connection terminated");
+// Drops `length` written bytes from the front of the queue; a partially
+// written segment stays queued with its offset advanced.
+void TcpConnect::ConsumeSent(size_t length) {
+    pending_send_bytes -= std::min(length, pending_send_bytes);
+    while (length > 0 && !send_queue.empty()) {
+        size_t remaining = send_queue.front().size() - send_queue_offset;
+        if (length < remaining) {
+            send_queue_offset += length;
+            return;
         }
-        for (int i = 0; i < read; ++i) {
-            message += data_2[i];
+        length -= remaining;
+        if (send_queue.front().capacity() <= kMaxCoalescedSize) {
+            spare_segment = std::move(send_queue.front()); // keeps its capacity for the next burst
+            spare_segment.clear();
         }
-        to_read -= read;
+        send_queue.pop_front();
+        send_queue_offset = 0;
     }
+}
 
-    return message;
+int TcpConnect::GetFd() const {
+    return sock;
+}
+
+uint64_t TcpConnect::GetGeneration() const {
+    return generation;
 }
 
 const std::string &TcpConnect::GetIp() const {
@@ -192,3 +295,11 @@ const std::string &TcpConnect::GetIp() const {
 int TcpConnect::GetPort() const {
     return port;
 }
+
+std::chrono::milliseconds TcpConnect::GetConnectTimeout() const {
+    return connect_timeout;
+}
+
+std::chrono::milliseconds TcpConnect::GetReadTimeout() const {
+    return read_timeout;
+}
@@ -0,0 +1,338 @@
+#include "net/UringEventLoop.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+
+using namespace std::chrono_literals;
+
+namespace {
+    constexpr unsigned kRingEntries = 4096;
+    constexpr auto kTickInterval = 100ms;
+    constexpr size_t kReceiveBufferSize = 32 * 1024;
+    constexpr uint16_t kReceiveBufferCount = 1024;
+    constexpr uint16_t kReceiveBufferGroup = 0;
+    constexpr size_t kMaxSendSize = 256 * 1024;
+
+    // user_data layout: operation (8 bits) | socket generation (24 bits) | slot (32 bits)
+    uint64_t PackUserData(uint8_t operation, uint64_t generation, size_t slot) {
+        return (static_cast<uint64_t>(operation) << 56) |
+               ((generation & 0xFFFFFF) << 32) |
+               static_cast<uint32_t>(slot);
+    }
+}
+
+UringEventLoop::UringEventLoop()
+    : ring(kRingEntries)
+    , receive_arena(kReceiveBufferSize * kReceiveBufferCount) {
+    for (uint16_t id = 0; id < kReceiveBufferCount; id += 256) {
+        io_uring_sqe* sqe = AcquireSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = std::min<int>(256, kReceiveBufferCount - id);
+        sqe->addr = reinterpret_cast<uint64_t>(BufferAt(id));
+        sqe->len = kReceiveBufferSize;
+        sqe->off = id;
+        sqe->buf_group = kReceiveBufferGroup;
+        sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kProvideBuffers), 0, 0);
+    }
+
+    size_t provided = 0;
+    int result = 0;
+    ring.Submit(kReceiveBufferCount / 256);
+    ring.ForEachCompletion([&](const io_uring_cqe& cqe) {
+        if (cqe.res < 0) {
+            result = cqe.res;
+        }
+        ++provided;
+    });
+    if (result < 0 || provided == 0) {
+        throw std::runtime_error("Failed to provide receive buffers: " + std::string(strerror(-result)));
+    }
+}
+
+UringEventLoop::~UringEventLoop() {
+    Stop();
+}
+
+const char* UringEventLoop::GetName() const {
+    return "io_uring";
+}
+
+char* UringEventLoop::BufferAt(uint16_t buffer_id) {
+    return receive_arena.data() + static_cast<size_t>(buffer_id) * kReceiveBufferSize;
+}
+
+io_uring_sqe* UringEventLoop::AcquireSqe() {
+    io_uring_sqe* sqe = ring.GetSqe();
+    if (!sqe) {
+        ring.Submit();
+        sqe = ring.GetSqe();
+    }
+    if (!sqe) {
+        throw std::runtime_error("io_uring submission queue is full");
+    }
+    return sqe;
+}
+
+void UringEventLoop::Loop() {
+    auto next_tick = std::chrono::steady_clock::now();
+
+    while (!is_stopped) {
+        AdoptNewPeers();
+
+        auto now = std::chrono::steady_clock::now();
+        if (!wake_pending) {
+            ArmWake();
+        }
+        if (!timeout_pending) {
+            ArmTimeout(std::max(std::chrono::nanoseconds(0), next_tick - now));
+        }
+
+        // One syscall submits every SQE queued since the last iteration and
+        // sleeps until at least one completion (the tick timeout at worst).
+        if (ring.Submit(1) < 0 && errno != EINTR) {
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        ring.ForEachCompletion([this](const io_uring_cqe& cqe) { HandleCompletion(cqe); });
+
+        now = std::chrono::steady_clock::now();
+        if (now >= next_tick) {
+            TickAll();
+            next_tick = now + kTickInterval;
+        }
+    }
+}
+
+void UringEventLoop::AdoptPeer(std::shared_ptr<PeerConnect> peer) {
+    peer->GetSocket().SetDirectIo(false);
+    entries.emplace_back();
+    entries.back().peer = std::move(peer);
+    if (is_stopped) {
+        return;
+    }
+    entries.back().peer->Start();
+    Arm(entries.size() - 1);
+}
+
+void UringEventLoop::TerminatePeers() {
+    // Terminating shuts the sockets down, which completes any pending
+    // receive or send; the buffers must outlive those completions.
+    for (Entry& entry : entries) {
+        entry.peer->Terminate();
+    }
+    WaitForInFlight();
+    entries.clear();
+}
+
+void UringEventLoop::WaitForInFlight() {
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (in_flight > 0 && std::chrono::steady_clock::now() < deadline) {
+        if (!timeout_pending) {
+            ArmTimeout(kTickInterval);
+        }
+        ring.Submit(1);
+        ring.ForEachCompletion([this](const io_uring_cqe& cqe) { HandleCompletion(cqe); });
+    }
+}
+
+void UringEventLoop::ArmWake() {
+    io_uring_sqe* sqe = AcquireSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kWake), 0, 0);
+    wake_pending = true;
+}
+
+void UringEventLoop::ArmTimeout(std::chrono::nanoseconds timeout) {
+    tick_timeout.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(timeout).count();
+    tick_timeout.tv_nsec = (timeout % std::chrono::seconds(1)).count();
+
+    io_uring_sqe* sqe = AcquireSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&tick_timeout);
+    sqe->len = 1;
+    sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kTimeout), 0, 0);
+    timeout_pending = true;
+}
+
+void UringEventLoop::ProvideBuffer(uint16_t buffer_id) {
+    io_uring_sqe* sqe = AcquireSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = reinterpret_cast<uint64_t>(BufferAt(buffer_id));
+    sqe->len = kReceiveBufferSize;
+    sqe->off = buffer_id;
+    sqe->buf_group = kReceiveBufferGroup;
+    sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kProvideBuffers), 0, 0);
+}
+
+void UringEventLoop::Arm(size_t slot) {
+    Entry& entry = entries[slot];
+    PeerConnect& peer = *entry.peer;
+    int fd = peer.GetFd();
+    if (fd == -1 || peer.IsTerminated()) {
+        return;
+    }
+    uint64_t generation = peer.GetSocketGeneration();
+
+    if (peer.IsConnecting()) {
+        if (!entry.poll_pending) {
+            io_uring_sqe* sqe = AcquireSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kPoll), generation, slot);
+            entry.poll_pending = true;
+            ++in_flight;
+        }
+        return;
+    }
+
+    if (!entry.receive_pending && !receive_starved) {
+        io_uring_sqe* sqe = AcquireSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->len = kReceiveBufferSize;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kReceiveBufferGroup;
+        sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kReceive), generation, slot);
+        entry.receive_pending = true;
+        ++in_flight;
+    }
+
+    TcpConnect& socket = peer.GetSocket();
+    if (!entry.send_pending && socket.HasPendingSend()) {
+        // Requests, haves and keep-alives queued since the last send go out
+        // together; the copy stays untouched until the completion arrives.
+        entry.send_in_flight.resize(std::min(kMaxSendSize, socket.GetPendingSendSize()));
+        size_t length = socket.CopyPendingSend(entry.send_in_flight.data(), entry.send_in_flight.size());
+
+        io_uring_sqe* sqe = AcquireSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(entry.send_in_flight.data());
+        sqe->len = length;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = PackUserData(static_cast<uint8_t>(Operation::kSend), generation, slot);
+        entry.send_pending = true;
+        ++in_flight;
+    }
+}
+
+void UringEventLoop::HandleCompletion(const io_uring_cqe& cqe) {
+    auto operation = static_cast<Operation>(cqe.user_data >> 56);
+
+    switch (operation) {
+        case Operation::kWake:
+            wake_pending = false;
+            DrainWakeFd();
+            return;
+
+        case Operation::kTimeout:
+            timeout_pending = false;
+            return;
+
+        case Operation::kProvideBuffers:
+            if (cqe.res < 0) {
+                std::cerr << "Failed to return receive buffer: " << strerror(-cqe.res) << std::endl;
+            }
+            return;
+
+        default:
+            break;
+    }
+
+    --in_flight;
+    size_t slot = static_cast<uint32_t>(cqe.user_data);
+    uint64_t generation = (cqe.user_data >> 32) & 0xFFFFFF;
+    if (slot >= entries.size()) {
+        return;
+    }
+
+    Entry& entry = entries[slot];
+    PeerConnect& peer = *entry.peer;
+    bool is_current = (peer.GetSocketGeneration() & 0xFFFFFF) == generation && peer.GetFd() != -1;
+
+    try {
+        switch (operation) {
+            case Operation::kPoll:
+                entry.poll_pending = false;
+                if (is_current) {
+                    peer.OnWritable();
+                }
+                break;
+
+            case Operation::kReceive: {
+                entry.receive_pending = false;
+                bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+                uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+                if (is_current) {
+                    if (cqe.res > 0 && has_buffer) {
+                        peer.GetSocket().AppendReceived(BufferAt(buffer_id), cqe.res);
+                        peer.OnDataReceived();
+                    } else if (cqe.res == 0) {
+                        peer.OnSocketError("Connection closed by peer");
+                    } else if (cqe.res == -ENOBUFS) {
+                        // Every buffer was taken by completions that are not
+                        // re-provided yet; retry on the next tick.
+                        receive_starved = true;
+                    } else if (cqe.res < 0 && cqe.res != -EINTR && cqe.res != -EAGAIN) {
+                        peer.OnSocketError("Read error: " + std::string(strerror(-cqe.res)));
+                    }
+                }
+                if (has_buffer) {
+                    ProvideBuffer(buffer_id);
+                }
+                break;
+            }
+
+            case Operation::kSend:
+                entry.send_pending = false;
+                if (is_current) {
+                    if (cqe.res >= 0) {
+                        peer.GetSocket().ConsumeSent(cqe.res);
+                    } else if (cqe.res != -EINTR && cqe.res != -EAGAIN) {
+                        peer.OnSocketError("Send error: " + std::string(strerror(-cqe.res)));
+                    }
+                }
+                std::vector<char>().swap(entry.send_in_flight);
+                break;
+
+            default:
+                break;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled peer error: " << e.what() << std::endl;
+    }
+
+    Arm(slot);
+}
+
+void UringEventLoop::TickAll() {
+    auto now = std::chrono::steady_clock::now();
+    size_t live_peers = 0;
+    receive_starved = false;
+
+    for (size_t slot = 0; slot < entries.size(); ++slot) {
+        PeerConnect& peer = *entries[slot].peer;
+        if (peer.IsTerminated()) {
+            continue;
+        }
+
+        try {
+            peer.OnTick(now);
+        } catch (const std::exception& e) {
+            std::cerr << "Unhandled peer error: " << e.what() << std::endl;
+        }
+        Arm(slot);
+        live_peers += peer.IsTerminated() ? 0 : 1;
+    }
+
+    SetLivePeerCount(live_peers);
+}
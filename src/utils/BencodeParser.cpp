@@ -1,6 +1,7 @@
 #include "utils/BencodeParser.hpp"
 #include "utils/byte_tools.hpp"
 #include <iostream>
+#include <stdexcept>
 
 std::string utils::BencodeParser::ReadFixedAmount(int amount) {
     std::string result = to_decode.substr(index, amount);
@@ -61,6 +62,12 @@ void utils::BencodeParser::ProcessDict() {
                 start_index = index;
                 flag = true;
             }
+            // The flat token list loses where one file's path ends and
+            // the next file begins, so the file list is read on its own.
+            if (key_name == "files" && to_decode[index] == 'l') {
+                ProcessFileList();
+                key_name.clear();
+            }
         }
 
         else {
@@ -93,6 +100,41 @@ void utils::BencodeParser::ProcessList() {
     ++index;
 }
 
+void utils::BencodeParser::ProcessFileList() {
+    ++index;
+    while (to_decode[index] != 'e') {
+        if (to_decode[index] != 'd') {
+            throw std::runtime_error("bencode: a file list entry is not a dictionary");
+        }
+        ++index;
+        FileEntry entry;
+        while (to_decode[index] != 'e') {
+            std::string key = ReadFixedAmount(stoi(ReadUntilDelimiter(':')));
+            if (key == "length" && to_decode[index] == 'i') {
+                ++index;
+                entry.length = std::stoull(ReadUntilDelimiter('e'));
+            } else if (key == "path" && to_decode[index] == 'l') {
+                ++index;
+                while (to_decode[index] != 'e') {
+                    entry.path.push_back(ReadFixedAmount(stoi(ReadUntilDelimiter(':'))));
+                }
+                ++index;
+            } else {
+                SkipValue();
+            }
+        }
+        ++index;
+        files.push_back(std::move(entry));
+    }
+    ++index;
+}
+
+void utils::BencodeParser::SkipValue() {
+    size_t parsed_count = parsed.size();
+    Process();
+    parsed.resize(parsed_count);
+}
+
 utils::BencodeParser::BencodeParser() : index(0) {}
 
 std::vector<std::string> utils::BencodeParser::ParseFromFile(const std::string& filename) {
@@ -118,6 +160,10 @@ std::string utils::BencodeParser::GetHash() {
     return info_hash;
 }
 
+std::vector<utils::BencodeParser::FileEntry> utils::BencodeParser::GetFiles() {
+    return files;
+}
+
 std::vector<std::string> utils::BencodeParser::GetPieceHashes() {
     for (size_t i = 0; i < parsed.size(); ++i) {
         if (parsed[i] == "pieces" && i + 1 < parsed.size()) {
@@ -0,0 +1,71 @@
+#include "utils/BufferPool.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+std::shared_ptr<utils::BufferPool> utils::BufferPool::Create(size_t buffer_size, size_t max_idle_buffers) {
+    std::shared_ptr<BufferPool> pool(new BufferPool(buffer_size, max_idle_buffers));
+    pool->self = pool;
+    return pool;
+}
+
+utils::BufferPool::BufferPool(size_t buffer_size, size_t max_idle_buffers)
+    : buffer_size(buffer_size)
+    , allocation_size((std::max<size_t>(1, buffer_size) + kAlignment - 1) / kAlignment * kAlignment)
+    , max_idle_buffers(max_idle_buffers) {}
+
+utils::BufferPool::~BufferPool() {
+    for (char* data : idle_buffers) {
+        std::free(data);
+    }
+}
+
+utils::BufferPool::Buffer utils::BufferPool::Acquire() {
+    char* data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!idle_buffers.empty()) {
+            data = idle_buffers.back();
+            idle_buffers.pop_back();
+        } else {
+            ++allocation_count;
+        }
+    }
+
+    if (!data) {
+        data = static_cast<char*>(std::aligned_alloc(kAlignment, allocation_size));
+        if (!data) {
+            throw std::bad_alloc();
+        }
+    }
+    return Buffer(data, Releaser{self.lock()});
+}
+
+void utils::BufferPool::Releaser::operator()(char* data) const {
+    pool->Release(data);
+}
+
+void utils::BufferPool::Release(char* data) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle_buffers.size() < max_idle_buffers) {
+            idle_buffers.push_back(data);
+            return;
+        }
+    }
+    std::free(data);
+}
+
+size_t utils::BufferPool::BufferSize() const {
+    return buffer_size;
+}
+
+size_t utils::BufferPool::IdleCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return idle_buffers.size();
+}
+
+size_t utils::BufferPool::AllocationCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocation_count;
+}
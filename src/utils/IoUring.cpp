@@ -0,0 +1,179 @@
+#include "utils/IoUring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    int SetupRing(unsigned entries, io_uring_params* params) {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    int EnterRing(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    unsigned LoadAcquire(const unsigned* value) {
+        return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+    }
+
+    void StoreRelease(unsigned* target, unsigned value) {
+        __atomic_store_n(target, value, __ATOMIC_RELEASE);
+    }
+
+    template <typename T>
+    T* At(void* base, size_t offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+}
+
+utils::IoUring::IoUring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    ring_fd = SetupRing(entries, &params);
+    if (ring_fd < 0) {
+        throw std::runtime_error("io_uring_setup failed: " + std::string(strerror(errno)));
+    }
+    sq_entries = params.sq_entries;
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        close(ring_fd);
+        throw std::runtime_error("Failed to map io_uring submission ring");
+    }
+
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            munmap(sq_ring, sq_ring_size);
+            close(ring_fd);
+            throw std::runtime_error("Failed to map io_uring completion ring");
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes_memory = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring_fd, IORING_OFF_SQES);
+    if (sqes_memory == MAP_FAILED) {
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        close(ring_fd);
+        throw std::runtime_error("Failed to map io_uring SQE array");
+    }
+    sqes = static_cast<io_uring_sqe*>(sqes_memory);
+
+    sq_head = At<unsigned>(sq_ring, params.sq_off.head);
+    sq_tail = At<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = At<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array = At<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = At<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = At<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = At<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = At<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+    local_sq_tail = *sq_tail;
+}
+
+utils::IoUring::~IoUring() {
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+}
+
+bool utils::IoUring::IsSupported() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = SetupRing(2, &params);
+    if (fd < 0) {
+        return false; // ENOSYS on old kernels, EPERM when disabled by sysctl/seccomp
+    }
+    close(fd);
+    return true;
+}
+
+io_uring_sqe* utils::IoUring::GetSqe() {
+    unsigned head = LoadAcquire(sq_head);
+    if (local_sq_tail - head >= sq_entries) {
+        return nullptr;
+    }
+
+    unsigned index = local_sq_tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++local_sq_tail;
+    return sqe;
+}
+
+int utils::IoUring::Submit(unsigned wait_for) {
+    StoreRelease(sq_tail, local_sq_tail);
+
+    unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result;
+    do {
+        // Anything the kernel has not consumed yet, including entries left
+        // over from an interrupted call.
+        unsigned to_submit = local_sq_tail - LoadAcquire(sq_head);
+        if (to_submit == 0 && wait_for == 0) {
+            return 0;
+        }
+        result = EnterRing(ring_fd, to_submit, wait_for, flags);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+size_t utils::IoUring::ForEachCompletion(const std::function<void(const io_uring_cqe&)>& handler) {
+    size_t count = 0;
+    while (true) {
+        // Re-read the head every time: the handler may reap completions itself.
+        unsigned head = *cq_head;
+        if (head == LoadAcquire(cq_tail)) {
+            break;
+        }
+        io_uring_cqe cqe = cqes[head & *cq_mask];
+        StoreRelease(cq_head, head + 1);
+        handler(cqe);
+        ++count;
+    }
+    return count;
+}
+
+size_t utils::IoUring::DropUnsubmitted(const std::function<void(const io_uring_sqe&)>& handler) {
+    // Without SQPOLL the kernel only consumes entries inside io_uring_enter,
+    // so nothing moves the head while this runs.
+    unsigned head = LoadAcquire(sq_head);
+    for (unsigned tail = head; tail != local_sq_tail; ++tail) {
+        handler(sqes[sq_array[tail & *sq_mask]]);
+    }
+    size_t count = local_sq_tail - head;
+    local_sq_tail = head;
+    StoreRelease(sq_tail, head);
+    return count;
+}
+
+unsigned utils::IoUring::GetSqEntries() const {
+    return sq_entries;
+}
@@ -0,0 +1,56 @@
+#include "utils/PositionalWrite.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+
+bool utils::WriteAt(int fd, uint64_t offset, std::vector<iovec>& vectors) {
+    size_t first = 0;
+    while (first < vectors.size()) {
+        if (vectors[first].iov_len == 0) {
+            ++first;
+            continue;
+        }
+        int count = static_cast<int>(std::min<size_t>(vectors.size() - first, IOV_MAX));
+        ssize_t written = pwritev(fd, vectors.data() + first, count, static_cast<off_t>(offset));
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            if (written == 0) {
+                errno = 0;
+            }
+            return false;
+        }
+        offset += static_cast<uint64_t>(written);
+        for (size_t left = static_cast<size_t>(written); left > 0;) {
+            size_t step = std::min(left, vectors[first].iov_len);
+            vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + step;
+            vectors[first].iov_len -= step;
+            left -= step;
+            if (vectors[first].iov_len == 0) {
+                ++first;
+            }
+        }
+    }
+    return true;
+}
+
+bool utils::ReadAt(int fd, uint64_t offset, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t count = pread(fd, data, length, static_cast<off_t>(offset));
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            if (count == 0) {
+                errno = 0;
+            }
+            return false;
+        }
+        offset += static_cast<uint64_t>(count);
+        data += count;
+        length -= static_cast<size_t>(count);
+    }
+    return true;
+}
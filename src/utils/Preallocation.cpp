@@ -0,0 +1,106 @@
+#include "utils/Preallocation.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    std::runtime_error SystemError(const std::string& what, int error) {
+        return std::runtime_error(what + ": " + strerror(error));
+    }
+}
+
+const char* utils::GetPreallocationModeName(PreallocationMode mode) {
+    switch (mode) {
+        case PreallocationMode::kNone:
+            return "none";
+        case PreallocationMode::kSparse:
+            return "sparse";
+        case PreallocationMode::kFull:
+            return "full";
+    }
+    return "unknown";
+}
+
+utils::PreallocationMode utils::ParsePreallocationMode(const std::string& name) {
+    for (PreallocationMode mode : {PreallocationMode::kNone, PreallocationMode::kSparse, PreallocationMode::kFull}) {
+        if (name == GetPreallocationModeName(mode)) {
+            return mode;
+        }
+    }
+    throw std::invalid_argument("Unknown preallocation mode: " + name);
+}
+
+void utils::CheckFreeSpace(const std::filesystem::path& file, uint64_t length) {
+    CheckFreeSpace({{file, length}});
+}
+
+// A sparse file only occupies the blocks written so far, so st_blocks
+// rather than the size says how much more it needs.
+void utils::CheckFreeSpace(const std::vector<std::pair<std::filesystem::path, uint64_t>>& files) {
+    if (files.empty()) {
+        return;
+    }
+    uint64_t needed = 0;
+    for (const auto& [file, length] : files) {
+        uint64_t allocated = 0;
+        struct stat file_stat;
+        if (stat(file.c_str(), &file_stat) == 0) {
+            allocated = static_cast<uint64_t>(file_stat.st_blocks) * 512;
+        }
+        needed += length > allocated ? length - allocated : 0;
+    }
+    if (needed == 0) {
+        return;
+    }
+
+    std::filesystem::path directory = files.front().first.parent_path();
+    while (!directory.empty() && !std::filesystem::exists(directory)) {
+        directory = directory.parent_path();
+    }
+    if (directory.empty()) {
+        directory = ".";
+    }
+    uint64_t available = std::filesystem::space(directory).available;
+    if (available < needed) {
+        std::string what = files.size() == 1 ? files.front().first.string()
+                                              : std::to_string(files.size()) + " files";
+        throw std::runtime_error("Not enough free space for " + what + ": " + std::to_string(needed) +
+                                 " bytes needed, " + std::to_string(available) + " available");
+    }
+}
+
+void utils::PreallocateFile(int fd, uint64_t length, PreallocationMode mode) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        throw SystemError("fstat failed", errno);
+    }
+    uint64_t size = static_cast<uint64_t>(file_stat.st_size);
+
+    switch (mode) {
+        case PreallocationMode::kNone:
+            return;
+        case PreallocationMode::kSparse:
+            if (size < length && ftruncate(fd, static_cast<off_t>(length)) == -1) {
+                throw SystemError("ftruncate failed", errno);
+            }
+            return;
+        case PreallocationMode::kFull:
+            if (length == 0) {
+                return;
+            }
+            if (fallocate(fd, 0, 0, static_cast<off_t>(length)) == 0) {
+                return;
+            }
+            if (errno != EOPNOTSUPP) {
+                throw SystemError("fallocate failed", errno);
+            }
+            // posix_fallocate returns the error instead of setting errno.
+            if (int error = posix_fallocate(fd, 0, static_cast<off_t>(length)); error != 0) {
+                throw SystemError("posix_fallocate failed", error);
+            }
+            return;
+    }
+}
@@ -0,0 +1,77 @@
+#include "utils/RingBuffer.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+utils::RingBuffer::RingBuffer(size_t initial_capacity)
+    : storage(initial_capacity) {}
+
+void utils::RingBuffer::Reserve(size_t size) {
+    if (WritableSize() >= size) {
+        return;
+    }
+
+    size_t used = Size();
+    if (read_position > 0) {
+        std::memmove(storage.data(), storage.data() + read_position, used);
+        read_position = 0;
+        write_position = used;
+    }
+    if (storage.size() - write_position < size) {
+        storage.resize(std::max(storage.size() * 2, used + size));
+    }
+}
+
+char* utils::RingBuffer::WritePointer() {
+    return storage.data() + write_position;
+}
+
+size_t utils::RingBuffer::WritableSize() const {
+    return storage.size() - write_position;
+}
+
+void utils::RingBuffer::Commit(size_t size) {
+    if (size > WritableSize()) {
+        throw std::out_of_range("RingBuffer: commit past reserved space");
+    }
+    write_position += size;
+}
+
+void utils::RingBuffer::Append(const char* data, size_t size) {
+    Reserve(size);
+    std::memcpy(WritePointer(), data, size);
+    write_position += size;
+}
+
+std::string_view utils::RingBuffer::Peek() const {
+    return std::string_view(storage.data() + read_position, Size());
+}
+
+void utils::RingBuffer::Consume(size_t size) {
+    if (size > Size()) {
+        throw std::out_of_range("RingBuffer: consume past written data");
+    }
+    read_position += size;
+    if (read_position == write_position) {
+        // Empty again: start over at the front so the next read needs no move.
+        read_position = 0;
+        write_position = 0;
+    }
+}
+
+size_t utils::RingBuffer::Size() const {
+    return write_position - read_position;
+}
+
+bool utils::RingBuffer::IsEmpty() const {
+    return read_position == write_position;
+}
+
+size_t utils::RingBuffer::Capacity() const {
+    return storage.size();
+}
+
+void utils::RingBuffer::Clear() {
+    read_position = 0;
+    write_position = 0;
+}
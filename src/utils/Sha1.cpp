@@ -0,0 +1,36 @@
+#include "utils/Sha1.hpp"
+#include <openssl/evp.h>
+#include <stdexcept>
+
+utils::Sha1::Sha1()
+    : context(EVP_MD_CTX_new()) {
+    if (!context) {
+        throw std::runtime_error("Failed to allocate a SHA-1 context");
+    }
+    Reset();
+}
+
+utils::Sha1::~Sha1() {
+    EVP_MD_CTX_free(context);
+}
+
+void utils::Sha1::Update(std::string_view data) {
+    if (EVP_DigestUpdate(context, data.data(), data.size()) != 1) {
+        throw std::runtime_error("SHA-1 update failed");
+    }
+}
+
+std::string utils::Sha1::Finalize() {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (EVP_DigestFinal_ex(context, digest, &size) != 1) {
+        throw std::runtime_error("SHA-1 finalization failed");
+    }
+    return std::string(reinterpret_cast<char*>(digest), size);
+}
+
+void utils::Sha1::Reset() {
+    if (EVP_DigestInit_ex(context, EVP_sha1(), nullptr) != 1) {
+        throw std::runtime_error("SHA-1 initialization failed");
+    }
+}
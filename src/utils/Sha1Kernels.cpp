@@ -0,0 +1,480 @@
+#include "utils/Sha1Kernels.hpp"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TORRENT_SHA1_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+    constexpr size_t kBlockSize = 64;
+    constexpr size_t kDigestSize = 20;
+    constexpr uint32_t kInitialState[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    constexpr uint32_t kRoundConstants[4] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+
+    uint32_t LoadBigEndian(const uint8_t* bytes) {
+        return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+    }
+
+    void StoreDigest(const uint32_t* state, size_t stride, std::string& digest) {
+        digest.resize(kDigestSize);
+        for (size_t i = 0; i < 5; ++i) {
+            uint32_t word = state[i * stride];
+            digest[4 * i] = static_cast<char>(word >> 24);
+            digest[4 * i + 1] = static_cast<char>(word >> 16);
+            digest[4 * i + 2] = static_cast<char>(word >> 8);
+            digest[4 * i + 3] = static_cast<char>(word);
+        }
+    }
+
+    // The last partial block of a message with the padding and bit length
+    // appended: one or two blocks.
+    struct Tail {
+        uint8_t bytes[2 * kBlockSize];
+        size_t block_count;
+
+        explicit Tail(std::string_view message) {
+            size_t full = message.size() / kBlockSize * kBlockSize;
+            size_t rest = message.size() - full;
+            block_count = rest + 9 <= kBlockSize ? 1 : 2;
+            std::memset(bytes, 0, sizeof(bytes));
+            std::memcpy(bytes, message.data() + full, rest);
+            bytes[rest] = 0x80;
+            uint64_t bits = uint64_t(message.size()) * 8;
+            uint8_t* end = bytes + block_count * kBlockSize;
+            for (size_t i = 1; i <= 8; ++i, bits >>= 8) {
+                end[-static_cast<ptrdiff_t>(i)] = static_cast<uint8_t>(bits);
+            }
+        }
+    };
+
+    void CompressScalar(uint32_t* state, const uint8_t* data, size_t block_count) {
+        for (; block_count > 0; --block_count, data += kBlockSize) {
+            uint32_t w[80];
+            for (size_t t = 0; t < 16; ++t) {
+                w[t] = LoadBigEndian(data + 4 * t);
+            }
+            for (size_t t = 16; t < 80; ++t) {
+                uint32_t x = w[t - 3] ^ w[t - 8] ^ w[t - 14] ^ w[t - 16];
+                w[t] = (x << 1) | (x >> 31);
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+            auto round = [&](size_t t, uint32_t f) {
+                uint32_t temp = ((a << 5) | (a >> 27)) + f + e + kRoundConstants[t / 20] + w[t];
+                e = d;
+                d = c;
+                c = (b << 30) | (b >> 2);
+                b = a;
+                a = temp;
+            };
+            for (size_t t = 0; t < 20; ++t) {
+                round(t, d ^ (b & (c ^ d)));
+            }
+            for (size_t t = 20; t < 40; ++t) {
+                round(t, b ^ c ^ d);
+            }
+            for (size_t t = 40; t < 60; ++t) {
+                round(t, (b & c) | (d & (b | c)));
+            }
+            for (size_t t = 60; t < 80; ++t) {
+                round(t, b ^ c ^ d);
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+        }
+    }
+
+    // One message at a time through a compression function that takes a run
+    // of whole blocks.
+    template <void (*Compress)(uint32_t*, const uint8_t*, size_t)>
+    void HashEach(const std::string_view* messages, size_t count, std::string* digests) {
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t state[5];
+            std::memcpy(state, kInitialState, sizeof(state));
+            Compress(state, reinterpret_cast<const uint8_t*>(messages[i].data()), messages[i].size() / kBlockSize);
+            Tail tail(messages[i]);
+            Compress(state, tail.bytes, tail.block_count);
+            StoreDigest(state, 1, digests[i]);
+        }
+    }
+
+    // Feeds up to kLanes messages to a SIMD compression function that runs
+    // one block of each lane per call. A lane that finishes its message
+    // takes the next one, so messages of different lengths keep every lane
+    // busy until the batch runs out; idle lanes hash a dummy block.
+    template <size_t kLanes, void (*Compress)(uint32_t (*)[kLanes], const uint8_t* const*)>
+    void HashInterleaved(const std::string_view* messages, size_t count, std::string* digests) {
+        struct Lane {
+            size_t message = 0;
+            const uint8_t* data = nullptr;
+            size_t full_blocks = 0;
+            size_t tail_blocks = 0;
+            size_t tail_position = 0;
+            Tail tail{std::string_view()};
+            bool active = false;
+        };
+
+        static const uint8_t kIdleBlock[kBlockSize] = {};
+        uint32_t state[5][kLanes];
+        const uint8_t* blocks[kLanes];
+        Lane lanes[kLanes];
+        size_t next = 0;
+        size_t active = 0;
+
+        auto start = [&](size_t l) {
+            Lane& lane = lanes[l];
+            if (next == count) {
+                lane.active = false;
+                return;
+            }
+            lane.message = next++;
+            std::string_view message = messages[lane.message];
+            lane.data = reinterpret_cast<const uint8_t*>(message.data());
+            lane.full_blocks = message.size() / kBlockSize;
+            lane.tail = Tail(message);
+            lane.tail_blocks = lane.tail.block_count;
+            lane.tail_position = 0;
+            lane.active = true;
+            for (size_t i = 0; i < 5; ++i) {
+                state[i][l] = kInitialState[i];
+            }
+        };
+
+        for (size_t l = 0; l < kLanes; ++l) {
+            start(l);
+            active += lanes[l].active;
+        }
+        while (active > 0) {
+            for (size_t l = 0; l < kLanes; ++l) {
+                const Lane& lane = lanes[l];
+                if (!lane.active) {
+                    blocks[l] = kIdleBlock;
+                } else if (lane.full_blocks > 0) {
+                    blocks[l] = lane.data;
+                } else {
+                    blocks[l] = lane.tail.bytes + lane.tail_position * kBlockSize;
+                }
+            }
+            Compress(state, blocks);
+            for (size_t l = 0; l < kLanes; ++l) {
+                Lane& lane = lanes[l];
+                if (!lane.active) {
+                    continue;
+                }
+                if (lane.full_blocks > 0) {
+                    --lane.full_blocks;
+                    lane.data += kBlockSize;
+                    continue;
+                }
+                if (++lane.tail_position < lane.tail_blocks) {
+                    continue;
+                }
+                StoreDigest(&state[0][l], kLanes, digests[lane.message]);
+                start(l);
+                active -= !lane.active;
+            }
+        }
+    }
+
+#ifdef TORRENT_SHA1_X86
+    // The instruction sequence from Intel's SHA extensions reference: 20
+    // groups of four rounds, each also advancing the message schedule.
+    template <int kGroup>
+    __attribute__((target("sha,sse4.1"), always_inline)) inline void ShaNiGroup(
+        __m128i& abcd, __m128i& e0, __m128i& e1, __m128i (&msg)[4], const uint8_t* data) {
+        constexpr int kCurrent = kGroup % 4;
+        __m128i& e_in = kGroup % 2 == 0 ? e0 : e1;
+        __m128i& e_out = kGroup % 2 == 0 ? e1 : e0;
+        if constexpr (kGroup < 4) {
+            const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+            msg[kCurrent] = _mm_shuffle_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * kGroup)), byte_swap);
+        }
+        if constexpr (kGroup == 0) {
+            e_in = _mm_add_epi32(e_in, msg[kCurrent]);
+        } else {
+            e_in = _mm_sha1nexte_epu32(e_in, msg[kCurrent]);
+        }
+        e_out = abcd;
+        if constexpr (kGroup >= 3 && kGroup <= 18) {
+            msg[(kGroup + 1) % 4] = _mm_sha1msg2_epu32(msg[(kGroup + 1) % 4], msg[kCurrent]);
+        }
+        abcd = _mm_sha1rnds4_epu32(abcd, e_in, kGroup / 5);
+        if constexpr (kGroup >= 1 && kGroup <= 16) {
+            msg[(kGroup + 3) % 4] = _mm_sha1msg1_epu32(msg[(kGroup + 3) % 4], msg[kCurrent]);
+        }
+        if constexpr (kGroup >= 2 && kGroup <= 17) {
+            msg[(kGroup + 2) % 4] = _mm_xor_si128(msg[(kGroup + 2) % 4], msg[kCurrent]);
+        }
+    }
+
+    template <int... kGroups>
+    __attribute__((target("sha,sse4.1"), always_inline)) inline void ShaNiRounds(
+        __m128i& abcd, __m128i& e0, __m128i& e1, __m128i (&msg)[4], const uint8_t* data,
+        std::integer_sequence<int, kGroups...>) {
+        (ShaNiGroup<kGroups>(abcd, e0, e1, msg, data), ...);
+    }
+
+    __attribute__((target("sha,sse4.1"))) void CompressShaNi(uint32_t* state, const uint8_t* data,
+                                                             size_t block_count) {
+        __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+        __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+        for (; block_count > 0; --block_count, data += kBlockSize) {
+            __m128i abcd_saved = abcd;
+            __m128i e0_saved = e0;
+            __m128i e1;
+            __m128i msg[4];
+            ShaNiRounds(abcd, e0, e1, msg, data, std::make_integer_sequence<int, 20>());
+            e0 = _mm_sha1nexte_epu32(e0, e0_saved);
+            abcd = _mm_add_epi32(abcd, abcd_saved);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+        state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+    }
+
+    template <int kBits>
+    __attribute__((target("avx2"), always_inline)) inline __m256i RotateLeft(__m256i x) {
+        return _mm256_or_si256(_mm256_slli_epi32(x, kBits), _mm256_srli_epi32(x, 32 - kBits));
+    }
+
+    // Eight lanes of 32-bit words; the message words are gathered straight
+    // from the eight block pointers.
+    __attribute__((target("avx2"))) void CompressAvx2(uint32_t (*state)[8], const uint8_t* const* blocks) {
+        const __m256i byte_swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                                   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        const __m256i addresses_low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks));
+        const __m256i addresses_high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blocks + 4));
+
+        __m256i w[16];
+        for (int t = 0; t < 16; ++t) {
+            const __m256i offset = _mm256_set1_epi64x(4 * t);
+            __m128i low = _mm256_i64gather_epi32(nullptr, _mm256_add_epi64(addresses_low, offset), 1);
+            __m128i high = _mm256_i64gather_epi32(nullptr, _mm256_add_epi64(addresses_high, offset), 1);
+            w[t] = _mm256_shuffle_epi8(_mm256_set_m128i(high, low), byte_swap);
+        }
+
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[0]));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[1]));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[2]));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[3]));
+        __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[4]));
+        const __m256i a_saved = a, b_saved = b, c_saved = c, d_saved = d, e_saved = e;
+
+        for (int t = 0; t < 80; ++t) {
+            if (t >= 16) {
+                w[t & 15] = RotateLeft<1>(_mm256_xor_si256(
+                    _mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),
+                    _mm256_xor_si256(w[(t - 14) & 15], w[t & 15])));
+            }
+            __m256i f;
+            if (t < 20) {
+                f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            } else if (t < 40 || t >= 60) {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            } else {
+                f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            }
+            __m256i temp = _mm256_add_epi32(
+                _mm256_add_epi32(RotateLeft<5>(a), f),
+                _mm256_add_epi32(_mm256_add_epi32(e, w[t & 15]),
+                                 _mm256_set1_epi32(static_cast<int>(kRoundConstants[t / 20]))));
+            e = d;
+            d = c;
+            c = RotateLeft<30>(b);
+            b = a;
+            a = temp;
+        }
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[0]), _mm256_add_epi32(a, a_saved));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[1]), _mm256_add_epi32(b, b_saved));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[2]), _mm256_add_epi32(c, c_saved));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[3]), _mm256_add_epi32(d, d_saved));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[4]), _mm256_add_epi32(e, e_saved));
+    }
+
+    // Sixteen lanes; the round functions are single ternary-logic ops. GCC's
+    // AVX-512 headers trip its own uninitialized-variable warnings.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+    __attribute__((target("avx512f,avx512bw"))) void CompressAvx512(uint32_t (*state)[16],
+                                                                    const uint8_t* const* blocks) {
+        const __m512i byte_swap = _mm512_broadcast_i32x4(
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+        const __m512i addresses_low = _mm512_loadu_si512(blocks);
+        const __m512i addresses_high = _mm512_loadu_si512(blocks + 8);
+
+        __m512i w[16];
+        for (int t = 0; t < 16; ++t) {
+            const __m512i offset = _mm512_set1_epi64(4 * t);
+            __m256i low = _mm512_i64gather_epi32(_mm512_add_epi64(addresses_low, offset), nullptr, 1);
+            __m256i high = _mm512_i64gather_epi32(_mm512_add_epi64(addresses_high, offset), nullptr, 1);
+            w[t] = _mm512_shuffle_epi8(_mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1), byte_swap);
+        }
+
+        __m512i a = _mm512_loadu_si512(state[0]);
+        __m512i b = _mm512_loadu_si512(state[1]);
+        __m512i c = _mm512_loadu_si512(state[2]);
+        __m512i d = _mm512_loadu_si512(state[3]);
+        __m512i e = _mm512_loadu_si512(state[4]);
+        const __m512i a_saved = a, b_saved = b, c_saved = c, d_saved = d, e_saved = e;
+
+        for (int t = 0; t < 80; ++t) {
+            if (t >= 16) {
+                w[t & 15] = _mm512_rol_epi32(
+                    _mm512_ternarylogic_epi32(w[(t - 3) & 15], w[(t - 8) & 15],
+                                              _mm512_xor_si512(w[(t - 14) & 15], w[t & 15]), 0x96),
+                    1);
+            }
+            __m512i f;
+            if (t < 20) {
+                f = _mm512_ternarylogic_epi32(b, c, d, 0xCA); // b ? c : d
+            } else if (t < 40 || t >= 60) {
+                f = _mm512_ternarylogic_epi32(b, c, d, 0x96); // b ^ c ^ d
+            } else {
+                f = _mm512_ternarylogic_epi32(b, c, d, 0xE8); // majority
+            }
+            __m512i temp = _mm512_add_epi32(
+                _mm512_add_epi32(_mm512_rol_epi32(a, 5), f),
+                _mm512_add_epi32(_mm512_add_epi32(e, w[t & 15]),
+                                 _mm512_set1_epi32(static_cast<int>(kRoundConstants[t / 20]))));
+            e = d;
+            d = c;
+            c = _mm512_rol_epi32(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        _mm512_storeu_si512(state[0], _mm512_add_epi32(a, a_saved));
+        _mm512_storeu_si512(state[1], _mm512_add_epi32(b, b_saved));
+        _mm512_storeu_si512(state[2], _mm512_add_epi32(c, c_saved));
+        _mm512_storeu_si512(state[3], _mm512_add_epi32(d, d_saved));
+        _mm512_storeu_si512(state[4], _mm512_add_epi32(e, e_saved));
+    }
+#pragma GCC diagnostic pop
+
+    struct CpuFeatures {
+        bool sha = false;
+        bool avx2 = false;
+        bool avx512 = false;
+
+        CpuFeatures() {
+            unsigned int eax, ebx, ecx, edx;
+            if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return;
+            }
+            bool ssse3 = ecx & bit_SSSE3;
+            bool sse41 = ecx & bit_SSE4_1;
+            bool osxsave = ecx & bit_OSXSAVE;
+            if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+                return;
+            }
+            sha = (ebx & bit_SHA) && ssse3 && sse41;
+
+            // The wide registers are only usable if the OS saves them.
+            if (!osxsave) {
+                return;
+            }
+            uint32_t xcr0_low, xcr0_high;
+            __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+            bool ymm_enabled = (xcr0_low & 0x6) == 0x6;
+            bool zmm_enabled = (xcr0_low & 0xE6) == 0xE6;
+            avx2 = ymm_enabled && (ebx & bit_AVX2);
+            avx512 = zmm_enabled && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW);
+        }
+    };
+
+    const CpuFeatures& GetCpuFeatures() {
+        static const CpuFeatures features;
+        return features;
+    }
+#endif
+}
+
+const char* utils::GetSha1KernelName(Sha1Kernel kernel) {
+    switch (kernel) {
+        case Sha1Kernel::kScalar:
+            return "scalar";
+        case Sha1Kernel::kShaNi:
+            return "sha-ni";
+        case Sha1Kernel::kAvx2:
+            return "avx2 x8";
+        case Sha1Kernel::kAvx512:
+            return "avx512 x16";
+    }
+    return "unknown";
+}
+
+bool utils::IsSha1KernelSupported(Sha1Kernel kernel) {
+#ifdef TORRENT_SHA1_X86
+    const CpuFeatures& features = GetCpuFeatures();
+    switch (kernel) {
+        case Sha1Kernel::kScalar:
+            return true;
+        case Sha1Kernel::kShaNi:
+            return features.sha;
+        case Sha1Kernel::kAvx2:
+            return features.avx2;
+        case Sha1Kernel::kAvx512:
+            return features.avx512;
+    }
+    return false;
+#else
+    return kernel == Sha1Kernel::kScalar;
+#endif
+}
+
+// A multi-buffer kernel with its lanes mostly full outruns SHA-NI hashing
+// the same messages one by one, and a half-empty one does not; SHA-NI is
+// the fastest way to hash a short batch.
+utils::Sha1Kernel utils::GetBestSha1Kernel(size_t batch_size) {
+    constexpr size_t kMinMultiBufferBatch = 8;
+    if (batch_size >= kMinMultiBufferBatch && IsSha1KernelSupported(Sha1Kernel::kAvx512)) {
+        return Sha1Kernel::kAvx512;
+    }
+    if (IsSha1KernelSupported(Sha1Kernel::kShaNi)) {
+        return Sha1Kernel::kShaNi;
+    }
+    if (batch_size >= kMinMultiBufferBatch && IsSha1KernelSupported(Sha1Kernel::kAvx2)) {
+        return Sha1Kernel::kAvx2;
+    }
+    return Sha1Kernel::kScalar;
+}
+
+void utils::CalculateSHA1Many(const std::string_view* messages, size_t count, std::string* digests) {
+    CalculateSHA1Many(GetBestSha1Kernel(count), messages, count, digests);
+}
+
+void utils::CalculateSHA1Many(Sha1Kernel kernel, const std::string_view* messages, size_t count,
+                              std::string* digests) {
+    if (!IsSha1KernelSupported(kernel)) {
+        throw std::runtime_error(std::string("SHA-1 kernel not supported on this CPU: ") + GetSha1KernelName(kernel));
+    }
+    switch (kernel) {
+        case Sha1Kernel::kScalar:
+            HashEach<CompressScalar>(messages, count, digests);
+            return;
+#ifdef TORRENT_SHA1_X86
+        case Sha1Kernel::kShaNi:
+            HashEach<CompressShaNi>(messages, count, digests);
+            return;
+        case Sha1Kernel::kAvx2:
+            HashInterleaved<8, CompressAvx2>(messages, count, digests);
+            return;
+        case Sha1Kernel::kAvx512:
+            HashInterleaved<16, CompressAvx512>(messages, count, digests);
+            return;
+#else
+        default:
+            return;
+#endif
+    }
+}
@@ -24,7 +24,7 @@ std::string utils::IntToBytes(int value) {
     return result;
 }
 
-std::string utils::CalculateSHA1(const std::string& msg) {
+std::string utils::CalculateSHA1(std::string_view msg) {
     unsigned char hash[SHA_DIGEST_LENGTH];
     SHA1(reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), hash);
 